@@ -0,0 +1,279 @@
+//
+// Benchmark harness for the codec: reports what initialization costs in
+// time, resident memory and page faults, then encoding throughput on a
+// corpus and on copies of it with a growing share of random bytes.
+//
+// The time of every stage can be saved and a later run compared with it,
+// which is how the PGO build is measured against the plain release build:
+//
+//   gpt2_codec_bench -n 5 -o release.json frankenstein.txt
+//   pgo/gpt2_codec_bench -n 5 -c release.json frankenstein.txt
+//
+
+#include "library.h"
+#include "rdtsc.h"
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define MAX_STAGES 8
+
+typedef struct {
+    char name[32];
+    double seconds;              /* the best of the runs */
+} stage_t;
+
+static stage_t stages[MAX_STAGES];
+static size_t numStages = 0;
+static size_t numRuns = 1;
+static const cJSON *baseline = NULL;    /* stage times to compare with */
+
+typedef struct {
+    uint16_t *tokens;
+    size_t numTokens;
+    size_t capacity;
+} tokenBuffer_t;
+
+static long maxRssKB(const struct rusage *usage) {
+#ifdef __APPLE__
+    return usage->ru_maxrss / 1024;
+#else
+    return usage->ru_maxrss;
+#endif
+}
+
+static void collectTokens(const uint16_t *tokens, size_t numTokens,
+                          size_t offset, size_t length, void *ctx) {
+    tokenBuffer_t *buffer = (tokenBuffer_t *) ctx;
+    if (buffer->numTokens + numTokens <= buffer->capacity) {
+        memcpy(buffer->tokens + buffer->numTokens, tokens,
+               numTokens * sizeof(uint16_t));
+    }
+    buffer->numTokens += numTokens;
+}
+
+/* Whether decoding every token gives back exactly `text`. */
+static bool roundTrips(const tokenBuffer_t *buffer, const char *text,
+                       size_t numBytes) {
+    char bytes[MAX_TOKEN_BYTES];
+    size_t pos = 0;
+    if (buffer->numTokens > buffer->capacity) {
+        return false;
+    }
+    for (size_t idx = 0; idx < buffer->numTokens; idx++) {
+        size_t length;
+        if (DecodeTokenBytes(buffer->tokens[idx], bytes, &length) !=
+            CODEC_SUCCESS || pos + length > numBytes ||
+            memcmp(text + pos, bytes, length) != 0) {
+            return false;
+        }
+        pos += length;
+    }
+    return pos == numBytes;
+}
+
+static char *readCorpus(const char *path, size_t *length) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = size > 0 ? malloc(size) : NULL;
+    if (buffer != NULL && fread(buffer, 1, size, f) != (size_t) size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(f);
+    *length = (size_t) size;
+    return buffer;
+}
+
+/*
+ * Overwrites about `perMille` bytes in every thousand with random ones,
+ * most of which break the UTF-8 around them.  Seeded, so runs compare.
+ */
+static void corrupt(char *text, size_t numBytes, unsigned int perMille) {
+    uint64_t state = 0x9E3779B97F4A7C15u;
+    for (size_t idx = 0; idx < numBytes; idx++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if (state % 1000 < perMille) {
+            text[idx] = (char) (state >> 32);
+        }
+    }
+}
+
+static double secondsSince(uint64_t start) {
+    return (RDTSC() - start) / g_TicksPerNanoSec / 1000000000;
+}
+
+/* Records the time of a stage, ending its line with the speedup over the
+   baseline if it has the stage. */
+static void endStage(const char *name, double seconds) {
+    if (numStages < MAX_STAGES) {
+        stage_t *stage = &stages[numStages++];
+        snprintf(stage->name, sizeof(stage->name), "%s", name);
+        stage->seconds = seconds;
+    }
+    const cJSON *before = cJSON_GetObjectItemCaseSensitive(baseline, name);
+    if (cJSON_IsNumber(before) && seconds > 0) {
+        printf(", %.2fx", before->valuedouble / seconds);
+    }
+    printf("\n");
+}
+
+static void benchEncode(const char *corpus, size_t numBytes) {
+    static const unsigned int rates[] = {0, 1, 10, 100, 1000};
+    char *text = malloc(numBytes);
+    tokenBuffer_t buffer = {.capacity = numBytes};
+    buffer.tokens = malloc(numBytes * sizeof(uint16_t));
+    if (text == NULL || buffer.tokens == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(text);
+        free(buffer.tokens);
+        return;
+    }
+    for (size_t idx = 0; idx < sizeof(rates) / sizeof(rates[0]); idx++) {
+        memcpy(text, corpus, numBytes);
+        corrupt(text, numBytes, rates[idx]);
+        enum CODEC_STATUS status = CODEC_SUCCESS;
+        double seconds = 0;
+        for (size_t run = 0; run < numRuns; run++) {
+            buffer.numTokens = 0;
+            uint64_t start = RDTSC();
+            status = EncodeText(text, numBytes, NULL, collectTokens, &buffer);
+            double elapsed = secondsSince(start);
+            if (run == 0 || elapsed < seconds) {
+                seconds = elapsed;
+            }
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "corrupted %.1f%%", rates[idx] / 10.0);
+        printf("%-16s %7.2f MB/s, %.2f bytes/token, %s", name,
+               numBytes / seconds / 1000000,
+               (double) numBytes / buffer.numTokens,
+               status != CODEC_SUCCESS ? "encode failed" :
+               roundTrips(&buffer, text, numBytes) ? "round trip exact" :
+               "ROUND TRIP DIFFERS");
+        endStage(name, seconds);
+    }
+    free(text);
+    free(buffer.tokens);
+}
+
+static bool writeStages(const char *path, const char *corpus) {
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        return false;
+    }
+    cJSON_AddStringToObject(json, "corpus", corpus);
+    cJSON_AddNumberToObject(json, "runs", (double) numRuns);
+    cJSON *seconds = cJSON_AddObjectToObject(json, "seconds");
+    for (size_t idx = 0; idx < numStages; idx++) {
+        cJSON_AddNumberToObject(seconds, stages[idx].name,
+                                stages[idx].seconds);
+    }
+    char *text = cJSON_Print(json);
+    cJSON_Delete(json);
+    FILE *f = text != NULL ? fopen(path, "w") : NULL;
+    bool written = f != NULL && fputs(text, f) >= 0 && fputc('\n', f) != EOF;
+    if (f != NULL && fclose(f) != 0) {
+        written = false;
+    }
+    free(text);
+    return written;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n runs] [-o file] [-c file] [corpus]\n"
+            "  -n  time every stage as the best of this many runs, "
+            "default 1\n"
+            "  -o  save the time of every stage to file as JSON\n"
+            "  -c  print the speedup of every stage over the times saved "
+            "in file\n"
+            "The corpus defaults to frankenstein.txt.\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    const char *savePath = NULL;
+    const char *comparePath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:c:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                numRuns = (size_t) atol(optarg);
+                break;
+            case 'o':
+                savePath = optarg;
+                break;
+            case 'c':
+                comparePath = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (numRuns < 1 || argc - optind > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *path = optind < argc ? argv[optind] : "frankenstein.txt";
+    cJSON *compared = NULL;
+    if (comparePath != NULL) {
+        if (readJson(comparePath, &compared) != CODEC_SUCCESS) {
+            fprintf(stderr, "could not read %s\n", comparePath);
+            return 1;
+        }
+        baseline = cJSON_GetObjectItemCaseSensitive(compared, "seconds");
+    }
+    struct rusage before, after;
+    CalibrateRdtscTicks();
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t start_rdtsc = RDTSC();
+    enum CODEC_STATUS status = InitializeGPT2Codec();
+    double seconds = secondsSince(start_rdtsc);
+    getrusage(RUSAGE_SELF, &after);
+    /* Later runs only count towards the time. */
+    for (size_t run = 1; run < numRuns && status == CODEC_SUCCESS; run++) {
+        ShutdownGPT2Codec();
+        start_rdtsc = RDTSC();
+        status = InitializeGPT2Codec();
+        double elapsed = secondsSince(start_rdtsc);
+        if (elapsed < seconds) {
+            seconds = elapsed;
+        }
+    }
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "InitializeGPT2Codec failed: %d\n", status);
+        return 1;
+    }
+    printf("init: %.2f ms, max rss %ld KB (+%ld KB), "
+           "%ld minor / %ld major page faults",
+           seconds * 1000,
+           maxRssKB(&after),
+           maxRssKB(&after) - maxRssKB(&before),
+           after.ru_minflt - before.ru_minflt,
+           after.ru_majflt - before.ru_majflt);
+    endStage("init", seconds);
+    size_t numBytes;
+    char *corpus = readCorpus(path, &numBytes);
+    if (corpus == NULL) {
+        fprintf(stderr, "could not read %s\n", path);
+    } else {
+        benchEncode(corpus, numBytes);
+        free(corpus);
+    }
+    ShutdownGPT2Codec();
+    cJSON_Delete(compared);
+    if (savePath != NULL && !writeStages(savePath, path)) {
+        fprintf(stderr, "could not write %s\n", savePath);
+        return 1;
+    }
+    return 0;
+}
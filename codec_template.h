@@ -0,0 +1,643 @@
+//
+// Vocabulary tables and the BPE merge engine, written once for every id
+// width.  library.c includes this file with ID_BITS set to 16 and again
+// with 32; each pass defines the functions with that width as a suffix,
+// e.g. toBPE16() and toBPE32(), over the matching types from library.h.
+//
+// The 16 bit instance is the GPT-2 path and keeps its 12 byte slots and
+// 16 bit ranks; the 32 bit one is only used by larger vocabularies.
+//
+
+#if ID_BITS == 16
+#define ID_T uint16_t
+#elif ID_BITS == 32
+#define ID_T uint32_t
+#else
+#error "ID_BITS must be 16 or 32"
+#endif
+
+#define SUFFIX(name) CONCAT(name, ID_BITS)
+#define SLOT_T CONCAT(CONCAT(vocabSlot, ID_BITS), _t)
+#define TABLE_T CONCAT(CONCAT(vocabTable, ID_BITS), _t)
+#define BIGRAM_T CONCAT(CONCAT(rankedBigram, ID_BITS), _t)
+#define TABLE_FIELD CONCAT(t, ID_BITS)
+#define PAIR_SLOT_T CONCAT(CONCAT(pairSlot, ID_BITS), _t)
+#define PAIR_TABLE_T CONCAT(CONCAT(pairTable, ID_BITS), _t)
+#define LANE_T CONCAT(CONCAT(mergeLane, ID_BITS), _t)
+
+/* Rank of a bigram that is not in the merge table, and therefore also the
+   largest rank a vocabulary of this width can hold plus one. */
+#define RANK_NONE ((ID_T) -1)
+
+// ==========================================================================
+// Hashtable
+// ==========================================================================
+
+uint64_t SUFFIX(hashBigram)(BIGRAM_T *item) {
+    if (item->hash) {
+        return item->hash;
+    }
+    item->hash = bigramHash(item->left, item->left_len,
+                            item->right, item->right_len);
+    return item->hash;
+}
+
+bool SUFFIX(vocabTableCreate)(TABLE_T *htab, size_t numEntries) {
+    /* Keep the load factor around 3/4, and the size prime so that the
+       double hashing below steps through every slot. */
+    unsigned int size = (unsigned int) (numEntries + numEntries / 3) | 1;
+    if (size < 3) size = 3;
+    while (!isPrime(size)) size += 2;
+    htab->slots = calloc(size + 1, sizeof(SLOT_T));
+    htab->size = size;
+    htab->filled = 0;
+    return htab->slots != NULL;
+}
+
+static inline bool SUFFIX(slotMatches)(const SLOT_T *slot,
+                                       unsigned int hval,
+                                       const char *strings, const char *left,
+                                       size_t left_len, const char *right,
+                                       size_t right_len) {
+    const char *key = strings + slot->offset;
+    if (slot->hash != hval) {
+        return false;
+    } else if (right == NULL) {
+        return slot->length == left_len &&
+               memcmp(key, left, left_len) == 0;
+    }
+    return slot->length == left_len + 1 + right_len &&
+           memcmp(key, left, left_len) == 0 &&
+           key[left_len] == ' ' &&
+           memcmp(key + left_len + 1, right, right_len) == 0;
+}
+
+/*
+ * Probes `htab` for the key `left` (or the bigram `left right` when `right`
+ * is not NULL).  Returns the index of the matching slot, or of the empty
+ * slot where the key would be inserted.
+ */
+unsigned int SUFFIX(vocabProbe)(const TABLE_T *htab, const char *strings,
+                                unsigned int hval, const char *left,
+                                size_t left_len, const char *right,
+                                size_t right_len, SLOT_T **retval,
+                                unsigned int *numProbes) {
+    SLOT_T *slots = htab->slots;
+    unsigned int idx = hval % htab->size + 1;
+    unsigned int probes = 1;
+
+    if (slots[idx].hash) {
+        if (SUFFIX(slotMatches)(&slots[idx], hval, strings, left, left_len,
+                                right, right_len)) {
+            *retval = &slots[idx];
+            if (numProbes != NULL) *numProbes = probes;
+            return idx;
+        }
+
+        /* Second hash function, as suggested in [Knuth] */
+        unsigned int hval2 = 1 + hval % (htab->size - 2);
+        unsigned int first_idx = idx;
+
+        do {
+            /* Because SIZE is prime this guarantees to step through all
+                   available indeces.  */
+            if (idx <= hval2)
+                idx = htab->size + idx - hval2;
+            else
+                idx -= hval2;
+
+            /* If we visited all entries leave the loop unsuccessfully.  */
+            if (idx == first_idx)
+                break;
+            probes++;
+
+            /* If entry is found use it. */
+            if (SUFFIX(slotMatches)(&slots[idx], hval, strings, left,
+                                    left_len, right, right_len)) {
+                *retval = &slots[idx];
+                if (numProbes != NULL) *numProbes = probes;
+                return idx;
+            }
+        } while (slots[idx].hash);
+    }
+    errno = ESRCH;
+    *retval = NULL;
+    if (numProbes != NULL) *numProbes = probes;
+    return idx;
+}
+
+unsigned int SUFFIX(hashLookup)(BIGRAM_T *item, SLOT_T **retval,
+                                unsigned int *hash, const TABLE_T *htab,
+                                const char *strings, unsigned int *numProbes) {
+    unsigned int hval = SUFFIX(hashBigram)(item);
+    *hash = hval;
+    return SUFFIX(vocabProbe)(htab, strings, hval, item->left,
+                              item->left_len, item->right, item->right_len,
+                              retval, numProbes);
+}
+
+SLOT_T *SUFFIX(tokenLookup)(const codecTables_t *tables, const char *s,
+                            size_t len) {
+    SLOT_T *slot;
+    SUFFIX(vocabProbe)(&tables->toToken.TABLE_FIELD, tables->strings,
+                       genHash(s, len, 0), s, len, NULL, 0, &slot, NULL);
+    return slot;
+}
+
+int SUFFIX(hashInsert)(TABLE_T *htab, const char *strings, unsigned int hval,
+                       uint32_t offset, size_t length, size_t split,
+                       ID_T value) {
+    SLOT_T *slot;
+    const char *key = strings + offset;
+    unsigned int idx = split ?
+            SUFFIX(vocabProbe)(htab, strings, hval, key, split,
+                               key + split + 1, length - split - 1, &slot,
+                               NULL) :
+            SUFFIX(vocabProbe)(htab, strings, hval, key, length, NULL, 0,
+                               &slot, NULL);
+
+    /* Duplicate keys keep their first (lowest) value, and a full table
+       refuses the insert. */
+    if (slot != NULL) {
+        return 1;
+    }
+    if (htab->filled == htab->size) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    htab->slots[idx].hash = hval;
+    htab->slots[idx].offset = offset;
+    htab->slots[idx].length = (uint16_t) length;
+    htab->slots[idx].value = value;
+    ++htab->filled;
+    return 1;
+}
+
+// ==========================================================================
+// Bigram functions
+// ==========================================================================
+
+void SUFFIX(printBigramRepr)(const BIGRAM_T *bigram) {
+    if (bigram->left != NULL) {
+        printf("Rank: %u Left[%zu]: %.*s Right[%zdu]: %.*s\n",
+               (unsigned int) bigram->rank,
+               bigram->left_len, (int) bigram->left_len, bigram->left,
+               bigram->right_len, (int) bigram->right_len, bigram->right);
+    }
+}
+
+void SUFFIX(showBigrams)(BIGRAM_T *bigrams) {
+    printf("====\n");
+    BIGRAM_T *bigram;
+    LL_FOREACH(bigrams, bigram) {
+        SUFFIX(printBigramRepr)(bigram);
+    }
+    printf("====\n");
+}
+
+BIGRAM_T *SUFFIX(rankBigrams)(const codecTables_t *tables,
+                              BIGRAM_T *bigrams, size_t *numDups,
+                              size_t *numBigrams, codecStats_t *stats) {
+    BIGRAM_T *highestBigram = NULL;
+    BIGRAM_T *currBigram = NULL;
+    *numBigrams = 0;
+    *numDups = 0;
+    DL_FOREACH(bigrams, currBigram) {
+        if (currBigram->rank != 0) {
+            if (highestBigram == NULL ||
+                currBigram->rank < highestBigram->rank) {
+                highestBigram = currBigram;
+            } else if (currBigram->hash == highestBigram->hash) {
+                (*numDups)++;
+            }
+            *numBigrams += 1;
+            continue;
+        }
+        *numBigrams += 1;
+        SLOT_T *slot;
+        unsigned int hash = 0;
+        unsigned int probes;
+        SUFFIX(hashLookup)(currBigram, &slot, &hash,
+                           &tables->bpeRanks.TABLE_FIELD, tables->strings,
+                           &probes);
+        if (stats != NULL) {
+            statsCount(stats->probes, probes);
+        }
+        if (slot != NULL) {
+            currBigram->rank = slot->value;
+            currBigram->repr = tables->strings + slot->offset;
+        } else {
+            currBigram->rank = RANK_NONE;
+        }
+        if (highestBigram == NULL ||
+            currBigram->rank < highestBigram->rank) {
+            highestBigram = currBigram;
+        } else if (currBigram->hash == highestBigram->hash) {
+            (*numDups)++;
+        }
+    }
+    //printf("Number of bigrams: %zu\n", *numBigrams);
+    // SUFFIX(showBigrams)(bigrams);
+    return highestBigram;
+}
+
+/*
+ * Links a bigram for every two neighbouring runes of the transcoded word.
+ * The runes stand for bytes, so each is one or two bytes of UTF-8.
+ */
+BIGRAM_T *SUFFIX(initBPE)(BIGRAM_T *bigrams, char *encoded,
+                          const size_t encodedLen) {
+    char *endPtr = encoded + encodedLen;
+    BIGRAM_T *head = NULL;
+    size_t bigrams_ct = 1;
+    bigrams[0].left = encoded;
+    bigrams[0].hash = 0;
+    bigrams[0].repr = NULL;
+    bigrams[0].rank = 0;
+    bigrams[0].prev = NULL;
+    bigrams[0].next = NULL;
+    DL_APPEND(head, &(bigrams[0]));
+
+    size_t runeLen = (unsigned char) *encoded < 0x80 ? 1 : 2;
+    bigrams[0].left_len = runeLen;
+    encoded += runeLen;
+    if (encoded >= endPtr) {
+        bigrams[0].right_len = 0;
+        bigrams[0].right = NULL;
+        return head;
+    } else {
+        runeLen = (unsigned char) *encoded < 0x80 ? 1 : 2;
+        bigrams[0].right = encoded;
+        bigrams[0].right_len = runeLen;
+        encoded += runeLen;
+    }
+    for (; encoded < endPtr;) {
+        DL_APPEND(head, &(bigrams[bigrams_ct]));
+        runeLen = (unsigned char) *encoded < 0x80 ? 1 : 2;
+        bigrams[bigrams_ct].right = encoded;
+        bigrams[bigrams_ct].right_len = runeLen;
+        encoded += runeLen;
+        bigrams[bigrams_ct].rank = 0;
+        bigrams[bigrams_ct].left = bigrams[bigrams_ct - 1].right;
+        bigrams[bigrams_ct].left_len = bigrams[bigrams_ct - 1].right_len;
+        bigrams[bigrams_ct].repr = NULL;
+        bigrams[bigrams_ct].hash = 0;
+        bigrams_ct++;
+    }
+    return head;
+}
+
+bool SUFFIX(mergeNeighboringBigrams)(BIGRAM_T *head, BIGRAM_T *bigram) {
+    BIGRAM_T *prev = bigram->prev;
+    BIGRAM_T *next = bigram->next;
+    if (prev != NULL && bigram != head) {
+        prev->right_len += bigram->right_len;
+        prev->repr = NULL;
+        prev->rank = 0;
+        prev->hash = 0;
+    }
+    if (next != NULL) {
+        next->left -= bigram->left_len;
+        next->left_len += bigram->left_len;
+        next->repr = NULL;
+        next->rank = 0;
+        next->hash = 0;
+    }
+    return true;
+}
+
+
+/*
+ * Resolves a merged token to its id.  Every transcoded byte is a token of
+ * its own, so a miss falls back to one token per byte.
+ */
+size_t SUFFIX(resolveToken)(const codecTables_t *tables, const char *s,
+                            const size_t len, ID_T *tokens) {
+    SLOT_T *slot = SUFFIX(tokenLookup)(tables, s, len);
+    if (slot != NULL) {
+        *tokens = slot->value;
+        return 1;
+    }
+    size_t numTokens = 0;
+    for (size_t idx = 0; idx < len;) {
+        size_t charLen = ((unsigned char) s[idx] < 0x80) ? 1 : 2;
+        slot = SUFFIX(tokenLookup)(tables, s + idx, charLen);
+        if (slot != NULL) {
+            tokens[numTokens++] = slot->value;
+        }
+        idx += charLen;
+    }
+    return numTokens;
+}
+
+// ==========================================================================
+// Lane kernel
+// ==========================================================================
+
+/* The slot holding the pair, or the empty one where it would go. */
+static inline uint32_t SUFFIX(pairProbe)(const PAIR_TABLE_T *pairs,
+                                         ID_T left, ID_T right,
+                                         unsigned int *numProbes) {
+    uint64_t pair = (uint64_t) left << ID_BITS | right;
+    uint32_t idx = (uint32_t) ((pair * 0x9E3779B97F4A7C15u) >> 32) &
+                   pairs->mask;
+    unsigned int probes = 1;
+    while (pairs->slots[idx].rank != 0 && pairs->slots[idx].pair != pair) {
+        idx = (idx + 1) & pairs->mask;
+        probes++;
+    }
+    *numProbes = probes;
+    return idx;
+}
+
+/*
+ * Keys every merge by the ids of its halves.  The kernel only runs on
+ * vocabularies where each byte, each half and each merged token has an
+ * id; anything else is left to the bigram path.  Returns false if out of
+ * memory.
+ */
+bool SUFFIX(buildPairTable)(codecTables_t *tables) {
+    const TABLE_T *ranks = &tables->bpeRanks.TABLE_FIELD;
+    PAIR_TABLE_T *pairs = &tables->bpePairs.TABLE_FIELD;
+    for (unsigned int byte = 0; byte < 256; byte++) {
+        char rune[2];
+        uint16_t point = tables->bytesToUnicode[byte];
+        size_t runeLen = point < 0x80 ? 1 : 2;
+        if (runeLen == 1) {
+            rune[0] = (char) point;
+        } else {
+            rune[0] = (char) (0xC0 | point >> 6);
+            rune[1] = (char) (0x80 | (point & 0x3F));
+        }
+        SLOT_T *slot = SUFFIX(tokenLookup)(tables, rune, runeLen);
+        if (slot == NULL) {
+            return true;
+        }
+        tables->byteTokens[byte] = slot->value;
+    }
+    uint32_t size = 1;
+    while (size < 2 * ranks->filled) size <<= 1;
+    PAIR_SLOT_T *slots = calloc(size, sizeof(PAIR_SLOT_T));
+    if (slots == NULL) {
+        return false;
+    }
+    PAIR_TABLE_T table = {slots, size - 1};
+    for (uint32_t idx = 1; idx <= ranks->size; idx++) {
+        const SLOT_T *merge = &ranks->slots[idx];
+        if (merge->hash == 0) {
+            continue;
+        }
+        const char *key = tables->strings + merge->offset;
+        const char *divisor = memchr(key, ' ', merge->length);
+        char joined[2 * MAX_TOKEN_BYTES];
+        SLOT_T *left = NULL, *right = NULL, *both = NULL;
+        if (divisor != NULL && merge->length <= sizeof(joined)) {
+            size_t leftLen = divisor - key;
+            size_t rightLen = merge->length - leftLen - 1;
+            memcpy(joined, key, leftLen);
+            memcpy(joined + leftLen, divisor + 1, rightLen);
+            left = SUFFIX(tokenLookup)(tables, key, leftLen);
+            right = SUFFIX(tokenLookup)(tables, divisor + 1, rightLen);
+            both = SUFFIX(tokenLookup)(tables, joined, leftLen + rightLen);
+        }
+        if (left == NULL || right == NULL || both == NULL) {
+            free(slots);
+            return true;
+        }
+        unsigned int probes;
+        PAIR_SLOT_T *slot = &slots[SUFFIX(pairProbe)(&table, left->value,
+                                                     right->value, &probes)];
+        /* A pair listed twice keeps its lowest rank. */
+        if (slot->rank == 0 || merge->value < slot->rank) {
+            slot->pair = (uint64_t) left->value << ID_BITS | right->value;
+            slot->rank = merge->value;
+            slot->merged = both->value;
+        }
+    }
+    *pairs = table;
+    return true;
+}
+
+/* Starts a lane on a pre-token of 1 to LANE_PIECES bytes. */
+void SUFFIX(loadLane)(const codecTables_t *tables, LANE_T *lane,
+                      const char *s, size_t numBytes) {
+    for (size_t idx = 0; idx < LANE_PIECES; idx++) {
+        lane->ranks[idx] = RANK_NONE;
+    }
+    for (size_t idx = 0; idx < numBytes; idx++) {
+        lane->pieces[idx] =
+                (ID_T) tables->byteTokens[(unsigned char) s[idx]];
+    }
+    lane->live = (uint32_t) ((1ull << numBytes) - 1);
+    lane->stale = lane->live >> 1;
+    lane->numMerges = 0;
+}
+
+/*
+ * Merges every occurrence of the lane's lowest ranked pair, left to
+ * right.  Each pair has a rank of its own, so the rank alone picks them
+ * out.  Returns false once nothing merges.
+ */
+static inline bool SUFFIX(mergeLane)(LANE_T *lane) {
+    ID_T lowest = RANK_NONE;
+    for (size_t idx = 0; idx < LANE_PIECES; idx++) {
+        lowest = lane->ranks[idx] < lowest ? lane->ranks[idx] : lowest;
+    }
+    if (lowest == RANK_NONE) {
+        return false;
+    }
+    uint32_t rest = lane->live;
+    while (rest != 0) {
+        unsigned int left = __builtin_ctz(rest);
+        rest &= rest - 1;
+        if (lane->ranks[left] != lowest) {
+            continue;
+        }
+        unsigned int right = __builtin_ctz(rest);
+        rest &= rest - 1;
+        lane->live &= ~(1u << right);
+        lane->pieces[left] = lane->merged[left];
+        lane->ranks[left] = RANK_NONE;
+        lane->ranks[right] = RANK_NONE;
+        if (rest != 0) {
+            lane->stale |= 1u << left;
+        }
+        uint32_t before = lane->live & ((1u << left) - 1);
+        if (before != 0) {
+            lane->stale |= 1u << (31 - __builtin_clz(before));
+        }
+        lane->numMerges++;
+    }
+    return true;
+}
+
+/*
+ * Runs BPE over a batch of short pre-tokens side by side, one per lane,
+ * until no lane has a pair left to merge.  Each round takes one merge in
+ * every lane that still has one.  The lanes do not depend on each other,
+ * so the lookups of one overlap the merges of the last rather than wait
+ * on them.  At most 256 lanes.
+ */
+void SUFFIX(mergeLanes)(const codecTables_t *tables, LANE_T *lanes,
+                        size_t numLanes, codecStats_t *stats) {
+    const PAIR_TABLE_T *pairs = &tables->bpePairs.TABLE_FIELD;
+    uint8_t active[256];
+    size_t numActive = 0;
+    for (size_t idx = 0; idx < numLanes; idx++) {
+        active[numActive++] = (uint8_t) idx;
+    }
+    while (numActive != 0) {
+        size_t kept = 0;
+        for (size_t idx = 0; idx < numActive; idx++) {
+            LANE_T *lane = &lanes[active[idx]];
+            for (; lane->stale != 0; lane->stale &= lane->stale - 1) {
+                unsigned int left = __builtin_ctz(lane->stale);
+                unsigned int right = __builtin_ctz(lane->live >> left >> 1) +
+                                     left + 1;
+                unsigned int probes;
+                const PAIR_SLOT_T *slot = &pairs->slots[SUFFIX(pairProbe)(
+                        pairs, lane->pieces[left], lane->pieces[right],
+                        &probes)];
+                lane->ranks[left] = slot->rank != 0 ? slot->rank : RANK_NONE;
+                lane->merged[left] = slot->merged;
+                if (stats != NULL) {
+                    statsCount(stats->probes, probes);
+                }
+            }
+            if (SUFFIX(mergeLane)(lane)) {
+                active[kept++] = active[idx];
+            }
+        }
+        numActive = kept;
+    }
+}
+
+/* Writes the tokens a merged lane ended up with, returns how many. */
+size_t SUFFIX(laneTokens)(const LANE_T *lane, ID_T *tokens) {
+    size_t numTokens = 0;
+    for (uint32_t live = lane->live; live != 0; live &= live - 1) {
+        tokens[numTokens++] = lane->pieces[__builtin_ctz(live)];
+    }
+    return numTokens;
+}
+
+/*
+ * Transcodes the pre-token into `transcode` and, if it is a token as a
+ * whole, writes that one id.  Every GPT-2 token is the last merge of the
+ * bytes it spells, so such a word merges back into exactly that token.
+ */
+bool SUFFIX(wholeWord)(codecTables_t *tables, const char *s,
+                       const size_t numBytes, char *transcode,
+                       size_t *encodedLen, ID_T *tokens,
+                       codecStats_t *stats) {
+    char *inputPtr = (char *) s;
+    char *encoded = transcode;
+    while (inputPtr < s + numBytes) {
+        encodeCharBPE(tables, &inputPtr, &encoded);
+    }
+    *encodedLen = encoded - transcode;
+    *encoded = '\0';
+
+    SLOT_T *whole = SUFFIX(tokenLookup)(tables, transcode, *encodedLen);
+    if (whole == NULL) {
+        return false;
+    }
+    tokens[0] = whole->value;
+    if (stats != NULL) {
+        stats->words++;
+        stats->wholeWords++;
+        stats->tokens++;
+        statsCount(stats->wordBytes, numBytes);
+        statsCount(stats->wordMerges, 0);
+    }
+    return true;
+}
+
+/* Merges the transcoded pre-token through the linked bigrams. */
+size_t SUFFIX(mergeBigrams)(codecTables_t *tables, char *transcode,
+                            const size_t encodedLen, const size_t numBytes,
+                            BIGRAM_T *bigramsBuffer, ID_T *tokens,
+                            codecStats_t *stats) {
+    size_t numBigrams = 0;
+    size_t numDups = 0;
+    BIGRAM_T *bigrams = SUFFIX(initBPE)(bigramsBuffer, transcode,
+                                        encodedLen);
+    BIGRAM_T *highestBigram = SUFFIX(rankBigrams)(tables, bigrams,
+                                                  &numDups, &numBigrams,
+                                                  stats);
+    size_t numMerges = 0;
+    // SUFFIX(showBigrams)(bigrams);
+    while (highestBigram->rank != RANK_NONE && highestBigram->rank != 0 &&
+           numBigrams > 1) {
+        BIGRAM_T *bigram;
+        BIGRAM_T *tmpBigram;
+        DL_FOREACH_SAFE(highestBigram, bigram, tmpBigram) {
+            if (bigram->hash != 0 && highestBigram->hash == bigram->hash) {
+                SUFFIX(mergeNeighboringBigrams)(bigrams, bigram);
+                DL_DELETE(bigrams, bigram);
+                numBigrams--;
+                numMerges++;
+                if (numDups > 0) {
+                    numDups--;
+                } else {
+                    break;
+                }
+            }
+        }
+        highestBigram = SUFFIX(rankBigrams)(tables, bigrams, &numDups,
+                                            &numBigrams, stats);
+        if (numBigrams <= 1) break;
+    }
+
+    BIGRAM_T *bigram;
+    // SUFFIX(showBigrams)(bigrams);
+    size_t tokens_ct = 0;
+    DL_FOREACH(bigrams, bigram) {
+        if (bigram->rank != RANK_NONE) {
+            tokens_ct += SUFFIX(resolveToken)(tables, bigram->left,
+                                              bigram->left_len +
+                                              bigram->right_len,
+                                              &tokens[tokens_ct]);
+        } else {
+            tokens_ct += SUFFIX(resolveToken)(tables, bigram->left,
+                                              bigram->left_len,
+                                              &tokens[tokens_ct]);
+            if (bigram->next == NULL && bigram->right_len != 0) {
+                tokens_ct += SUFFIX(resolveToken)(tables, bigram->right,
+                                                  bigram->right_len,
+                                                  &tokens[tokens_ct]);
+            }
+        }
+    }
+    if (stats != NULL) {
+        stats->words++;
+        stats->tokens += tokens_ct;
+        statsCount(stats->wordBytes, numBytes);
+        statsCount(stats->wordMerges, numMerges);
+    }
+    return tokens_ct;
+}
+
+size_t SUFFIX(toBPE)(codecTables_t *tables, const char *s,
+                     const size_t numBytes, BIGRAM_T *bigramsBuffer,
+                     char *transcode, ID_T *tokens, codecStats_t *stats) {
+    size_t encodedLen;
+    if (SUFFIX(wholeWord)(tables, s, numBytes, transcode, &encodedLen,
+                          tokens, stats)) {
+        return 1;
+    }
+    return SUFFIX(mergeBigrams)(tables, transcode, encodedLen, numBytes,
+                                bigramsBuffer, tokens, stats);
+}
+
+#undef RANK_NONE
+#undef LANE_T
+#undef PAIR_TABLE_T
+#undef PAIR_SLOT_T
+#undef TABLE_FIELD
+#undef BIGRAM_T
+#undef TABLE_T
+#undef SLOT_T
+#undef SUFFIX
+#undef ID_T
@@ -0,0 +1,291 @@
+//
+// Keeps the encoding of a document that is being edited, re-encoding only
+// the text around each edit.
+//
+// The splitter looks only SPLITTER_LOOKAHEAD bytes past the end of a
+// pre-token, or as far as the longest special token.  So the pre-tokens
+// that end further in front of the edit encode as before.  The pattern has
+// no lookbehind, so encoding can restart at any pre-token boundary and
+// split the rest as a full encode would.  It runs in windows: a pre-token
+// only counts once the window has gone that far past its end, since it
+// could still grow or split until then.  Once a pre-token behind the edit
+// starts where one started before, the rest of the old encoding is kept.
+//
+
+#include "document.h"
+#include <string.h>
+
+/* Extra bytes encoded past the edit on the first try. */
+#define WINDOW_SLACK 256
+
+typedef struct {
+    uint32_t offset;             /* from the start of the window */
+    uint32_t length;
+    uint32_t first;              /* into the window's tokens */
+    uint32_t numTokens;
+} preToken_t;
+
+typedef struct {
+    uint16_t *tokens;
+    size_t numTokens;
+    size_t tokensCap;
+    preToken_t *words;
+    size_t numWords;
+    size_t wordsCap;
+    bool failed;
+} window_t;
+
+static void collectWords(const uint16_t *tokens, size_t numTokens,
+                         size_t offset, size_t length, void *ctx) {
+    window_t *window = (window_t *) ctx;
+    if (window->numTokens + numTokens > window->tokensCap) {
+        size_t capacity = window->tokensCap ? window->tokensCap * 2 : 1024;
+        while (capacity < window->numTokens + numTokens) {
+            capacity *= 2;
+        }
+        uint16_t *grown = realloc(window->tokens,
+                                  capacity * sizeof(uint16_t));
+        if (grown == NULL) {
+            window->failed = true;
+            return;
+        }
+        window->tokens = grown;
+        window->tokensCap = capacity;
+    }
+    if (window->numWords == window->wordsCap) {
+        size_t capacity = window->wordsCap ? window->wordsCap * 2 : 256;
+        preToken_t *grown = realloc(window->words,
+                                    capacity * sizeof(preToken_t));
+        if (grown == NULL) {
+            window->failed = true;
+            return;
+        }
+        window->words = grown;
+        window->wordsCap = capacity;
+    }
+    preToken_t *word = &window->words[window->numWords++];
+    word->offset = (uint32_t) offset;
+    word->length = (uint32_t) length;
+    word->first = (uint32_t) window->numTokens;
+    word->numTokens = (uint32_t) numTokens;
+    memcpy(window->tokens + window->numTokens, tokens,
+           numTokens * sizeof(uint16_t));
+    window->numTokens += numTokens;
+}
+
+static size_t tokenOffset(const tokenDocument_t *doc, size_t index) {
+    size_t offset;
+    DocumentToken(doc, index, &offset);
+    return offset;
+}
+
+static bool reserveGap(tokenDocument_t *doc, size_t needed) {
+    if (doc->gapEnd - doc->gapStart >= needed) {
+        return true;
+    }
+    size_t capacity = doc->capacity ? doc->capacity * 2 : 1024;
+    while (capacity - DocumentNumTokens(doc) < needed) {
+        capacity *= 2;
+    }
+    uint16_t *tokens = realloc(doc->tokens, capacity * sizeof(uint16_t));
+    if (tokens == NULL) {
+        return false;
+    }
+    doc->tokens = tokens;
+    uint32_t *offsets = realloc(doc->offsets, capacity * sizeof(uint32_t));
+    if (offsets == NULL) {
+        return false;
+    }
+    doc->offsets = offsets;
+    size_t tail = doc->capacity - doc->gapEnd;
+    memmove(doc->tokens + capacity - tail, doc->tokens + doc->gapEnd,
+            tail * sizeof(uint16_t));
+    memmove(doc->offsets + capacity - tail, doc->offsets + doc->gapEnd,
+            tail * sizeof(uint32_t));
+    doc->gapEnd = capacity - tail;
+    doc->capacity = capacity;
+    return true;
+}
+
+/* Moves the gap in front of token `index`, at the current text length. */
+static void moveGap(tokenDocument_t *doc, size_t index) {
+    while (doc->gapStart > index) {
+        doc->gapStart--;
+        doc->gapEnd--;
+        doc->tokens[doc->gapEnd] = doc->tokens[doc->gapStart];
+        doc->offsets[doc->gapEnd] =
+                (uint32_t) (doc->textLength - doc->offsets[doc->gapStart]);
+    }
+    while (doc->gapStart < index) {
+        doc->tokens[doc->gapStart] = doc->tokens[doc->gapEnd];
+        doc->offsets[doc->gapStart] =
+                (uint32_t) (doc->textLength - doc->offsets[doc->gapEnd]);
+        doc->gapStart++;
+        doc->gapEnd++;
+    }
+}
+
+/*
+ * Picks where to start encoding for an edit at `offset`: the start of the
+ * last pre-token in front of every byte whose encoding the edit could
+ * change.  Returns the index of its first token.
+ */
+static size_t findRestart(const tokenDocument_t *doc, size_t offset,
+                          size_t *restart) {
+    bool special = doc->options.allowSpecial | doc->options.denySpecial;
+    size_t guard = special ? MAX_TOKEN_BYTES : SPLITTER_LOOKAHEAD;
+    *restart = 0;
+    if (offset < guard) {
+        return 0;
+    }
+    size_t limit = offset - guard;
+    size_t lower = 0, upper = DocumentNumTokens(doc);
+    while (lower < upper) {
+        size_t middle = lower + (upper - lower) / 2;
+        if (tokenOffset(doc, middle) <= limit) {
+            lower = middle + 1;
+        } else {
+            upper = middle;
+        }
+    }
+    size_t index = lower;
+    if (index > 0) {
+        *restart = tokenOffset(doc, --index);
+        while (index > 0 && tokenOffset(doc, index - 1) == *restart) {
+            index--;
+        }
+    }
+    return index;
+}
+
+/*
+ * Whether the new pre-token at `start` lines up with the old encoding
+ * behind the gap.  Old tokens in front of it are dropped on the way.
+ */
+static bool resynced(tokenDocument_t *doc, size_t oldStart,
+                     size_t oldLength) {
+    while (doc->gapEnd < doc->capacity &&
+           oldLength - doc->offsets[doc->gapEnd] < oldStart) {
+        doc->gapEnd++;
+    }
+    return doc->gapEnd < doc->capacity &&
+           oldLength - doc->offsets[doc->gapEnd] == oldStart;
+}
+
+static void clearDocument(tokenDocument_t *doc) {
+    doc->gapStart = 0;
+    doc->gapEnd = doc->capacity;
+    doc->textLength = 0;
+}
+
+void DocumentInit(tokenDocument_t *doc) {
+    memset(doc, 0, sizeof(tokenDocument_t));
+}
+
+enum CODEC_STATUS DocumentEncode(tokenDocument_t *doc, const char *text,
+                                 size_t numBytes,
+                                 const encodeOptions_t *options) {
+    clearDocument(doc);
+    if (options != NULL) {
+        doc->options = *options;
+    } else {
+        memset(&doc->options, 0, sizeof(encodeOptions_t));
+    }
+    return DocumentEdit(doc, text, numBytes, 0, 0, numBytes);
+}
+
+enum CODEC_STATUS DocumentEdit(tokenDocument_t *doc, const char *text,
+                               size_t numBytes, size_t offset, size_t removed,
+                               size_t inserted) {
+    size_t oldLength = doc->textLength;
+    if (offset + removed > oldLength ||
+        numBytes != oldLength - removed + inserted ||
+        numBytes > UINT32_MAX) {
+        return ERR_EDIT_INVALID;
+    }
+    bool special = doc->options.allowSpecial | doc->options.denySpecial;
+    size_t guard = special ? MAX_TOKEN_BYTES : SPLITTER_LOOKAHEAD;
+    size_t pos;
+    moveGap(doc, findRestart(doc, offset, &pos));
+    size_t editEnd = offset + inserted;
+    size_t windowSize = editEnd - pos + WINDOW_SLACK;
+    window_t window = {0};
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    doc->numReencoded = 0;
+
+    while (status == CODEC_SUCCESS) {
+        size_t end = numBytes - pos > windowSize ? pos + windowSize : numBytes;
+        while (end < numBytes && ((unsigned char) text[end] & 0xC0) == 0x80) {
+            end--;
+        }
+        window.numTokens = 0;
+        window.numWords = 0;
+        if (end > pos) {
+            status = EncodeText(text + pos, end - pos, &doc->options,
+                                collectWords, &window);
+            if (status == CODEC_SUCCESS && window.failed) {
+                status = ERR_EDIT_MALLOC;
+            }
+            if (status != CODEC_SUCCESS) {
+                break;
+            }
+        }
+        doc->numReencoded += end - pos;
+        bool synced = false;
+        size_t restart = pos;
+        size_t restartGap = doc->gapStart;
+        for (size_t idx = 0; idx < window.numWords; idx++) {
+            const preToken_t *word = &window.words[idx];
+            size_t start = pos + word->offset;
+            if (start >= editEnd &&
+                resynced(doc, start - inserted + removed, oldLength)) {
+                synced = true;
+                break;
+            }
+            if (idx > 0) {
+                restart = start;
+                restartGap = doc->gapStart;
+            }
+            /* The next pre-token could still start elsewhere. */
+            if (end < numBytes && start + word->length + guard > end) {
+                break;
+            }
+            if (!reserveGap(doc, word->numTokens)) {
+                status = ERR_EDIT_MALLOC;
+                break;
+            }
+            for (size_t token = 0; token < word->numTokens; token++) {
+                doc->tokens[doc->gapStart] =
+                        window.tokens[word->first + token];
+                doc->offsets[doc->gapStart++] = (uint32_t) start;
+            }
+        }
+        if (synced || status != CODEC_SUCCESS) {
+            break;
+        }
+        if (end == numBytes) {
+            doc->gapEnd = doc->capacity;
+            break;
+        }
+        /* Resume at the last pre-token counted, or retry with more text. */
+        doc->gapStart = restartGap;
+        if (restart == pos) {
+            windowSize *= 2;
+        }
+        pos = restart;
+    }
+    free(window.tokens);
+    free(window.words);
+    if (status != CODEC_SUCCESS) {
+        clearDocument(doc);
+        return status;
+    }
+    doc->textLength = numBytes;
+    return CODEC_SUCCESS;
+}
+
+void DocumentFree(tokenDocument_t *doc) {
+    free(doc->tokens);
+    free(doc->offsets);
+    DocumentInit(doc);
+}
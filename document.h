@@ -0,0 +1,66 @@
+//
+// Keeps the encoding of a document that is being edited, re-encoding only
+// the text around each edit.
+//
+
+#ifndef GPT2_CODEC_DOCUMENT_H
+#define GPT2_CODEC_DOCUMENT_H
+
+#include "library.h"
+
+/*
+ * Every token carries the offset of the pre-token it was encoded from.
+ * The tokens sit in a gap buffer with the gap at the last edit, so edits
+ * close to each other move little.  Offsets after the gap are kept as the
+ * distance from the end of the document, which an edit in front of them
+ * does not change.
+ */
+typedef struct {
+    uint16_t *tokens;
+    uint32_t *offsets;
+    size_t capacity;
+    size_t gapStart;             /* tokens before the gap */
+    size_t gapEnd;               /* tokens after it run up to capacity */
+    size_t textLength;
+    encodeOptions_t options;
+    size_t numReencoded;         /* bytes re-encoded by the last edit */
+} tokenDocument_t;
+
+void DocumentInit(tokenDocument_t *doc);
+
+/* Encodes the whole text, replacing whatever the document held. */
+enum CODEC_STATUS DocumentEncode(tokenDocument_t *doc, const char *text,
+                                 size_t numBytes,
+                                 const encodeOptions_t *options);
+
+/*
+ * Updates the encoding after `removed` bytes at `offset` were replaced by
+ * `inserted` bytes.  `text` is the whole document after the edit.  Encoding
+ * restarts at the last stable pre-token boundary in front of the edit and
+ * stops at the first boundary behind it where the tokens line up with the
+ * previous encoding again.  If the edited text fails to encode the
+ * document is left empty.
+ */
+enum CODEC_STATUS DocumentEdit(tokenDocument_t *doc, const char *text,
+                               size_t numBytes, size_t offset, size_t removed,
+                               size_t inserted);
+
+static inline size_t DocumentNumTokens(const tokenDocument_t *doc) {
+    return doc->gapStart + doc->capacity - doc->gapEnd;
+}
+
+/* The token at `index`, and the offset of the text it was encoded from. */
+static inline uint16_t DocumentToken(const tokenDocument_t *doc, size_t index,
+                                     size_t *offset) {
+    if (index < doc->gapStart) {
+        *offset = doc->offsets[index];
+        return doc->tokens[index];
+    }
+    index += doc->gapEnd - doc->gapStart;
+    *offset = doc->textLength - doc->offsets[index];
+    return doc->tokens[index];
+}
+
+void DocumentFree(tokenDocument_t *doc);
+
+#endif //GPT2_CODEC_DOCUMENT_H
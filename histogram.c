@@ -0,0 +1,100 @@
+//
+// Log-linear latency histogram, shared by the server and its load generator.
+//
+
+#include "histogram.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+static size_t bucketIndex(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return ((size_t) (shift + 1) << HISTOGRAM_SUB_BITS) +
+           ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/* Smallest value that lands in the bucket. */
+static uint64_t bucketValue(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (int) (index >> HISTOGRAM_SUB_BITS) - 1;
+    return (uint64_t) (SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+}
+
+void HistogramRecord(latencyHistogram_t *histogram, uint64_t nanoseconds) {
+    histogram->counts[bucketIndex(nanoseconds)]++;
+    histogram->total++;
+    histogram->sum += nanoseconds;
+    if (nanoseconds > histogram->max) {
+        histogram->max = nanoseconds;
+    }
+}
+
+void HistogramMerge(latencyHistogram_t *into, const latencyHistogram_t *from) {
+    for (size_t idx = 0; idx < HISTOGRAM_BUCKETS; idx++) {
+        into->counts[idx] += from->counts[idx];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/* Upper edge of the bucket holding the percentile, capped at the maximum. */
+uint64_t HistogramPercentile(const latencyHistogram_t *histogram,
+                             double percentile) {
+    uint64_t rank = (uint64_t) (percentile / 100 * histogram->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t idx = 0; idx < HISTOGRAM_BUCKETS - 1; idx++) {
+        seen += histogram->counts[idx];
+        if (seen >= rank) {
+            uint64_t upper = bucketValue(idx + 1) - 1;
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void HistogramPrint(FILE *f, const char *name,
+                    const latencyHistogram_t *histogram) {
+    if (histogram->total == 0) {
+        fprintf(f, "%s: no requests\n", name);
+        return;
+    }
+    fprintf(f, "%s: %llu requests, mean %.1f us, p50 %.1f us, "
+               "p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+            name,
+            (unsigned long long) histogram->total,
+            (double) histogram->sum / histogram->total / 1000,
+            HistogramPercentile(histogram, 50) / 1000.0,
+            HistogramPercentile(histogram, 90) / 1000.0,
+            HistogramPercentile(histogram, 99) / 1000.0,
+            HistogramPercentile(histogram, 99.9) / 1000.0,
+            histogram->max / 1000.0);
+    /* One row per power of two. */
+    for (size_t group = 0; group < HISTOGRAM_BUCKETS; group += SUB_BUCKETS) {
+        uint64_t count = 0;
+        for (size_t idx = group; idx < group + SUB_BUCKETS; idx++) {
+            count += histogram->counts[idx];
+        }
+        if (count == 0) {
+            continue;
+        }
+        double share = 100.0 * count / histogram->total;
+        fprintf(f, "  < %10.1f us %10llu %5.1f%% ",
+                bucketValue(group + SUB_BUCKETS) / 1000.0,
+                (unsigned long long) count, share);
+        for (int bar = 0; bar < (int) (share / 2 + 0.5); bar++) {
+            fputc('#', f);
+        }
+        fputc('\n', f);
+    }
+}
@@ -0,0 +1,33 @@
+//
+// Log-linear latency histogram, shared by the server and its load generator.
+//
+
+#ifndef GPT2_CODEC_HISTOGRAM_H
+#define GPT2_CODEC_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Each power of two is split into 2^HISTOGRAM_SUB_BITS buckets, so a
+   reported percentile is within 12.5% of the true value. */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} latencyHistogram_t;
+
+void HistogramRecord(latencyHistogram_t *histogram, uint64_t nanoseconds);
+
+void HistogramMerge(latencyHistogram_t *into, const latencyHistogram_t *from);
+
+uint64_t HistogramPercentile(const latencyHistogram_t *histogram,
+                             double percentile);
+
+void HistogramPrint(FILE *f, const char *name,
+                    const latencyHistogram_t *histogram);
+
+#endif //GPT2_CODEC_HISTOGRAM_H
@@ -1,11 +1,18 @@
 #include "library.h"
 #include "rdtsc.h"
+#include "wordcache.h"
 #include <stdio.h>
 #include <string.h>
-#include <regex.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <wctype.h>
 #include <utf8proc/utf8proc.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 codecTables_t *codecTables;
 
@@ -46,122 +53,104 @@ unsigned int genHash(const char *s, const unsigned int len,
                      unsigned int hval) {
     unsigned int count;
 
-    if (hval == 0) hval = len;
-    count = len;
-    while (count-- > 0) {
-        hval <<= 4;
-        hval += s[count];
+    /* FNV-1a, chained across calls so a bigram hashes as one key. */
+    if (hval == 0) hval = 2166136261u;
+    for (count = 0; count < len; count++) {
+        hval ^= (unsigned char) s[count];
+        hval *= 16777619u;
     }
     if (hval == 0) ++hval;
 
     return hval;
 }
 
-uint64_t hashBigram(rankedBigram_t *item) {
+unsigned int bigramHash(const char *left, size_t left_len,
+                        const char *right, size_t right_len) {
     const char space = ' ';
 
-    uint64_t hval;
-    if (item->hash) {
-        return item->hash;
-    }
-    hval = genHash(item->left, item->left_len, 0);
+    unsigned int hval;
+    hval = genHash(left, left_len, 0);
     hval = genHash(&space, 1, hval);
-    hval = genHash(item->right, item->right_len, hval);
-    item->hash = hval;
+    hval = genHash(right, right_len, hval);
     return hval;
 }
 
-uint64_t cmpBigramKey(const rankedBigram_t *item, const char *key) {
-    if (strncmp(item->left, key, item->left_len) == 0
-        && strncmp(item->right, &(key[item->left_len + 1]),
-                   item->right_len) == 0) {
-        return 0;
-    } else {
-        return 1;
+static bool isPrime(unsigned int n) {
+    for (unsigned int d = 3; d * d <= n; d += 2) {
+        if (n % d == 0) return false;
     }
+    return true;
 }
 
-unsigned int hashLookup(rankedBigram_t *item, ENTRY **retval,
-                        unsigned int *hash, const struct hsearch_data *htab) {
-    struct hsearch_data lhtab = *htab;
-    unsigned int hval;
-    unsigned int idx;
-
-    hval = hashBigram(item);
-    idx = hval % lhtab.size + 1;
-
-    if (lhtab.table[idx].used) {
-        /* Further action might be required according to the action value. */
-        if (lhtab.table[idx].used == hval
-            && cmpBigramKey(item, lhtab.table[idx].entry.key) == 0) {
-            *retval = &lhtab.table[idx].entry;
-            *hash = hval;
-            return idx;
-        }
-
-        /* Second hash function, as suggested in [Knuth] */
-        unsigned int hval2 = 1 + hval % (lhtab.size - 2);
-        unsigned int first_idx = idx;
-
-        do {
-            /* Because SIZE is prime this guarantees to step through all
-                   available indeces.  */
-            if (idx <= hval2)
-                idx = lhtab.size + idx - hval2;
-            else
-                idx -= hval2;
-
-            /* If we visited all entries leave the loop unsuccessfully.  */
-            if (idx == first_idx)
-                break;
+void u8_inc(char *s, int *i) {
+    (void) (isutf(s[++(*i)]) || isutf(s[++(*i)]) ||
+            isutf(s[++(*i)]) || ++(*i));
+}
 
-            /* If entry is found use it. */
-            if (lhtab.table[idx].used == hval
-                && cmpBigramKey(item, lhtab.table[idx].entry.key) == 0) {
-                *retval = &lhtab.table[idx].entry;
-                *hash = hval;
-                return idx;
-            }
-        } while (lhtab.table[idx].used);
-    }
-    errno = ESRCH;
-    /* Prevent the dereferencing of a NULL pointer. */
-    if (retval != NULL) {
-        *retval = NULL;
+size_t encodeCharBPE(codecTables_t *tables, char **ch, char **dest) {
+    uint16_t rune = tables->bytesToUnicode[(unsigned char) **ch];
+    *ch = *ch + 1;
+    if (rune == 0) {
+        return 0;
+    } else if (rune < 0x80) {
+        **dest = (char) rune;
+        *dest = *dest + 1;
+        return 1;
+    } else {
+        **dest = (char) ((rune >> 6) | 0xC0);
+        *dest = *dest + 1;
+        **dest = (char) ((rune & 0x3F) | 0x80);
+        *dest = *dest + 1;
+        return 2;
     }
-    *hash = hval;
-    return idx;
 }
 
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
 
-int hashInsert(rankedBigram_t *item, ENTRY **retval,
-               struct hsearch_data *htab) {
-    unsigned int hval = 0;
-    unsigned int idx = hashLookup(item, retval, &hval, htab);
+#define ID_BITS 16
+#include "codec_template.h"
+#undef ID_BITS
 
-    /* If table is full and another entry should be entered return
-       with error.  */
-    if (htab->filled == htab->size) {
-        errno = ENOMEM;
-        /* Prevent the dereferencing of a NULL pointer. */
-        if (retval != NULL) {
-            *retval = NULL;
-        }
-        return 0;
+#define ID_BITS 32
+#include "codec_template.h"
+#undef ID_BITS
+
+// ==========================================================================
+// String pool, all vocabulary keys are stored here and referenced by offset
+// ==========================================================================
+
+bool poolReserve(codecTables_t *tables, size_t numBytes) {
+    if (tables->stringsLen + numBytes <= tables->stringsCap) {
+        return true;
+    }
+    size_t capacity = tables->stringsCap ? tables->stringsCap : 4096;
+    while (capacity < tables->stringsLen + numBytes) {
+        capacity *= 2;
     }
+    char *strings = realloc(tables->strings, capacity);
+    if (strings == NULL) {
+        return false;
+    }
+    tables->strings = strings;
+    tables->stringsCap = capacity;
+    return true;
+}
 
-    htab->table[idx].used = hval;
-    htab->table[idx].entry.key = item->repr;
-    htab->table[idx].entry.data = item;
-    ++htab->filled;
+uint32_t poolAppend(codecTables_t *tables, const char *s, size_t len) {
+    uint32_t offset = (uint32_t) tables->stringsLen;
+    memcpy(tables->strings + offset, s, len);
+    tables->strings[offset + len] = '\0';
+    tables->stringsLen += len + 1;
+    return offset;
+}
 
-    /* Ignore 'retval' if 'action' is 'ENTER' and 'retval' is a
-            NULL pointer. */
-    if (retval != NULL) {
-        /* Prevent the dereferencing of a NULL pointer. */
-        *retval = &htab->table[idx].entry;
+void poolShrink(codecTables_t *tables) {
+    char *strings = realloc(tables->strings, tables->stringsLen);
+    if (strings != NULL) {
+        tables->strings = strings;
+        tables->stringsCap = tables->stringsLen;
     }
-    return 1;
 }
 
 // ==========================================================================
@@ -231,281 +220,532 @@ void buildUnicodeByteTable(codecTables_t **table) {
     fillUnicodePoints(&uct, table, 173, 173);
 }
 
-enum CODEC_STATUS readBpeVocabulary(const char *filename,
-                                    codecTables_t **table) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        return ERR_BPE_FOPEN;
+/*
+ * Moves a 16 bit table to 32 bits.  The slots keep their places, the probe
+ * sequence only depends on the hash and the table size.
+ */
+static bool widenTable(vocabTable_t *table) {
+    vocabTable16_t *narrow = &table->t16;
+    vocabSlot32_t *slots = calloc(narrow->size + 1, sizeof(vocabSlot32_t));
+    if (slots == NULL) {
+        return false;
     }
-    char *line = NULL;
-    size_t len = 0;
-    size_t numLines = 0;
-    long skip = 0;
-
-    while (getline(&line, &len, f) != -1) {
-        if (!numLines) {
-            skip = ftell(f);
-        }
-        numLines += 1;
-    }
-    fseek(f, skip, SEEK_SET);
-    hcreate_r(numLines, &(*table)->bpeRanks);
-
-    size_t bpeRank = 1;
-    while (getline(&line, &len, f) != -1) {
-        rankedBigram_t *entry = malloc(sizeof(rankedBigram_t));
-        size_t repr_len = strlen(line) - 1;
-        entry->repr = strndup(line, repr_len);
-        entry->rank = bpeRank;
-        char *divisor = strchr(entry->repr, ' ');
-        entry->left_len = divisor - entry->repr;
-        entry->left = strndup(line, entry->left_len);
-        entry->right = divisor + 1;
-        entry->right_len = strlen(entry->right);
-        ENTRY *ep;
-        hashInsert(entry, &ep, &(*table)->bpeRanks);
-        bpeRank++;
+    for (uint32_t idx = 0; idx <= narrow->size; idx++) {
+        slots[idx].hash = narrow->slots[idx].hash;
+        slots[idx].offset = narrow->slots[idx].offset;
+        slots[idx].length = narrow->slots[idx].length;
+        slots[idx].value = narrow->slots[idx].value;
     }
-    return CODEC_SUCCESS;
+    free(narrow->slots);
+    vocabTable32_t wide = {slots, narrow->size, narrow->filled};
+    table->t32 = wide;
+    return true;
 }
 
-enum CODEC_STATUS readEncoderDefinitions(const char *filename,
-                                         codecTables_t **tables) {
-    *tables = malloc(sizeof(codecTables_t));
+/* Brings the token and merge tables to the wider of their two widths. */
+static bool matchWidths(codecTables_t *tables, unsigned int tokenBits,
+                        unsigned int rankBits) {
+    tables->idBits = tokenBits > rankBits ? tokenBits : rankBits;
+    return (tokenBits == tables->idBits || widenTable(&tables->toToken)) &&
+           (rankBits == tables->idBits || widenTable(&tables->bpeRanks));
+}
 
-    cJSON *encoderJson = malloc(sizeof(cJSON));
-    if (readJson(filename, &encoderJson) != CODEC_SUCCESS) {
-        return ERR_JSON_FAILED;
+static bool fileSize(const char *filename, size_t *size) {
+    struct stat info;
+    if (stat(filename, &info) != 0) {
+        return false;
     }
-    int numEntries = cJSON_GetArraySize(encoderJson);
-    hcreate_r(numEntries, &(*tables)->toToken);
-    const cJSON *entry;
-    cJSON_ArrayForEach(entry, encoderJson) {
-        ENTRY e;
-        ENTRY *ep;
-        e.key = strdup(entry->string);
-        e.data = (void *) (uint64_t) entry->valueint;
-        hsearch_r(e, ENTER, &ep, &(*tables)->toToken);
-        (*tables)->fromToken[entry->valueint] = e.key;
-    }
-    cJSON_free(encoderJson);
-    return CODEC_SUCCESS;
+    *size = (size_t) info.st_size;
+    return true;
+}
+
+/*
+ * One vocabulary file being read into a stretch of the string pool that
+ * was reserved for it up front, so both files can load at the same time.
+ * A file never needs more of the pool than its own size plus one.
+ */
+typedef struct {
+    const char *filename;
+    codecTables_t *tables;
+    size_t base;                 /* of its stretch of the pool */
+    size_t length;               /* of the file */
+    size_t used;                 /* pool bytes filled */
+    unsigned int idBits;         /* of the table it built */
+    enum CODEC_STATUS status;
+} vocabLoader_t;
+
+static void loadMerges(vocabLoader_t *loader) {
+    codecTables_t *tables = loader->tables;
+    FILE *f = fopen(loader->filename, "rb");
+    if (!f) {
+        loader->status = ERR_BPE_FOPEN;
+        return;
+    }
+    size_t length = loader->length;
+    if (length == 0) {
+        fclose(f);
+        loader->status = ERR_BPE_EMPTY;
+        return;
+    }
+    /* The file is read straight into the pool and each merge line becomes
+       its own `left right` key in place, nothing is copied per entry. */
+    size_t base = loader->base;
+    char *lines = tables->strings + base;
+    size_t bytesRead = fread(lines, 1, length, f);
+    fclose(f);
+    if (bytesRead != length) {
+        loader->status = ERR_BPE_FAILED;
+        return;
+    }
+    lines[length] = '\0';
+    loader->used = length + 1;
+
+    /* Sized from the file in place of counting its lines first: no merge
+       is shorter than "a b\n". */
+    loader->idBits = 16;
+    if (!vocabTableCreate16(&tables->bpeRanks.t16, (length + 1) / 4 + 1)) {
+        loader->status = ERR_BPE_MALLOC;
+        return;
+    }
+
+    /* The first line is the `#version` header, ranks start at 1. */
+    char *line = lines;
+    char *end = lines + length;
+    size_t bpeRank = 0;
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        *eol = '\0';
+        size_t line_len = eol - line;
+        char *divisor = memchr(line, ' ', line_len);
+        if (bpeRank != 0 && divisor != NULL) {
+            /* The merges can outgrow 16 bit ranks in a vocabulary whose
+               ids would fit, the whole codec then moves to 32 bits. */
+            if (loader->idBits == 16 && bpeRank >= UINT16_MAX) {
+                if (!widenTable(&tables->bpeRanks)) {
+                    loader->status = ERR_BPE_MALLOC;
+                    return;
+                }
+                loader->idBits = 32;
+            }
+            size_t left_len = divisor - line;
+            unsigned int hval = bigramHash(line, left_len, divisor + 1,
+                                           line_len - left_len - 1);
+            if (loader->idBits == 16) {
+                hashInsert16(&tables->bpeRanks.t16, tables->strings, hval,
+                             base + (line - lines), line_len, left_len,
+                             (uint16_t) bpeRank);
+            } else {
+                hashInsert32(&tables->bpeRanks.t32, tables->strings, hval,
+                             base + (line - lines), line_len, left_len,
+                             (uint32_t) bpeRank);
+            }
+        }
+        bpeRank++;
+        line = eol + 1;
+    }
+    loader->status = CODEC_SUCCESS;
+}
+
+static void *loadMergesMain(void *arg) {
+    loadMerges((vocabLoader_t *) arg);
+    return NULL;
 }
 
 // ==========================================================================
-// Bigram functions
+// encoder.json, scanned as a flat object of strings to integers
 // ==========================================================================
 
+typedef struct {
+    uint32_t offset;             /* key in the string pool */
+    uint32_t length;
+    int64_t id;
+} encoderEntry_t;
+
+static const char *skipSpace(const char *pos, const char *end) {
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' ||
+                         *pos == '\r')) {
+        pos++;
+    }
+    return pos;
+}
 
-void printBigramRepr(const rankedBigram_t *bigram) {
-    if (bigram->left != NULL) {
-        printf("Rank: %d Left[%zu]: %.*s Right[%zdu]: %.*s\n", bigram->rank,
-               bigram->left_len, (int) bigram->left_len, bigram->left,
-               bigram->right_len, (int) bigram->right_len, bigram->right);
+static int hexDigits(const char *pos, const char *end) {
+    if (end - pos < 4) {
+        return -1;
+    }
+    int value = 0;
+    for (int idx = 0; idx < 4; idx++) {
+        char ch = pos[idx];
+        int digit = ch >= '0' && ch <= '9' ? ch - '0' :
+                    (ch | 0x20) >= 'a' && (ch | 0x20) <= 'f' ?
+                    (ch | 0x20) - 'a' + 10 : -1;
+        if (digit < 0) {
+            return -1;
+        }
+        value = value << 4 | digit;
     }
+    return value;
 }
 
-void showBigrams(rankedBigram_t *bigrams) {
-    printf("====\n");
-    rankedBigram_t *bigram;
-    LL_FOREACH(bigrams, bigram) {
-        printBigramRepr(bigram);
+static size_t putRune(char *dest, uint32_t rune) {
+    if (rune < 0x80) {
+        dest[0] = (char) rune;
+        return 1;
+    } else if (rune < 0x800) {
+        dest[0] = (char) (0xC0 | rune >> 6);
+        dest[1] = (char) (0x80 | (rune & 0x3F));
+        return 2;
+    } else if (rune < 0x10000) {
+        dest[0] = (char) (0xE0 | rune >> 12);
+        dest[1] = (char) (0x80 | (rune >> 6 & 0x3F));
+        dest[2] = (char) (0x80 | (rune & 0x3F));
+        return 3;
     }
-    printf("====\n");
+    dest[0] = (char) (0xF0 | rune >> 18);
+    dest[1] = (char) (0x80 | (rune >> 12 & 0x3F));
+    dest[2] = (char) (0x80 | (rune >> 6 & 0x3F));
+    dest[3] = (char) (0x80 | (rune & 0x3F));
+    return 4;
 }
 
-rankedBigram_t *rankBigrams(const codecTables_t *tables,
-                            rankedBigram_t *bigrams, size_t *numDups,
-                            size_t *numBigrams) {
-    rankedBigram_t *highestBigram = NULL;
-    rankedBigram_t *currBigram = NULL;
-    *numBigrams = 0;
-    *numDups = 0;
-    DL_FOREACH(bigrams, currBigram) {
-        if (currBigram->rank != 0) {
-            if (highestBigram == NULL ||
-                currBigram->rank < highestBigram->rank) {
-                highestBigram = currBigram;
-            } else if (currBigram->hash == highestBigram->hash) {
-                (*numDups)++;
-            }
-            *numBigrams += 1;
+/*
+ * Decodes the string whose opening quote is at `pos` into `dest`, which
+ * never needs more bytes than the string spans in the file.  Returns the
+ * position past the closing quote, or NULL if the string is malformed.
+ */
+static const char *scanString(const char *pos, const char *end, char *dest,
+                              size_t *length) {
+    char *out = dest;
+    pos++;
+    while (pos < end && *pos != '"') {
+        if (*pos != '\\') {
+            *out++ = *pos++;
             continue;
         }
-        *numBigrams += 1;
-        ENTRY *ep;
-        unsigned int hash = 0;
-        hashLookup(currBigram,
-                   &ep, &hash, &(tables->bpeRanks));
-        if (ep != NULL) {
-            rankedBigram_t *matchBigram = (rankedBigram_t *) &(*ep->data);
-            currBigram->rank = matchBigram->rank;
-            currBigram->repr = matchBigram->repr;
+        if (++pos == end) {
+            return NULL;
+        }
+        switch (*pos++) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                int rune = hexDigits(pos, end);
+                pos += 4;
+                if (rune >= 0xDC00 && rune <= 0xDFFF) {
+                    return NULL;
+                } else if (rune >= 0xD800 && rune <= 0xDBFF) {
+                    int low = end - pos >= 6 && pos[0] == '\\' &&
+                              pos[1] == 'u' ? hexDigits(pos + 2, end) : -1;
+                    if (low < 0xDC00 || low > 0xDFFF) {
+                        return NULL;
+                    }
+                    pos += 6;
+                    rune = 0x10000 + ((rune - 0xD800) << 10) +
+                           (low - 0xDC00);
+                } else if (rune < 0) {
+                    return NULL;
+                }
+                out += putRune(out, (uint32_t) rune);
+                break;
+            }
+            default:
+                return NULL;
+        }
+    }
+    if (pos == end) {
+        return NULL;
+    }
+    *length = out - dest;
+    return pos + 1;
+}
+
+/*
+ * Bytes a vocabulary key decodes to, or SIZE_MAX if it has a rune outside
+ * the byte-level alphabet, which tokenByte() could not map back.
+ */
+static size_t keyBytes(const codecTables_t *tables, const char *key,
+                       size_t length) {
+    const unsigned char *s = (const unsigned char *) key;
+    size_t numBytes = 0;
+    for (size_t pos = 0; pos < length; numBytes++) {
+        uint32_t rune;
+        if (s[pos] < 0x80) {
+            rune = s[pos++];
+        } else if ((s[pos] & 0xE0) == 0xC0 && pos + 1 < length &&
+                   (s[pos + 1] & 0xC0) == 0x80) {
+            rune = (s[pos] & 0x1F) << 6 | (s[pos + 1] & 0x3F);
+            pos += 2;
         } else {
-            currBigram->rank = 65535;
+            return SIZE_MAX;
         }
-        if (highestBigram == NULL ||
-            currBigram->rank < highestBigram->rank) {
-            highestBigram = currBigram;
-        } else if (currBigram->hash == highestBigram->hash) {
-            (*numDups)++;
+        if (rune >= sizeof(tables->unicodeToBytes) ||
+            tables->bytesToUnicode[tables->unicodeToBytes[rune]] != rune) {
+            return SIZE_MAX;
         }
     }
-    //printf("Number of bigrams: %zu\n", *numBigrams);
-    // showBigrams(bigrams);
-    return highestBigram;
+    return numBytes;
 }
 
-void u8_inc(char *s, int *i) {
-    (void) (isutf(s[++(*i)]) || isutf(s[++(*i)]) ||
-            isutf(s[++(*i)]) || ++(*i));
+/*
+ * Collects the keys of `{"key": id, ...}` into the pool as it goes, with
+ * no parse tree in between.  Ids must be integers.
+ */
+static bool scanEncoder(vocabLoader_t *loader, const char *json,
+                        encoderEntry_t **entries, size_t *numEntries) {
+    const char *pos = skipSpace(json, json + loader->length);
+    const char *end = json + loader->length;
+    char *pool = loader->tables->strings;
+    size_t capacity = loader->length / 8 + 16;
+    *entries = malloc(capacity * sizeof(encoderEntry_t));
+    *numEntries = 0;
+    if (*entries == NULL || pos == end || *pos++ != '{') {
+        return false;
+    }
+    pos = skipSpace(pos, end);
+    if (pos < end && *pos == '}') {
+        return true;
+    }
+    while (pos < end) {
+        if (*pos != '"') {
+            return false;
+        }
+        size_t offset = loader->base + loader->used;
+        size_t length;
+        pos = scanString(pos, end, pool + offset, &length);
+        if (pos == NULL) {
+            return false;
+        }
+        /* Decoders write a token into MAX_TOKEN_BYTES. */
+        size_t numBytes = keyBytes(loader->tables, pool + offset, length);
+        if (numBytes == SIZE_MAX) {
+            loader->status = ERR_JSON_ALPHABET;
+            return false;
+        } else if (numBytes > MAX_TOKEN_BYTES) {
+            return false;
+        }
+        pool[offset + length] = '\0';
+        loader->used += length + 1;
+        pos = skipSpace(pos, end);
+        if (pos == end || *pos++ != ':') {
+            return false;
+        }
+        pos = skipSpace(pos, end);
+        bool negative = pos < end && *pos == '-';
+        pos += negative;
+        if (pos == end || *pos < '0' || *pos > '9') {
+            return false;
+        }
+        int64_t id = 0;
+        while (pos < end && *pos >= '0' && *pos <= '9' && id <= UINT32_MAX) {
+            id = id * 10 + (*pos++ - '0');
+        }
+        if (*numEntries == capacity) {
+            capacity *= 2;
+            encoderEntry_t *grown = realloc(*entries,
+                                            capacity *
+                                            sizeof(encoderEntry_t));
+            if (grown == NULL) {
+                return false;
+            }
+            *entries = grown;
+        }
+        encoderEntry_t *entry = &(*entries)[(*numEntries)++];
+        entry->offset = (uint32_t) offset;
+        entry->length = (uint32_t) length;
+        entry->id = negative ? -id : id;
+        pos = skipSpace(pos, end);
+        if (pos < end && *pos == '}') {
+            return true;
+        }
+        if (pos == end || *pos++ != ',') {
+            return false;
+        }
+        pos = skipSpace(pos, end);
+    }
+    return false;
 }
 
-size_t encodeCharBPE(codecTables_t *tables, char **ch, char **dest) {
-    uint16_t rune = tables->bytesToUnicode[**ch];
-    *ch = *ch + 1;
-    if (rune == 0) {
-        return 0;
-    } else if (rune < 0x80) {
-        **dest = (char) rune;
-        *dest = *dest + 1;
-        return 1;
-    } else {
-        **dest = (char) ((rune >> 6) | 0xC0);
-        *dest = *dest + 1;
-        **dest = (char) ((rune & 0x3F) | 0x80);
-        *dest = *dest + 1;
-        return 2;
+static void loadEncoder(vocabLoader_t *loader) {
+    codecTables_t *tables = loader->tables;
+    loader->status = ERR_JSON_FAILED;
+    FILE *f = fopen(loader->filename, "rb");
+    if (!f) {
+        loader->status = ERR_JSON_FOPEN;
+        return;
+    }
+    char *json = malloc(loader->length + 1);
+    if (json == NULL) {
+        fclose(f);
+        loader->status = ERR_JSON_MALLOC;
+        return;
+    }
+    size_t bytesRead = fread(json, 1, loader->length, f);
+    fclose(f);
+    encoderEntry_t *entries = NULL;
+    size_t numEntries = 0;
+    bool scanned = bytesRead == loader->length &&
+                   scanEncoder(loader, json, &entries, &numEntries);
+    free(json);
+    if (!scanned) {
+        free(entries);
+        return;
+    }
+
+    int64_t maxToken = -1;
+    for (size_t idx = 0; idx < numEntries; idx++) {
+        if (entries[idx].id > maxToken) maxToken = entries[idx].id;
+    }
+    /* Ids are dense, with room at most for the special tokens. */
+    if (maxToken >= (int64_t) (numEntries + MAX_SPECIAL_TOKENS)) {
+        free(entries);
+        return;
+    }
+    tables->numTokens = maxToken + 1;
+    loader->idBits = maxToken > UINT16_MAX ? 32 : 16;
+    tables->fromToken = calloc(tables->numTokens, sizeof(vocabToken_t));
+    if ((tables->fromToken == NULL && tables->numTokens != 0) ||
+        (loader->idBits == 16 ?
+         !vocabTableCreate16(&tables->toToken.t16, numEntries) :
+         !vocabTableCreate32(&tables->toToken.t32, numEntries))) {
+        free(entries);
+        loader->status = ERR_JSON_MALLOC;
+        return;
+    }
+    for (size_t idx = 0; idx < numEntries; idx++) {
+        const encoderEntry_t *entry = &entries[idx];
+        if (entry->id < 0) continue;
+        const char *key = tables->strings + entry->offset;
+        unsigned int hval = genHash(key, entry->length, 0);
+        if (loader->idBits == 16) {
+            hashInsert16(&tables->toToken.t16, tables->strings, hval,
+                         entry->offset, entry->length, 0,
+                         (uint16_t) entry->id);
+        } else {
+            hashInsert32(&tables->toToken.t32, tables->strings, hval,
+                         entry->offset, entry->length, 0,
+                         (uint32_t) entry->id);
+        }
+        tables->fromToken[entry->id].offset = entry->offset;
+        tables->fromToken[entry->id].length = entry->length;
     }
+    free(entries);
+    loader->status = CODEC_SUCCESS;
 }
 
+enum CODEC_STATUS readBpeVocabulary(const char *filename,
+                                    codecTables_t **table) {
+    vocabLoader_t loader = {.filename = filename, .tables = *table};
+    if (!fileSize(filename, &loader.length)) {
+        return ERR_BPE_FOPEN;
+    }
+    if (!poolReserve(*table, loader.length + 1)) {
+        return ERR_BPE_MALLOC;
+    }
+    loader.base = (*table)->stringsLen;
+    loadMerges(&loader);
+    (*table)->stringsLen += loader.used;
+    if (loader.status == CODEC_SUCCESS &&
+        !matchWidths(*table, (*table)->idBits, loader.idBits)) {
+        return ERR_BPE_MALLOC;
+    }
+    return loader.status;
+}
 
-rankedBigram_t *initBPE(codecTables_t *tables, rankedBigram_t *bigrams,
-                        const char *s, const size_t numBytes, char *encoded) {
-    char *inputPtr = (char *) s;
-    char *endPtr = (char *) s + numBytes;
-    rankedBigram_t *head = NULL;
-    size_t bigrams_ct = 1;
-    bigrams[0].left = encoded;
-    bigrams[0].hash = 0;
-    bigrams[0].repr = NULL;
-    bigrams[0].rank = 0;
-    bigrams[0].prev = NULL;
-    bigrams[0].next = NULL;
-    DL_APPEND(head, &(bigrams[0]));
-
-    size_t encodedLen = encodeCharBPE(tables, &inputPtr, &encoded);
-    bigrams[0].left_len = encodedLen;
-    if (inputPtr >= endPtr) {
-        bigrams[0].right_len = 0;
-        bigrams[0].right = NULL;
-        return head;
-    } else {
-        bigrams[0].right = encoded;
-        bigrams[0].right_len = encodeCharBPE(tables, &inputPtr, &encoded);
-    }
-    for (; inputPtr < endPtr;) {
-        DL_APPEND(head, &(bigrams[bigrams_ct]));
-        bigrams[bigrams_ct].right = encoded;
-        encodedLen = encodeCharBPE(tables, &inputPtr, &encoded);
-        bigrams[bigrams_ct].right_len = encodedLen;
-        bigrams[bigrams_ct].rank = 0;
-        bigrams[bigrams_ct].left = bigrams[bigrams_ct - 1].right;
-        bigrams[bigrams_ct].left_len = bigrams[bigrams_ct - 1].right_len;
-        bigrams[bigrams_ct].repr = NULL;
-        bigrams[bigrams_ct].hash = 0;
-        bigrams_ct++;
-    }
-    *encoded = '\0';
-    return head;
-}
-
-bool mergeNeighboringBigrams(rankedBigram_t *head, rankedBigram_t *bigram) {
-    rankedBigram_t *prev = bigram->prev;
-    rankedBigram_t *next = bigram->next;
-    if (prev != NULL && bigram != head) {
-        prev->right_len += bigram->right_len;
-        prev->repr = NULL;
-        prev->rank = 0;
-        prev->hash = 0;
-    }
-    if (next != NULL) {
-        next->left -= bigram->left_len;
-        next->left_len += bigram->left_len;
-        next->repr = NULL;
-        next->rank = 0;
-        next->hash = 0;
+enum CODEC_STATUS readEncoderDefinitions(const char *filename,
+                                         codecTables_t **tables) {
+    *tables = calloc(1, sizeof(codecTables_t));
+    if (*tables == NULL) {
+        return ERR_JSON_MALLOC;
     }
-    return true;
+    vocabLoader_t loader = {.filename = filename, .tables = *tables};
+    if (!fileSize(filename, &loader.length)) {
+        return ERR_JSON_FOPEN;
+    }
+    if (!poolReserve(*tables, loader.length + 1)) {
+        return ERR_JSON_MALLOC;
+    }
+    loader.base = (*tables)->stringsLen;
+    loadEncoder(&loader);
+    (*tables)->stringsLen += loader.used;
+    (*tables)->idBits = loader.idBits;
+    return loader.status;
 }
 
+void freeCodecTables(codecTables_t *tables) {
+    if (tables == NULL) {
+        return;
+    }
+    free(tables->strings);
+    if (tables->idBits == 16) {
+        free(tables->toToken.t16.slots);
+        free(tables->bpeRanks.t16.slots);
+        free(tables->bpePairs.t16.slots);
+    } else {
+        free(tables->toToken.t32.slots);
+        free(tables->bpeRanks.t32.slots);
+        free(tables->bpePairs.t32.slots);
+    }
+    free(tables->fromToken);
+    WordCacheClose(tables->wordCache);
+    free(tables);
+}
 
-size_t toBPE(codecTables_t *tables, const char *s, const size_t numBytes,
-             rankedBigram_t *bigramsBuffer, char *transcode) {
-    TokenCacheEntry *cacheEntry;
-    /* HASH_FIND_STR(tables->tokenCache, s, cacheEntry);
-    if (cacheEntry != NULL) {
-        return cacheEntry->numTokens;
-    } */
-    size_t numBigrams = 0;
-    size_t numDups = 0;
-    rankedBigram_t *bigrams = initBPE(tables, bigramsBuffer, s, numBytes,
-                                      transcode);
-    rankedBigram_t *highestBigram = rankBigrams(tables, bigrams,
-                                                &numDups, &numBigrams);
-    // showBigrams(bigrams);
-    while (highestBigram->rank != 65535 && highestBigram->rank != 0 &&
-           numBigrams > 1) {
-        rankedBigram_t *bigram;
-        rankedBigram_t *tmpBigram;
-        DL_FOREACH_SAFE(highestBigram, bigram, tmpBigram) {
-            if (bigram->hash != 0 && highestBigram->hash == bigram->hash) {
-                mergeNeighboringBigrams(bigrams, bigram);
-                DL_DELETE(bigrams, bigram);
-                numBigrams--;
-                if (numDups > 0) {
-                    numDups--;
-                } else {
-                    break;
-                }
-            }
+enum CODEC_STATUS addSpecialToken(codecTables_t *tables, const char *text,
+                                  uint32_t id) {
+    size_t len = strlen(text);
+    if (len == 0 || len > MAX_TOKEN_BYTES ||
+        (tables->idBits == 16 && id > UINT16_MAX)) {
+        return ERR_SPECIAL_INVALID;
+    }
+    size_t index;
+    for (index = 0; index < tables->numSpecial; index++) {
+        const specialToken_t *token = &tables->special[index];
+        if (token->length == len &&
+            memcmp(tables->strings + token->offset, text, len) == 0) {
+            break;
         }
-        highestBigram = rankBigrams(tables, bigrams, &numDups, &numBigrams);
-        if (numBigrams <= 1) break;
-    }
-
-    rankedBigram_t *bigram;
-    // showBigrams(bigrams);
-    // printf("TOKENS: ");
-    size_t tokens_ct = 0;
-    DL_FOREACH(bigrams, bigram) {
-        printf("TOKEN: |");
-        if (bigram->rank != 65535) {
-            /* printf("|%.*s%.*s", (int)bigram->left_len, bigram->left,
-                   (int)bigram->right_len, bigram->right); */
-            EscapePrints(bigram->left, bigram->left_len);
-            EscapePrints(bigram->right, bigram->right_len);
-            printf("|");
-            tokens_ct += 1;
-        } else {
-            EscapePrints(bigram->left, bigram->left_len);
-            //printf("|%.*s", (int)bigram->left_len, bigram->left);
-            tokens_ct += 1;
-            printf("|");
-            if (bigram->next == NULL && bigram->right_len != 0) {
-                EscapePrints(bigram->right, bigram->right_len);
-                //printf("|%.*s", (int)bigram->right_len, bigram->right);
-                tokens_ct += 1;
-                printf("|");
-            }
+    }
+    if (index == MAX_SPECIAL_TOKENS) {
+        return ERR_SPECIAL_INVALID;
+    }
+    if (id >= tables->numTokens) {
+        /* Tokens beyond the vocabulary still need to decode. */
+        vocabToken_t *fromToken = realloc(tables->fromToken,
+                                          (id + 1) * sizeof(vocabToken_t));
+        if (fromToken == NULL) {
+            return ERR_SPECIAL_MALLOC;
+        }
+        memset(fromToken + tables->numTokens, 0,
+               (id + 1 - tables->numTokens) * sizeof(vocabToken_t));
+        tables->fromToken = fromToken;
+        tables->numTokens = id + 1;
+    }
+    specialToken_t *token = &tables->special[index];
+    if (index == tables->numSpecial) {
+        if (!poolReserve(tables, len + 1)) {
+            return ERR_SPECIAL_MALLOC;
         }
-        printf("\n");
+        token->offset = poolAppend(tables, text, len);
+        token->length = len;
+        tables->specialFirst[(unsigned char) text[0]] |= (uint64_t) 1 << index;
+        tables->numSpecial++;
+    }
+    token->id = id;
+    if (tables->fromToken[id].length == 0) {
+        tables->fromToken[id].offset = token->offset;
+        tables->fromToken[id].length = token->length;
+        tables->fromToken[id].literal = 1;
     }
-    cacheEntry = (TokenCacheEntry *) malloc(sizeof *cacheEntry);
-    cacheEntry->numTokens = tokens_ct;
-    cacheEntry->id = strdup(s);
-    // HASH_ADD_STR(tables->tokenCache, id, cacheEntry);
-    return tokens_ct;
+    return CODEC_SUCCESS;
 }
 
 // ==========================================================================
@@ -517,7 +757,7 @@ size_t toUnicode(const codecTables_t *tables, const char *s, char **unicode,
     *unicode = malloc(numchars * 2);
     char *dest = *unicode;
     for (int idx = 0; idx < numchars; idx++) {
-        uint16_t rune = tables->bytesToUnicode[s[idx]];
+        uint16_t rune = tables->bytesToUnicode[(unsigned char) s[idx]];
         if (rune < 0x80) {
             *dest++ = (char) rune;
         } else {
@@ -530,42 +770,6 @@ size_t toUnicode(const codecTables_t *tables, const char *s, char **unicode,
     return sz;
 }
 
-void SplitWords(codecTables_t *tables, const char *s) {
-    CalibrateRdtscTicks();
-    uint64_t start_rdtsc, end_rdtsc;
-    uint64_t host_cpu_ticks;
-    double host_cpu_ns;
-    double host_cpu_us;
-    double host_cpu_s;
-    double tokens_per_us;
-    start_rdtsc = RDTSC();
-    regmatch_t match;
-    int regex_status = 0;
-    size_t token_ct = 0;
-    const char *s_ptr = s;
-    rankedBigram_t bigrams[256];
-    char unicode[256];
-    while (regex_status == 0) {
-        regex_status = regexec(&tables->pattern, s_ptr, 1, &match, 0);
-        token_ct += toBPE(tables, s_ptr, match.rm_eo,
-                          (rankedBigram_t *) &bigrams, unicode);
-        //printf("%.*s\n", match.rm_eo, s_ptr);
-        s_ptr += match.rm_eo;
-    }
-    end_rdtsc = RDTSC();
-    // Calculate rates
-    host_cpu_ticks = end_rdtsc - start_rdtsc;
-    host_cpu_ns = host_cpu_ticks / g_TicksPerNanoSec;
-    host_cpu_us = host_cpu_ns / 1000;
-    host_cpu_s = host_cpu_ns / 1000000000;
-    tokens_per_us = token_ct / host_cpu_us;
-    printf("%.2lf token/µs, %zu tokens, %.4f seconds, %llu ticks\n",
-           tokens_per_us,
-           token_ct,
-           host_cpu_s,
-           host_cpu_ticks);
-}
-
 // UTF8PROC_CATEGORY_CN  = 0, /**< Other, not assigned */
 // UTF8PROC_CATEGORY_LU  = 1, /**< Letter, uppercase */
 // UTF8PROC_CATEGORY_LL  = 2, /**< Letter, lowercase */
@@ -597,182 +801,679 @@ void SplitWords(codecTables_t *tables, const char *s) {
 // UTF8PROC_CATEGORY_CS = 28, /**< Other, surrogate */
 // UTF8PROC_CATEGORY_CO = 29, /**< Other, private use */
 
+/*
+ * The splitter follows the GPT-2 pre-tokenizer pattern
+ *
+ *   's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+ *
+ * in one pass over the bytes, looking at most one rune ahead.  It works on
+ * the raw input: bytes that are not well-formed UTF-8 are punctuation as far
+ * as the pattern goes, and every byte ends up in exactly one pre-token.
+ */
+enum PRETOKEN_KIND {
+    PRE_EMPTY,
+    PRE_LETTERS,
+    PRE_NUMBERS,
+    PRE_OTHER,
+    PRE_SPACES,
+    PRE_APOSTROPHE               /* "'", "'r", "'v" or "'l", which may yet
+                                    become a contraction */
+};
+
+/* Stands in for a byte that does not start a well-formed sequence. */
+#define INVALID_RUNE (-1)
+
+/*
+ * Pre-tokens are encoded into a batch and reach the sink when it fills.
+ * Short ones that are not a token as a whole take a lane and merge along
+ * with the other lanes of the batch once it is flushed.
+ */
+#define BATCH_LANES 32
+#define BATCH_WORDS 128
+#define BATCH_TOKENS 2048
+#define NO_LANE UINT32_MAX
+
+typedef struct {
+    uint32_t length;             /* input bytes, the words are contiguous */
+    uint32_t lane;               /* or NO_LANE when its tokens are known */
+    uint32_t first;              /* into the batch tokens */
+    uint32_t numTokens;
+} batchWord_t;
+
 typedef struct {
-    bool apostrophe;
-    bool priorIsLiteralSpace;
-    bool priorIsUnicodeSpace;
-    bool priorIsNumber;
-    bool priorIsLetter;
-    bool priorIsNewline;
-    bool priorIsOther;
-    size_t numLiteralSpaces;
-    size_t numSpaces;
+    enum PRETOKEN_KIND kind;     /* of the buffered pre-token */
     size_t buffIdx;
+    size_t lastRune;             /* where the last rune of a run of white
+                                    space starts in the buffer */
     size_t numTokens;
     size_t inputSize;
-    size_t bytesScanned;
+    size_t inputPos;             /* offset of the rune being split */
+    size_t wordStart;            /* offset of the buffered pre-token */
+    const unsigned char *input;
+    uint64_t specialMask;        /* allowSpecial | denySpecial */
+    uint64_t denySpecial;
+    enum CODEC_STATUS status;
+    tokenSink_t sink;            /* only with 16 bit tables */
+    tokenSink32_t sink32;
+    wordSink_t wordSink;         /* splits without encoding */
+    void *sinkCtx;
+    codecStats_t *stats;
     codecTables_t *codec;
-    char buffer[256];
-    char unicode[256];
-    rankedBigram_t bigrams[256];
+    char buffer[256];            /* the input bytes of the pre-token */
+    char unicode[512];
+    union {
+        rankedBigram16_t b16[256];
+        rankedBigram32_t b32[256];
+    } bigrams;
+    union {
+        uint16_t t16[256];
+        uint32_t t32[256];
+    } tokens;
+    batchWord_t batch[BATCH_WORDS];
+    size_t batchLen;
+    size_t batchStart;           /* input offset of the first word */
+    size_t numLanes;
+    size_t numBatchTokens;
+    union {
+        mergeLane16_t l16[BATCH_LANES];
+        mergeLane32_t l32[BATCH_LANES];
+    } lanes;
+    union {
+        uint16_t t16[BATCH_TOKENS];
+        uint32_t t32[BATCH_TOKENS];
+    } batchTokens;
 } SplitterState;
 
+/* Hands numTokens ids of the codec's width to whichever sink is set. */
+static void emitTokens(SplitterState *state, const void *tokens,
+                       size_t numTokens, size_t offset, size_t length) {
+    if (state->sink != NULL) {
+        state->sink((const uint16_t *) tokens, numTokens, offset, length,
+                    state->sinkCtx);
+    } else if (state->sink32 != NULL) {
+        if (state->codec->idBits == 16) {
+            /* Widened from the back, so that ids already in place in
+               state->tokens are read before the wider ones land on them. */
+            const uint16_t *narrow = (const uint16_t *) tokens;
+            for (size_t idx = numTokens; idx-- > 0;) {
+                state->tokens.t32[idx] = narrow[idx];
+            }
+            tokens = state->tokens.t32;
+        }
+        state->sink32((const uint32_t *) tokens, numTokens, offset, length,
+                      state->sinkCtx);
+    }
+}
 
-void flushState(SplitterState *state) {
-    state->buffer[state->buffIdx] = '\0';
-    /* printf("SPLIT: |");
-    EscapePrints(state->buffer, 0);
-    printf("|\n"); */
-    state->numTokens += toBPE(state->codec, state->buffer, state->buffIdx,
-                              (rankedBigram_t *) &state->bigrams,
-                              state->unicode);
-    // fflush(stdout);
-
-    state->apostrophe = false;
-    state->priorIsLiteralSpace = false;
-    state->priorIsUnicodeSpace = false;
-    state->priorIsNumber = false;
-    state->priorIsLetter = false;
-    state->priorIsOther = false;
-    state->priorIsNewline = false;
-    state->numSpaces = 0;
-    state->numLiteralSpaces = 0;
-    state->buffIdx = 0;
-}
-
-int codePoint(int rune, void *inputState) {
-    SplitterState *state = (SplitterState *) inputState;
-    bool isSpace = false;
-    bool isLiteralSpace = false;
-    bool isNewline = false;
-    //printf("RUNE: %d TYPE: %s\n", rune, utf8proc_category_string(rune));
-    if (rune < 127) {
-        char charRune = (char) rune;
-        state->buffer[state->buffIdx] = charRune;
-        if (state->apostrophe) {
-            switch (charRune) {
-                case 's':
-                case 't':
-                case 'm':
-                case 'd':
-                    if (state->buffIdx == 1) {
-                        flushState(state);
-                        return rune;
-                    }
-                    state->apostrophe = false;
-                    break;
-                case 'l':
-                    if (state->buffIdx == 2 &&
-                        state->buffer[state->buffIdx - 1] == 'l') {
-                        flushState(state);
-                        return rune;
-                    }
-                    state->apostrophe = false;
-                    break;
-                case 'r':
-                case 'v':
-                    if (state->buffIdx != 1)
-                        state->apostrophe = false;
-                    break;
-                case 'e':
-                    if (state->buffIdx == 2) {
-                        flushState(state);
-                        return rune;
-                    }
-                default:
-                    state->apostrophe = false;
+/* Copies the tokens of the buffered word from the shared cache, if any. */
+static size_t cachedTokens(SplitterState *state, size_t numBytes,
+                           void *tokens) {
+    wordCache_t *cache = state->codec->wordCache;
+    if (cache == NULL || numBytes < WORD_CACHE_MIN_BYTES ||
+        numBytes > WORD_CACHE_KEY_BYTES) {
+        return 0;
+    }
+    size_t numTokens = WordCacheLookup(cache, state->buffer, numBytes,
+                                       tokens);
+    codecStats_t *stats = state->stats;
+    if (stats != NULL) {
+        stats->cacheLookups++;
+        if (numTokens != 0) {
+            stats->cacheHits++;
+            stats->words++;
+            stats->tokens += numTokens;
+            statsCount(stats->wordBytes, numBytes);
+            statsCount(stats->wordMerges, 0);
+        }
+    }
+    return numTokens;
+}
+
+static void cacheTokens(SplitterState *state, const char *word,
+                        size_t length, const void *tokens, size_t numTokens) {
+    if (state->codec->wordCache != NULL) {
+        WordCacheInsert(state->codec->wordCache, word, length, tokens,
+                        numTokens);
+    }
+}
+
+/* Merges the lanes and hands every word of the batch to the sink. */
+static void flushBatch(SplitterState *state) {
+    /* Also when only splitting, without a codec. */
+    if (state->batchLen == 0) {
+        return;
+    }
+    bool narrow = state->codec->idBits == 16;
+    if (state->numLanes != 0 && narrow) {
+        mergeLanes16(state->codec, state->lanes.l16, state->numLanes,
+                     state->stats);
+    } else if (state->numLanes != 0) {
+        mergeLanes32(state->codec, state->lanes.l32, state->numLanes,
+                     state->stats);
+    }
+    size_t offset = state->batchStart;
+    for (size_t idx = 0; idx < state->batchLen; idx++) {
+        batchWord_t *word = &state->batch[idx];
+        uint16_t *tokens16 = state->batchTokens.t16 + word->first;
+        uint32_t *tokens32 = state->batchTokens.t32 + word->first;
+        void *tokens = narrow ? (void *) tokens16 : (void *) tokens32;
+        if (word->lane != NO_LANE) {
+            const mergeLane16_t *lane16 = &state->lanes.l16[word->lane];
+            const mergeLane32_t *lane32 = &state->lanes.l32[word->lane];
+            word->numTokens = (uint32_t) (narrow ?
+                    laneTokens16(lane16, tokens16) :
+                    laneTokens32(lane32, tokens32));
+            if (state->stats != NULL) {
+                state->stats->words++;
+                state->stats->tokens += word->numTokens;
+                statsCount(state->stats->wordBytes, word->length);
+                statsCount(state->stats->wordMerges, narrow ?
+                                                     lane16->numMerges :
+                                                     lane32->numMerges);
             }
+            cacheTokens(state, (const char *) state->input + offset,
+                        word->length, tokens, word->numTokens);
         }
-        switch (charRune) {
-            case '\'':
-                if (state->buffIdx == 0) state->apostrophe = true;
-                return rune;
-            case ' ':
-                if (state->buffIdx != 0 && state->numLiteralSpaces == 0) {
-                    flushState(state);
-                    state->buffer[0] = charRune;
-                    state->buffIdx++;
-                    return rune;
-                } else if (state->buffIdx == state->numLiteralSpaces) {
-                    state->numLiteralSpaces++;
-                    isLiteralSpace = true;
-                }
-            case '\f':
-            case '\r':
-            case '\v':
-            case '\t':
-            case '\n':
-                isSpace = true;
-                state->numSpaces++;
-            default:
-                break;
+        state->numTokens += word->numTokens;
+        emitTokens(state, tokens, word->numTokens, offset, word->length);
+        offset += word->length;
+    }
+    state->batchLen = 0;
+    state->numLanes = 0;
+    state->numBatchTokens = 0;
+}
+
+/*
+ * Encodes the first numBytes of the buffer as a pre-token of their own,
+ * into the batch.
+ */
+static void flushBytes(SplitterState *state, size_t numBytes) {
+    if (state->wordSink != NULL) {
+        state->wordSink(state->buffer, numBytes, state->sinkCtx);
+        state->wordStart += numBytes;
+        state->buffIdx -= numBytes;
+        memmove(state->buffer, state->buffer + numBytes, state->buffIdx);
+        state->lastRune = 0;
+        return;
+    }
+    /* A word never has more tokens than bytes. */
+    if (state->numBatchTokens + numBytes > BATCH_TOKENS) {
+        flushBatch(state);
+    }
+    codecTables_t *codec = state->codec;
+    bool narrow = codec->idBits == 16;
+    bool kernel = narrow ? codec->bpePairs.t16.slots != NULL :
+                  codec->bpePairs.t32.slots != NULL;
+    if (state->batchLen == 0) {
+        state->batchStart = state->wordStart;
+    }
+    batchWord_t *word = &state->batch[state->batchLen++];
+    word->length = (uint32_t) numBytes;
+    word->lane = NO_LANE;
+    word->first = (uint32_t) state->numBatchTokens;
+    word->numTokens = 1;
+    uint16_t *tokens16 = state->batchTokens.t16 + word->first;
+    uint32_t *tokens32 = state->batchTokens.t32 + word->first;
+    void *tokens = narrow ? (void *) tokens16 : (void *) tokens32;
+    size_t encodedLen, cached;
+    if (narrow ? wholeWord16(codec, state->buffer, numBytes, state->unicode,
+                             &encodedLen, tokens16, state->stats) :
+        wholeWord32(codec, state->buffer, numBytes, state->unicode,
+                    &encodedLen, tokens32, state->stats)) {
+        state->numBatchTokens++;
+    } else if ((cached = cachedTokens(state, numBytes, tokens)) != 0) {
+        word->numTokens = (uint32_t) cached;
+        state->numBatchTokens += cached;
+    } else if (kernel && numBytes <= LANE_PIECES) {
+        word->lane = (uint32_t) state->numLanes++;
+        if (narrow) {
+            loadLane16(codec, &state->lanes.l16[word->lane], state->buffer,
+                       numBytes);
+        } else {
+            loadLane32(codec, &state->lanes.l32[word->lane], state->buffer,
+                       numBytes);
+        }
+        state->numBatchTokens += numBytes;
+    } else {
+        word->numTokens = (uint32_t) (narrow ?
+                mergeBigrams16(codec, state->unicode, encodedLen, numBytes,
+                               state->bigrams.b16, tokens16, state->stats) :
+                mergeBigrams32(codec, state->unicode, encodedLen, numBytes,
+                               state->bigrams.b32, tokens32, state->stats));
+        state->numBatchTokens += word->numTokens;
+        cacheTokens(state, state->buffer, numBytes, tokens, word->numTokens);
+    }
+    state->wordStart += numBytes;
+    state->buffIdx -= numBytes;
+    memmove(state->buffer, state->buffer + numBytes, state->buffIdx);
+    state->lastRune = 0;
+    if (state->numLanes == BATCH_LANES || state->batchLen == BATCH_WORDS) {
+        flushBatch(state);
+    }
+}
+
+void flushState(SplitterState *state) {
+    if (state->buffIdx != 0) {
+        flushBytes(state, state->buffIdx);
+    }
+    state->kind = PRE_EMPTY;
+}
+
+/*
+ * The input, or the text in front of a special token, ends here.  A "'r"
+ * or "'v" without its 'e' is an apostrophe and the start of a word.
+ */
+static void finishText(SplitterState *state) {
+    if (state->kind == PRE_APOSTROPHE && state->buffIdx == 2) {
+        flushBytes(state, 1);
+    }
+    flushState(state);
+    flushBatch(state);
+}
+
+/*
+ * Called with the registered special tokens that start with the current
+ * byte.  The longest one present in the input wins; an allowed token is
+ * emitted as its id.  Returns the number of bytes it spans.
+ */
+static size_t matchSpecialToken(SplitterState *state, uint64_t candidates) {
+    const codecTables_t *tables = state->codec;
+    const unsigned char *s = state->input + state->inputPos;
+    size_t remaining = state->inputSize - state->inputPos;
+    const specialToken_t *match = NULL;
+    uint64_t matchBit = 0;
+    while (candidates != 0) {
+        uint64_t bit = candidates & -candidates;
+        const specialToken_t *token =
+                &tables->special[__builtin_ctzll(candidates)];
+        candidates &= candidates - 1;
+        if (token->length <= remaining &&
+            (match == NULL || token->length > match->length) &&
+            memcmp(s, tables->strings + token->offset, token->length) == 0) {
+            match = token;
+            matchBit = bit;
+        }
+    }
+    if (match == NULL) {
+        return 0;
+    }
+    if (matchBit & state->denySpecial) {
+        /* The pre-tokens in front of it still reach the sink. */
+        flushBatch(state);
+        state->status = ERR_SPECIAL_DENIED;
+        return match->length;
+    }
+    finishText(state);
+    state->numTokens += 1;
+    if (state->codec->idBits == 16) {
+        state->tokens.t16[0] = (uint16_t) match->id;
+    } else {
+        state->tokens.t32[0] = match->id;
+    }
+    emitTokens(state, &state->tokens, 1, state->inputPos, match->length);
+    state->wordStart = state->inputPos + match->length;
+    return match->length;
+}
+
+/*
+ * Decodes the rune at `s`.  A byte that does not start a well-formed
+ * sequence comes back on its own as INVALID_RUNE, so the caller neither
+ * fails nor has to validate the input first.
+ */
+static size_t decodeRune(const unsigned char *s, size_t remaining,
+                         int32_t *rune) {
+    unsigned char lead = s[0];
+    unsigned char lower = 0x80;
+    unsigned char upper = 0xBF;
+    size_t length;
+    int32_t value;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+        value = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        value = lead & 0x0F;
+        if (lead == 0xE0) lower = 0xA0;                // overlong
+        if (lead == 0xED) upper = 0x9F;                // surrogates
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        value = lead & 0x07;
+        if (lead == 0xF0) lower = 0x90;                // overlong
+        if (lead == 0xF4) upper = 0x8F;                // beyond U+10FFFF
+    } else {
+        *rune = INVALID_RUNE;
+        return 1;
+    }
+    if (remaining < length) {
+        *rune = INVALID_RUNE;
+        return 1;
+    }
+    for (size_t idx = 1; idx < length; idx++) {
+        if (s[idx] < lower || s[idx] > upper) {
+            *rune = INVALID_RUNE;
+            return 1;
+        }
+        lower = 0x80;
+        upper = 0xBF;
+        value = value << 6 | (s[idx] & 0x3F);
+    }
+    *rune = value;
+    return length;
+}
+
+/*
+ * The kind of pre-token a rune belongs in, INVALID_RUNE included; \s is
+ * Unicode White_Space.
+ */
+static enum PRETOKEN_KIND runeClass(int32_t rune) {
+    if (rune < 0x80) {
+        if ((rune | 0x20) >= 'a' && (rune | 0x20) <= 'z') {
+            return PRE_LETTERS;
+        } else if (rune >= '0' && rune <= '9') {
+            return PRE_NUMBERS;
+        } else if (rune == ' ' || (rune >= '\t' && rune <= '\r')) {
+            return PRE_SPACES;
         }
+        return PRE_OTHER;
+    }
+    switch (rune) {
+        case 0x85:
+        case 0xA0:
+        case 0x1680:
+        case 0x2028:
+        case 0x2029:
+        case 0x202F:
+        case 0x205F:
+        case 0x3000:
+            return PRE_SPACES;
+        default:
+            if (rune >= 0x2000 && rune <= 0x200A) {
+                return PRE_SPACES;
+            }
     }
-    bool isLetter = false, isNumber = false, isOther = false;
-    utf8proc_int32_t unicodeCategory = utf8proc_category(rune);
-    // printf("%s\n", utf8proc_category_string(rune));
-    switch (unicodeCategory) {
+    switch (utf8proc_category(rune)) {
         case UTF8PROC_CATEGORY_LU:
         case UTF8PROC_CATEGORY_LL:
         case UTF8PROC_CATEGORY_LT:
         case UTF8PROC_CATEGORY_LM:
         case UTF8PROC_CATEGORY_LO:
-            isLetter = true;
-            break;
+            return PRE_LETTERS;
         case UTF8PROC_CATEGORY_ND:
         case UTF8PROC_CATEGORY_NL:
         case UTF8PROC_CATEGORY_NO:
-            isNumber = true;
-            break;
-        case UTF8PROC_CATEGORY_ZS:
-        case UTF8PROC_CATEGORY_ZL:
-        case UTF8PROC_CATEGORY_ZP:
-            isSpace = true;
-            break;
-        case UTF8PROC_CATEGORY_CC:
-            if (isSpace) break;
+            return PRE_NUMBERS;
         default:
-            isOther = true;
-    }
-    if ((isLetter && state->priorIsNumber) ||   // letters -> numbers
-        (isNumber && state->priorIsLetter) ||   // numbers -> letters
-        ((isLetter || isNumber) &&              // litSpace -> numbers/letters
-         state->priorIsLiteralSpace &&
-         state->buffIdx > 1) ||
-        ((isLetter || isNumber || isOther) &&   // unicodeSpace ->
-         state->priorIsUnicodeSpace) ||         //   non-unicodeSpace
-        ((isLetter || isNumber) &&             // other -> letter/number
-         state->priorIsOther) ||
-        (isSpace && state->priorIsOther) ||
-        ((isSpace || isOther) &&                // letter/number ->
-         (state->priorIsLetter ||               //   space / other
-          state->priorIsNumber)) ||
-        (isSpace &&
-         (state->priorIsLetter ||
-          state->priorIsNumber ||
-          (state->priorIsUnicodeSpace &&
-           state->numSpaces == 3)))) // newlines
-    {
+            return PRE_OTHER;
+    }
+}
+
+static void appendRune(SplitterState *state, size_t runeLen) {
+    memcpy(state->buffer + state->buffIdx, state->input + state->inputPos,
+           runeLen);
+    state->buffIdx += runeLen;
+}
+
+void splitRune(SplitterState *state, int32_t rune, size_t runeLen) {
+    enum PRETOKEN_KIND class = runeClass(rune);
+    if (state->stats != NULL) {
+        if (rune >= 0 && rune < 0x80) {
+            state->stats->asciiRunes++;
+        } else {
+            state->stats->otherRunes++;
+        }
+    }
+    /* Overlong pre-tokens are split rather than overrun the buffers. */
+    if (state->buffIdx + 4 >= sizeof(state->buffer)) {
         flushState(state);
     }
-    size_t numBytes = utf8proc_encode_char(
-            rune, (utf8proc_uint8_t *)
-                    &state->buffer[state->buffIdx]);
-    state->buffIdx += numBytes;
-    state->priorIsLiteralSpace = isLiteralSpace;
-    state->priorIsUnicodeSpace = isSpace;
-    state->priorIsLetter = isLetter;
-    state->priorIsNumber = isNumber;
-    state->priorIsOther = isOther;
-    state->priorIsNewline = isNewline;
-    state->bytesScanned += numBytes;
-    return 0;
+    switch (state->kind) {
+        case PRE_EMPTY:
+            break;
+        case PRE_LETTERS:
+        case PRE_NUMBERS:
+        case PRE_OTHER:
+            if (class == state->kind) {
+                appendRune(state, runeLen);
+                return;
+            }
+            flushState(state);
+            break;
+        case PRE_SPACES:
+            if (class == PRE_SPACES) {
+                state->lastRune = state->buffIdx;
+                appendRune(state, runeLen);
+                return;
+            }
+            /* \s+(?!\S) leaves the last rune of the run to what follows,
+               which takes it when it is a plain space. */
+            if (state->lastRune != 0) {
+                flushBytes(state, state->lastRune);
+            }
+            if (state->buffer[0] == ' ') {
+                state->kind = class;
+                appendRune(state, runeLen);
+                return;
+            }
+            flushState(state);
+            break;
+        case PRE_APOSTROPHE:
+            if (state->buffIdx == 1) {
+                switch (rune) {
+                    case 's':
+                    case 't':
+                    case 'm':
+                    case 'd':
+                        appendRune(state, runeLen);
+                        flushState(state);
+                        return;
+                    case 'r':
+                    case 'v':
+                    case 'l':
+                        appendRune(state, runeLen);
+                        return;
+                    default:
+                        break;
+                }
+                state->kind = PRE_OTHER;
+                if (class == PRE_OTHER) {
+                    appendRune(state, runeLen);
+                    return;
+                }
+                flushState(state);
+                break;
+            }
+            if (rune == (state->buffer[1] == 'l' ? 'l' : 'e')) {
+                appendRune(state, runeLen);
+                flushState(state);
+                return;
+            }
+            /* Not a contraction after all. */
+            flushBytes(state, 1);
+            state->kind = PRE_LETTERS;
+            if (class == PRE_LETTERS) {
+                appendRune(state, runeLen);
+                return;
+            }
+            flushState(state);
+            break;
+    }
+    state->kind = rune == '\'' ? PRE_APOSTROPHE : class;
+    appendRune(state, runeLen);
+}
+
+/* Feeds the whole input through the splitter, special tokens first. */
+static void splitInput(SplitterState *state) {
+    const unsigned char *s = state->input;
+    size_t numBytes = state->inputSize;
+    size_t pos = 0;
+    while (pos < numBytes) {
+        state->inputPos = pos;
+        uint64_t candidates = state->specialMask == 0 ? 0 :
+                state->specialMask & state->codec->specialFirst[s[pos]];
+        if (candidates != 0) {
+            size_t matched = matchSpecialToken(state, candidates);
+            if (state->status != CODEC_SUCCESS) {
+                break;
+            } else if (matched != 0) {
+                pos += matched;
+                continue;
+            }
+        }
+        int32_t rune = s[pos];
+        size_t runeLen = 1;
+        if (rune >= 0x80) {
+            runeLen = decodeRune(s + pos, numBytes - pos, &rune);
+        }
+        splitRune(state, rune, runeLen);
+        pos += runeLen;
+    }
+    if (state->status == CODEC_SUCCESS) {
+        state->inputPos = numBytes;
+        finishText(state);
+    }
+}
+
+void SplitText(const char *text, size_t numBytes, wordSink_t sink,
+               void *ctx) {
+    SplitterState state = {.inputSize = numBytes,
+                           .input = (const unsigned char *) text,
+                           .status = CODEC_SUCCESS,
+                           .wordSink = sink,
+                           .sinkCtx = ctx};
+    splitInput(&state);
+}
+
+/* Whether a special token of the loaded codec lies across `cut`. */
+static bool specialStraddles(const unsigned char *data, size_t length,
+                             size_t cut) {
+    const codecTables_t *tables = codecTables;
+    if (tables == NULL || tables->numSpecial == 0) {
+        return false;
+    }
+    size_t from = cut > MAX_TOKEN_BYTES ? cut - MAX_TOKEN_BYTES : 0;
+    for (size_t pos = from; pos < cut; pos++) {
+        uint64_t candidates = tables->specialFirst[data[pos]];
+        while (candidates != 0) {
+            const specialToken_t *token =
+                    &tables->special[__builtin_ctzll(candidates)];
+            candidates &= candidates - 1;
+            if (pos + token->length > cut && pos + token->length <= length &&
+                memcmp(data + pos, tables->strings + token->offset,
+                       token->length) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    size_t end;                  /* of the pre-tokens seen so far */
+    size_t cut;
+    bool afterSpaces;            /* the last pre-token was whitespace */
+} cutSearch_t;
+
+/*
+ * Notes the start of every pre-token that the bytes past the buffer can
+ * no longer change.  Not after whitespace: `\s+(?!\S)` gave the last rune
+ * of the run to the pre-token that follows, and a chunk ending there would
+ * keep the whole run as one.
+ */
+static void noteCut(const char *word, size_t length, void *ctx) {
+    cutSearch_t *search = (cutSearch_t *) ctx;
+    size_t start = search->end;
+    search->end += length;
+    if (!search->afterSpaces &&
+        search->end + SPLITTER_LOOKAHEAD <= search->length &&
+        !specialStraddles(search->data, search->length, start)) {
+        search->cut = start;
+    }
+    /* A pre-token is whitespace if its last rune is. */
+    const unsigned char *bytes = (const unsigned char *) word;
+    int32_t rune = INVALID_RUNE;
+    for (size_t pos = length > 4 ? length - 4 : 0; pos < length;) {
+        if (bytes[pos] < 0x80) {
+            rune = bytes[pos++];
+        } else {
+            pos += decodeRune(bytes + pos, length - pos, &rune);
+        }
+    }
+    search->afterSpaces = runeClass(rune) == PRE_SPACES;
+}
+
+/*
+ * Cuts after a newline that stands between two characters other than
+ * whitespace, or before a space that starts a word after a non-space.
+ * GPT-2 never joins a pre-token across either.  Text without either, such
+ * as CJK or text without spaces, is split from the start to find the last
+ * pre-token boundary that the rest of the input cannot move.
+ */
+size_t SplitterCutPoint(const char *text, size_t length) {
+    const unsigned char *data = (const unsigned char *) text;
+    for (size_t pos = length; pos-- > 2;) {
+        unsigned char ch = data[pos];
+        unsigned char prior = data[pos - 1];
+        unsigned char before = data[pos - 2];
+        size_t cut = 0;
+        if (prior == '\n' && ch < 0x80 && !isspace(ch) &&
+            before < 0x80 && !isspace(before)) {
+            cut = pos;
+        } else if (prior == ' ' && isalpha(ch) && before < 0x80 &&
+                   !isspace(before)) {
+            cut = pos - 1;
+        }
+        if (cut != 0 && !specialStraddles(data, length, cut)) {
+            return cut;
+        }
+    }
+    cutSearch_t search = {.data = data, .length = length};
+    SplitText(text, length, noteCut, &search);
+    return search.cut;
+}
+
+enum CODEC_STATUS encodeWords(codecTables_t *tables, const unsigned char *s,
+                              size_t numBytes,
+                              const encodeOptions_t *options,
+                              tokenSink_t sink, tokenSink32_t sink32,
+                              void *ctx, size_t *numTokens) {
+    SplitterState state = {.inputSize = numBytes,
+                           .input = s,
+                           .status = CODEC_SUCCESS,
+                           .sink = sink,
+                           .sink32 = sink32,
+                           .sinkCtx = ctx,
+                           .codec = tables};
+    if (options != NULL) {
+        state.specialMask = options->allowSpecial | options->denySpecial;
+        state.denySpecial = options->denySpecial;
+        state.stats = options->stats;
+    }
+    splitInput(&state);
+    *numTokens = state.numTokens;
+    if (state.stats != NULL) {
+        state.stats->calls++;
+        state.stats->bytes += numBytes;
+    }
+    return state.status;
+}
+
+void printTokens(const uint32_t *tokens, size_t numTokens, size_t offset,
+                 size_t length, void *ctx) {
+    const codecTables_t *tables = (const codecTables_t *) ctx;
+    printf("TOKEN: |");
+    for (size_t idx = 0; idx < numTokens; idx++) {
+        const vocabToken_t *token = &tables->fromToken[tokens[idx]];
+        EscapePrints(tables->strings + token->offset, token->length);
+        printf("|");
+    }
+    printf("\n");
 }
 
 int scanWords(const unsigned char *s, codecTables_t *tables) {
     // printf("\nscanWords called\n");
     // printf("%s\n", s);
-    unsigned char *dst;
     CalibrateRdtscTicks();
     uint64_t start_rdtsc, end_rdtsc;
     uint64_t host_cpu_ticks;
@@ -782,42 +1483,28 @@ int scanWords(const unsigned char *s, codecTables_t *tables) {
     double tokens_per_us;
     start_rdtsc = RDTSC();
     size_t numBytes = strlen((const char *) s);
-    SplitterState state = {false,
-                           false,
-                           false,
-                           false,
-                           false,
-                           false,
-                           false,
-                           0,
-                           0,
-                           0,
-                           0,
-                           numBytes,
-                           0,
-                           tables,
-                           {},
-                           {}};
-    utf8proc_decompose_custom(s,
-                              (long) numBytes,
-                              NULL,
-                              0,
-                              0,
-                              codePoint,
-                              &state);
-    flushState(&state);
+    size_t numTokens = 0;
+    codecStats_t stats = {0};
+    encodeOptions_t options = {.stats = &stats};
+    encodeWords(tables, s, numBytes, &options, NULL, printTokens, tables,
+                &numTokens);
     end_rdtsc = RDTSC();
     // Calculate rates
     host_cpu_ticks = end_rdtsc - start_rdtsc;
     host_cpu_ns = host_cpu_ticks / g_TicksPerNanoSec;
     host_cpu_us = host_cpu_ns / 1000;
     host_cpu_s = host_cpu_ns / 1000000000;
-    tokens_per_us = state.numTokens / host_cpu_us;
+    tokens_per_us = numTokens / host_cpu_us;
     printf("\n%.2lf token/µs, %zu tokens, %.4f seconds, %llu ticks\n",
            tokens_per_us,
-           state.numTokens,
+           numTokens,
            host_cpu_s,
            host_cpu_ticks);
+    char *report = StatsReport(&stats);
+    if (report != NULL) {
+        printf("%s\n", report);
+        free(report);
+    }
     return 0;
 }
 
@@ -839,17 +1526,204 @@ enum CODEC_STATUS EncodeTextFile(const char *path) {
         fclose(f);
         return ERR_CORPUS_EMPTY;
     }
-    buffer = malloc(length);
+    buffer = malloc(length + 1);
     if (!buffer) {
         fclose(f);
         return ERR_CORPUS_MALLOC;
     }
     fread(buffer, 1, length, f);
-    scanWords(buffer, codecTables);
-    // SplitWords(codecTables, buffer);
+    fclose(f);
+    buffer[length] = '\0';
+    scanWords((const unsigned char *) buffer, codecTables);
+    free(buffer);
     return CODEC_SUCCESS;
 }
 
+enum CODEC_STATUS EncodeText(const char *text, size_t numBytes,
+                             const encodeOptions_t *options,
+                             tokenSink_t sink, void *ctx) {
+    if (codecTables == NULL) {
+        enum CODEC_STATUS status = InitializeGPT2Codec();
+        if (status != CODEC_SUCCESS) {
+            return status;
+        }
+    }
+    if (codecTables->idBits != 16) {
+        return ERR_VOCAB_WIDTH;
+    }
+    size_t numTokens = 0;
+    return encodeWords(codecTables, (const unsigned char *) text, numBytes,
+                       options, sink, NULL, ctx, &numTokens);
+}
+
+enum CODEC_STATUS EncodeText32(const char *text, size_t numBytes,
+                               const encodeOptions_t *options,
+                               tokenSink32_t sink, void *ctx) {
+    if (codecTables == NULL) {
+        enum CODEC_STATUS status = InitializeGPT2Codec();
+        if (status != CODEC_SUCCESS) {
+            return status;
+        }
+    }
+    size_t numTokens = 0;
+    return encodeWords(codecTables, (const unsigned char *) text, numBytes,
+                       options, NULL, sink, ctx, &numTokens);
+}
+
+// ==========================================================================
+// Streaming decoder
+// ==========================================================================
+
+static size_t writeReplacement(char *out) {
+    out[0] = (char) 0xEF;
+    out[1] = (char) 0xBF;
+    out[2] = (char) 0xBD;
+    return 3;
+}
+
+/*
+ * Feeds one byte through the UTF-8 validator, emitting whatever it
+ * completes.  Ill-formed sequences are replaced by one U+FFFD per maximal
+ * subpart, the same as most other decoders do.
+ */
+static size_t decodeByte(decoderSession_t *session, uint8_t byte, char *out) {
+    size_t written = 0;
+    if (session->needed != 0) {
+        if (byte >= session->lower && byte <= session->upper) {
+            session->pending[session->numPending++] = byte;
+            session->lower = 0x80;
+            session->upper = 0xBF;
+            if (--session->needed == 0) {
+                memcpy(out, session->pending, session->numPending);
+                written = session->numPending;
+                session->numPending = 0;
+            }
+            return written;
+        }
+        /* Not a continuation, the pending bytes are dropped and the byte
+           is looked at again as the start of a new character. */
+        DecoderInit(session);
+        written = writeReplacement(out);
+    }
+    if (byte < 0x80) {
+        out[written++] = (char) byte;
+        return written;
+    }
+    if (byte >= 0xC2 && byte <= 0xDF) {
+        session->needed = 1;
+    } else if (byte >= 0xE0 && byte <= 0xEF) {
+        session->needed = 2;
+        if (byte == 0xE0) session->lower = 0xA0;       // overlong
+        if (byte == 0xED) session->upper = 0x9F;       // surrogates
+    } else if (byte >= 0xF0 && byte <= 0xF4) {
+        session->needed = 3;
+        if (byte == 0xF0) session->lower = 0x90;       // overlong
+        if (byte == 0xF4) session->upper = 0x8F;       // beyond U+10FFFF
+    } else {
+        return written + writeReplacement(out + written);
+    }
+    session->pending[session->numPending++] = byte;
+    return written;
+}
+
+void DecoderInit(decoderSession_t *session) {
+    session->numPending = 0;
+    session->needed = 0;
+    session->lower = 0x80;
+    session->upper = 0xBF;
+}
+
+/* Looks up a token to decode, NULL when there is no such id. */
+static const vocabToken_t *decodedToken(uint32_t id,
+                                        enum CODEC_STATUS *status) {
+    *status = CODEC_SUCCESS;
+    if (codecTables == NULL) {
+        *status = InitializeGPT2Codec();
+        if (*status != CODEC_SUCCESS) {
+            return NULL;
+        }
+    }
+    if (id >= codecTables->numTokens ||
+        codecTables->fromToken[id].length == 0) {
+        *status = ERR_DECODE_INVALID;
+        return NULL;
+    }
+    return &codecTables->fromToken[id];
+}
+
+/*
+ * The next input byte a token stands for, from its vocabulary text, which
+ * scanEncoder() only admits in the byte-level alphabet.  That ends at
+ * U+0143, two bytes at most; anything else still stays in bounds.
+ */
+static inline uint8_t tokenByte(const vocabToken_t *token,
+                                const unsigned char **s,
+                                const unsigned char *end) {
+    const unsigned char *p = *s;
+    if (token->literal) {
+        *s = p + 1;
+        return *p;
+    } else if (*p < 0x80 || p + 1 == end) {
+        *s = p + 1;
+        return codecTables->unicodeToBytes[*p & 0x7F];
+    }
+    *s = p + 2;
+    uint32_t rune = (p[0] & 0x1F) << 6 | (p[1] & 0x3F);
+    return rune < sizeof(codecTables->unicodeToBytes) ?
+           codecTables->unicodeToBytes[rune] : 0;
+}
+
+enum CODEC_STATUS DecoderPush(decoderSession_t *session, uint32_t id,
+                              char *out, size_t *outLen) {
+    enum CODEC_STATUS status;
+    const vocabToken_t *token = decodedToken(id, &status);
+    *outLen = 0;
+    if (token == NULL) {
+        return status;
+    }
+    const unsigned char *s = (const unsigned char *) codecTables->strings +
+                             token->offset;
+    const unsigned char *end = s + token->length;
+    size_t written = 0;
+    while (s < end) {
+        uint8_t byte = tokenByte(token, &s, end);
+        if (byte < 0x80 && session->needed == 0) {
+            out[written++] = (char) byte;
+        } else {
+            written += decodeByte(session, byte, out + written);
+        }
+    }
+    *outLen = written;
+    return CODEC_SUCCESS;
+}
+
+enum CODEC_STATUS DecodeTokenBytes(uint32_t id, char *out, size_t *outLen) {
+    enum CODEC_STATUS status;
+    const vocabToken_t *token = decodedToken(id, &status);
+    *outLen = 0;
+    if (token == NULL) {
+        return status;
+    }
+    const unsigned char *s = (const unsigned char *) codecTables->strings +
+                             token->offset;
+    const unsigned char *end = s + token->length;
+    size_t written = 0;
+    while (s < end) {
+        out[written++] = (char) tokenByte(token, &s, end);
+    }
+    *outLen = written;
+    return CODEC_SUCCESS;
+}
+
+size_t DecoderFinish(decoderSession_t *session, char *out) {
+    size_t written = 0;
+    if (session->needed != 0) {
+        written = writeReplacement(out);
+    }
+    DecoderInit(session);
+    return written;
+}
+
 
 /*
 
@@ -876,14 +1750,138 @@ int nextWord(char *s) {
     }
 } */
 
-enum CODEC_STATUS InitializeGPT2Codec() {
-    readEncoderDefinitions("resources/encoder.json", &codecTables);
-    readBpeVocabulary("resources/vocab.bpe", &codecTables);
+enum CODEC_STATUS InitializeCodec(const char *encoderPath,
+                                  const char *bpePath) {
+    ShutdownGPT2Codec();
+    codecTables = calloc(1, sizeof(codecTables_t));
+    if (codecTables == NULL) {
+        return ERR_JSON_MALLOC;
+    }
+    /* The encoder keys are checked against it as they load. */
     buildUnicodeByteTable(&codecTables);
-    codecTables->tokenCache = NULL;
-    int result = regcomp(
-            &(codecTables->pattern),
-            "'s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^[:space:][:alpha:][:digit:]]+|[[:space:]]+",
-            REG_EXTENDED);
-    printf("regex result: %d\n", result);
-}
\ No newline at end of file
+    vocabLoader_t encoder = {.filename = encoderPath, .tables = codecTables};
+    vocabLoader_t merges = {.filename = bpePath, .tables = codecTables};
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    if (!fileSize(encoderPath, &encoder.length)) {
+        status = ERR_JSON_FOPEN;
+    } else if (!fileSize(bpePath, &merges.length)) {
+        status = ERR_BPE_FOPEN;
+    } else if (!poolReserve(codecTables,
+                            merges.length + 1 + encoder.length + 1)) {
+        status = ERR_JSON_MALLOC;
+    }
+    if (status == CODEC_SUCCESS) {
+        /* The merges load on their own thread into the front of the pool,
+           the encoder keys go after them. */
+        encoder.base = merges.length + 1;
+        pthread_t thread;
+        bool threaded = pthread_create(&thread, NULL, loadMergesMain,
+                                       &merges) == 0;
+        if (!threaded) {
+            loadMerges(&merges);
+        }
+        loadEncoder(&encoder);
+        if (threaded) {
+            pthread_join(thread, NULL);
+        }
+        status = encoder.status != CODEC_SUCCESS ? encoder.status :
+                 merges.status;
+    }
+    if (status == CODEC_SUCCESS) {
+        codecTables->stringsLen = encoder.base + encoder.used;
+        codecTables->vocabLen = codecTables->stringsLen;
+        if (!matchWidths(codecTables, encoder.idBits, merges.idBits)) {
+            status = ERR_BPE_MALLOC;
+        }
+    }
+    if (status != CODEC_SUCCESS) {
+        ShutdownGPT2Codec();
+        return status;
+    }
+    if (codecTables->idBits == 16) {
+        vocabSlot16_t *endOfText = tokenLookup16(codecTables,
+                                                 "<|endoftext|>", 13);
+        if (endOfText != NULL) {
+            addSpecialToken(codecTables, "<|endoftext|>", endOfText->value);
+        }
+    } else {
+        vocabSlot32_t *endOfText = tokenLookup32(codecTables,
+                                                 "<|endoftext|>", 13);
+        if (endOfText != NULL) {
+            addSpecialToken(codecTables, "<|endoftext|>", endOfText->value);
+        }
+    }
+    poolShrink(codecTables);
+    if (!(codecTables->idBits == 16 ? buildPairTable16(codecTables) :
+          buildPairTable32(codecTables))) {
+        ShutdownGPT2Codec();
+        return ERR_BPE_MALLOC;
+    }
+#ifdef __GLIBC__
+    /* Hand the transient load buffers back to the OS. */
+    malloc_trim(0);
+#endif
+    return CODEC_SUCCESS;
+}
+
+enum CODEC_STATUS InitializeGPT2Codec() {
+    return InitializeCodec("resources/encoder.json", "resources/vocab.bpe");
+}
+
+unsigned int CodecIdBits() {
+    return codecTables != NULL ? codecTables->idBits : 0;
+}
+
+void ShutdownGPT2Codec() {
+    freeCodecTables(codecTables);
+    codecTables = NULL;
+}
+
+enum CODEC_STATUS AttachWordCache(const char *name, size_t numBytes) {
+    if (codecTables == NULL) {
+        enum CODEC_STATUS status = InitializeGPT2Codec();
+        if (status != CODEC_SUCCESS) {
+            return status;
+        }
+    }
+    wordCache_t *cache;
+    enum CODEC_STATUS status = WordCacheOpen(codecTables, name, numBytes,
+                                             &cache);
+    if (status == CODEC_SUCCESS) {
+        WordCacheClose(codecTables->wordCache);
+        codecTables->wordCache = cache;
+    }
+    return status;
+}
+
+void DetachWordCache() {
+    if (codecTables != NULL) {
+        WordCacheClose(codecTables->wordCache);
+        codecTables->wordCache = NULL;
+    }
+}
+
+enum CODEC_STATUS RegisterSpecialToken(const char *text, uint32_t id) {
+    if (codecTables == NULL) {
+        enum CODEC_STATUS status = InitializeGPT2Codec();
+        if (status != CODEC_SUCCESS) {
+            return status;
+        }
+    }
+    return addSpecialToken(codecTables, text, id);
+}
+
+uint64_t SpecialTokenSet(const char *text) {
+    if (codecTables == NULL) {
+        return 0;
+    }
+    size_t len = strlen(text);
+    for (size_t index = 0; index < codecTables->numSpecial; index++) {
+        const specialToken_t *token = &codecTables->special[index];
+        if (token->length == len &&
+            memcmp(codecTables->strings + token->offset, text, len) == 0) {
+            return (uint64_t) 1 << index;
+        }
+    }
+    return 0;
+}
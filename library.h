@@ -2,20 +2,16 @@
 #define GPT2_CODEC_LIBRARY_H
 
 #include <cJSON/cJSON.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <search_hsearch_r.h>
-#include <regex.h>
 #include <utlist.h>
 #include <uthash.h>
+#include "stats.h"
 
 #define isutf(c) (((c)&0xC0)!=0x80)
 
-typedef struct _ENTRY {
-    unsigned int used;
-    ENTRY entry;
-} _ENTRY;
-
 enum CODEC_STATUS {
     CODEC_SUCCESS,
     ERR_JSON_FOPEN,
@@ -28,27 +24,142 @@ enum CODEC_STATUS {
     ERR_BPE_FAILED,
     ERR_CORPUS_FOPEN,
     ERR_CORPUS_MALLOC,
-    ERR_CORPUS_EMPTY
+    ERR_CORPUS_EMPTY,
+    ERR_SPECIAL_INVALID,
+    ERR_SPECIAL_MALLOC,
+    ERR_SPECIAL_DENIED,
+    ERR_PACK_INVALID,
+    ERR_PACK_MALLOC,
+    ERR_DECODE_INVALID,
+    ERR_REQUEST_INVALID,
+    ERR_VOCAB_WIDTH,
+    ERR_EDIT_INVALID,
+    ERR_EDIT_MALLOC,
+    ERR_TRAIN_MALLOC,
+    ERR_TRAIN_WRITE,
+    ERR_CACHE_INVALID,
+    ERR_CACHE_MALLOC,
+    ERR_CACHE_OPEN,
+    ERR_CACHE_MISMATCH,
+    ERR_WINDOW_INVALID,
+    ERR_WINDOW_MALLOC,
+    ERR_REQUEST_MALLOC,
+    ERR_JSON_ALPHABET
 };
 
+/*
+ * Vocabulary records never hold pointers: every key lives in the shared
+ * string pool and is referenced by its offset, so the pool can grow (and
+ * be shrunk to fit) without fixing anything up, and the whole vocabulary
+ * is a handful of allocations instead of one per entry.
+ *
+ * Token ids and bpe ranks come in two widths.  Vocabularies that fit in
+ * 16 bits, GPT-2 among them, use the 12 byte slots; larger ones use the
+ * 32 bit variants.  The code over them is in codec_template.h.
+ */
 typedef struct {
-    char* id;                    /* key */
-    size_t numTokens;
-    UT_hash_handle hh;         /* makes this structure hashable */
-} TokenCacheEntry;
+    uint32_t hash;               /* 0 marks an empty slot */
+    uint32_t offset;             /* key in the string pool */
+    uint16_t length;             /* key length in bytes */
+    uint16_t value;              /* token id or bpe rank */
+} vocabSlot16_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t offset;
+    uint16_t length;
+    uint32_t value;
+} vocabSlot32_t;
+
+typedef struct {
+    vocabSlot16_t *slots;        /* size + 1 slots, index 0 unused */
+    uint32_t size;
+    uint32_t filled;
+} vocabTable16_t;
+
+typedef struct {
+    vocabSlot32_t *slots;
+    uint32_t size;
+    uint32_t filled;
+} vocabTable32_t;
+
+typedef union {
+    vocabTable16_t t16;
+    vocabTable32_t t32;
+} vocabTable_t;
+
+/*
+ * The merges again, keyed by the ids of the two tokens they join, for the
+ * lane kernel in codec_template.h.  Rank 0 marks an empty slot.
+ */
+typedef struct {
+    uint32_t pair;               /* left id << 16 | right id */
+    uint16_t rank;
+    uint16_t merged;             /* id of the joined token */
+} pairSlot16_t;
+
+typedef struct {
+    uint64_t pair;
+    uint32_t rank;
+    uint32_t merged;
+} pairSlot32_t;
+
+typedef struct {
+    pairSlot16_t *slots;         /* NULL when the kernel is off */
+    uint32_t mask;               /* size - 1, a power of two */
+} pairTable16_t;
+
+typedef struct {
+    pairSlot32_t *slots;
+    uint32_t mask;
+} pairTable32_t;
+
+typedef union {
+    pairTable16_t t16;
+    pairTable32_t t32;
+} pairTable_t;
+
+typedef struct {
+    uint32_t offset;
+    uint16_t length;
+    uint16_t literal;            /* raw text rather than byte-level unicode */
+} vocabToken_t;
+
+#define MAX_SPECIAL_TOKENS 64
+#define MAX_TOKEN_BYTES 256
+#define SPECIAL_ALL (~(uint64_t) 0)
+
+typedef struct {
+    uint32_t offset;             /* literal text in the string pool */
+    uint16_t length;
+    uint32_t id;
+} specialToken_t;
+
+/* See wordcache.h. */
+typedef struct wordCacheStruct wordCache_t;
 
 struct codecTablesStruct {
-    struct hsearch_data toToken;
-    struct hsearch_data bpeRanks;
-    TokenCacheEntry *tokenCache;
-    char *fromToken[65535];
+    char *strings;               /* string pool, NUL separated */
+    size_t stringsLen;
+    size_t stringsCap;
+    size_t vocabLen;             /* pool bytes from the vocabulary files */
+    unsigned int idBits;         /* 16 or 32, see vocabSlot16_t */
+    vocabTable_t toToken;
+    vocabTable_t bpeRanks;
+    pairTable_t bpePairs;        /* only when every merge is in toToken */
+    uint32_t byteTokens[256];    /* the token of each single byte */
+    vocabToken_t *fromToken;     /* indexed by token id */
+    size_t numTokens;
+    specialToken_t special[MAX_SPECIAL_TOKENS];
+    size_t numSpecial;
+    uint64_t specialFirst[256];  /* special tokens by their first byte */
+    wordCache_t *wordCache;      /* shared between processes, or NULL */
     uint8_t unicodeToBytes[324];
     uint16_t bytesToUnicode[256];
-    regex_t pattern;
 };
 
 
-typedef struct BPERankedPair {
+typedef struct BPERankedPair16 {
     char *repr;
     uint16_t rank;
     uint64_t hash;
@@ -56,12 +167,77 @@ typedef struct BPERankedPair {
     size_t left_len;
     const char *right;
     size_t right_len;
-    struct BPERankedPair *next;
-    struct BPERankedPair *prev;
-} rankedBigram_t;
+    struct BPERankedPair16 *next;
+    struct BPERankedPair16 *prev;
+} rankedBigram16_t;
+
+typedef struct BPERankedPair32 {
+    char *repr;
+    uint32_t rank;
+    uint64_t hash;
+    const char *left;
+    size_t left_len;
+    const char *right;
+    size_t right_len;
+    struct BPERankedPair32 *next;
+    struct BPERankedPair32 *prev;
+} rankedBigram32_t;
+
+/*
+ * One short pre-token in the lane kernel.  Its pieces start out as its
+ * bytes and keep their positions: a merge leaves the joined token where
+ * the left one was and drops the right one from `live`.  ranks[i] is that
+ * of pieces[i] and the next live piece.
+ */
+#define LANE_PIECES 16
+
+typedef struct {
+    uint16_t pieces[LANE_PIECES];
+    uint16_t ranks[LANE_PIECES];
+    uint16_t merged[LANE_PIECES];
+    uint32_t live;               /* pieces still in the word */
+    uint32_t stale;              /* ranks to look up before the next round */
+    uint32_t numMerges;
+} mergeLane16_t;
+
+typedef struct {
+    uint32_t pieces[LANE_PIECES];
+    uint32_t ranks[LANE_PIECES];
+    uint32_t merged[LANE_PIECES];
+    uint32_t live;
+    uint32_t stale;
+    uint32_t numMerges;
+} mergeLane32_t;
 
 typedef struct codecTablesStruct codecTables_t;
 
+/*
+ * Special tokens are selected by their bit in these masks, see
+ * SpecialTokenSet().  Markers that are in neither mask are encoded as
+ * ordinary text; with both masks empty the matcher never runs.
+ */
+typedef struct {
+    uint64_t allowSpecial;       /* emitted as their token id */
+    uint64_t denySpecial;        /* fail the encode with ERR_SPECIAL_DENIED */
+    codecStats_t *stats;         /* collects workload statistics if set */
+} encodeOptions_t;
+
+/*
+ * Receives the tokens of one pre-token (or of one special token), along
+ * with the byte range of the input it was encoded from.
+ */
+typedef void (*tokenSink_t)(const uint16_t *tokens, size_t numTokens,
+                            size_t offset, size_t length, void *ctx);
+
+/* The same for vocabularies of any width. */
+typedef void (*tokenSink32_t)(const uint32_t *tokens, size_t numTokens,
+                              size_t offset, size_t length, void *ctx);
+
+/* Receives the bytes of one pre-token, see SplitText(). */
+typedef void (*wordSink_t)(const char *word, size_t length, void *ctx);
+
+unsigned int genHash(const char *s, unsigned int len, unsigned int hval);
+
 enum CODEC_STATUS readJson(const char *filename, cJSON **json);
 
 enum CODEC_STATUS readEncoderDefinitions(const char *filename,
@@ -72,8 +248,113 @@ enum CODEC_STATUS readBpeVocabulary(const char *filename,
 
 void buildUnicodeByteTable(codecTables_t **tables);
 
+/* Writes the rune byte `**ch` stands for as UTF-8, advancing both. */
+size_t encodeCharBPE(codecTables_t *tables, char **ch, char **dest);
+
+void freeCodecTables(codecTables_t *tables);
+
+/*
+ * Loads any byte-level BPE vocabulary in the GPT-2 file formats.  The id
+ * width is picked from the number of tokens and merges.  A vocabulary
+ * already loaded is shut down first, word cache and all.
+ */
+enum CODEC_STATUS InitializeCodec(const char *encoderPath,
+                                  const char *bpePath);
+
 enum CODEC_STATUS InitializeGPT2Codec();
 
+/* 16 or 32 for the loaded vocabulary, 0 before initialization. */
+unsigned int CodecIdBits();
+
+void ShutdownGPT2Codec();
+
+/*
+ * Looks up and stores merged pre-tokens in a cache shared between
+ * processes, see WordCacheOpen() for `name` and `numBytes`.  Workers
+ * forked from a process that attached share its cache.
+ */
+enum CODEC_STATUS AttachWordCache(const char *name, size_t numBytes);
+
+void DetachWordCache();
+
+enum CODEC_STATUS addSpecialToken(codecTables_t *tables, const char *text,
+                                  uint32_t id);
+
+enum CODEC_STATUS RegisterSpecialToken(const char *text, uint32_t id);
+
+uint64_t SpecialTokenSet(const char *text);
+
+/* Fails with ERR_VOCAB_WIDTH if the vocabulary needs 32 bit ids. */
+enum CODEC_STATUS EncodeText(const char *text, size_t numBytes,
+                             const encodeOptions_t *options,
+                             tokenSink_t sink, void *ctx);
+
+enum CODEC_STATUS EncodeText32(const char *text, size_t numBytes,
+                               const encodeOptions_t *options,
+                               tokenSink32_t sink, void *ctx);
+
 enum CODEC_STATUS EncodeTextFile(const char *path);
 
+/*
+ * Runs the pre-tokenizer alone and hands every pre-token to `sink`
+ * unencoded.  Needs no vocabulary; special tokens are split as text.
+ */
+void SplitText(const char *text, size_t numBytes, wordSink_t sink,
+               void *ctx);
+
+/*
+ * Where to cut a buffer of text that starts at a pre-token boundary, so
+ * that encoding either side alone gives the same tokens as the whole, and
+ * as close to its end as it finds.  Returns 0 when there is no such cut,
+ * as in a single long pre-token: the caller adds more input and asks again.
+ */
+size_t SplitterCutPoint(const char *text, size_t length);
+
+/*
+ * Bytes past its end the splitter may look at to end a pre-token: a run
+ * of white space gives its last rune to the word that follows, so it ends
+ * depending on the two runes after it.
+ */
+#define SPLITTER_LOOKAHEAD 8
+
+/*
+ * Worst case output of a single DecoderPush(): up to three bytes held over
+ * from earlier tokens plus the token itself, every byte of it replaced by a
+ * three byte U+FFFD.
+ */
+#define DECODE_BUFFER_SIZE (3 * (MAX_TOKEN_BYTES + 3))
+
+/*
+ * Streaming decoder state.  A token can end part way through a UTF-8
+ * character; those bytes are held here until the character completes.
+ */
+typedef struct {
+    uint8_t pending[4];
+    uint8_t numPending;
+    uint8_t needed;              /* continuation bytes still to come */
+    uint8_t lower;               /* allowed range of the next one */
+    uint8_t upper;
+} decoderSession_t;
+
+void DecoderInit(decoderSession_t *session);
+
+/*
+ * Decodes one token, writing only complete and valid UTF-8 to `out`, which
+ * must hold DECODE_BUFFER_SIZE bytes.  Malformed sequences come out as
+ * U+FFFD.  The cost is linear in the token length, independent of how much
+ * has been decoded before.
+ */
+enum CODEC_STATUS DecoderPush(decoderSession_t *session, uint32_t id,
+                              char *out, size_t *outLen);
+
+/* Ends the stream, writing U+FFFD for any incomplete trailing character. */
+size_t DecoderFinish(decoderSession_t *session, char *out);
+
+/*
+ * Writes the input bytes a token was encoded from, at most MAX_TOKEN_BYTES
+ * of them, without any validation.  Decoding every token this way gives
+ * back exactly the bytes that were encoded, valid UTF-8 or not.
+ */
+enum CODEC_STATUS DecodeTokenBytes(uint32_t id, char *out, size_t *outLen);
+
 #endif //GPT2_CODEC_LIBRARY_H
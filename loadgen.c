@@ -0,0 +1,295 @@
+//
+// Load generator for gpt2_codec_server.  Each connection runs on its own
+// thread and keeps `pipeline` requests in flight, cutting the requests out
+// of a text file.  Reports throughput and the client side latency
+// histogram, and the server's own histograms with -S.
+//
+
+#include "library.h"
+#include "histogram.h"
+#include "rdtsc.h"
+#include "server.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef struct {
+    pthread_t thread;
+    size_t index;
+    latencyHistogram_t latencies;
+    uint64_t bytes;
+    uint64_t tokens;
+    uint64_t errors;
+} client_t;
+
+static const char *socketPath = SERVER_SOCKET_PATH;
+static const char *corpus;
+static size_t corpusLen;
+static size_t numConnections = 4;
+static size_t numRequests = 10000;
+static size_t pipelineDepth = 1;
+static size_t requestBytes = 4096;
+static uint8_t requestOp = OP_ENCODE;
+
+static int connectTo(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool readAll(int fd, void *buffer, size_t length) {
+    char *dest = (char *) buffer;
+    while (length > 0) {
+        ssize_t received = read(fd, dest, length);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        dest += received;
+        length -= received;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void *buffer, size_t length) {
+    const char *src = (const char *) buffer;
+    while (length > 0) {
+        ssize_t written = write(fd, src, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        src += written;
+        length -= written;
+    }
+    return true;
+}
+
+/* Cuts the next request out of the corpus, ending it on a line break. */
+static size_t nextChunk(size_t *pos, const char **chunk) {
+    if (*pos >= corpusLen) {
+        *pos = 0;
+    }
+    const char *begin = corpus + *pos;
+    size_t length = corpusLen - *pos;
+    if (length > requestBytes) {
+        const char *eol = memchr(begin + requestBytes, '\n',
+                                 length - requestBytes);
+        length = eol != NULL ? (size_t) (eol - begin) + 1 : length;
+    }
+    *pos += length;
+    *chunk = begin;
+    return length;
+}
+
+static bool sendRequest(int fd, client_t *client, uint32_t id, size_t *pos) {
+    const char *chunk;
+    size_t length = nextChunk(pos, &chunk);
+    frameHeader_t header = {.length = (uint32_t) length, .id = id,
+                            .op = requestOp};
+    client->bytes += length;
+    return writeAll(fd, &header, sizeof(header)) &&
+           writeAll(fd, chunk, length);
+}
+
+static void *clientMain(void *arg) {
+    client_t *client = (client_t *) arg;
+    int fd = connectTo(socketPath);
+    if (fd < 0) {
+        perror(socketPath);
+        client->errors = numRequests;
+        return NULL;
+    }
+    uint64_t *sent = malloc(numRequests * sizeof(uint64_t));
+    char *response = NULL;
+    size_t responseCap = 0;
+    /* Connections start at different places in the corpus. */
+    size_t pos = corpusLen / numConnections * client->index;
+    size_t numSent = 0;
+    size_t numReceived = 0;
+    bool ok = sent != NULL;
+    while (ok && numReceived < numRequests) {
+        while (ok && numSent < numRequests &&
+               numSent - numReceived < pipelineDepth) {
+            sent[numSent] = RDTSC();
+            ok = sendRequest(fd, client, (uint32_t) numSent, &pos);
+            numSent++;
+        }
+        frameHeader_t header;
+        if (!ok || !readAll(fd, &header, sizeof(header)) ||
+            header.id >= numSent) {
+            ok = false;
+            break;
+        }
+        if (header.length > responseCap) {
+            responseCap = header.length;
+            response = realloc(response, responseCap);
+        }
+        if (!readAll(fd, response, header.length)) {
+            ok = false;
+            break;
+        }
+        HistogramRecord(&client->latencies,
+                        (uint64_t) ((RDTSC() - sent[header.id]) /
+                                    g_TicksPerNanoSec));
+        if (header.status != CODEC_SUCCESS) {
+            client->errors++;
+        } else if (header.op == OP_COUNT && header.length == 4) {
+            uint32_t count;
+            memcpy(&count, response, sizeof(count));
+            client->tokens += count;
+        } else {
+            client->tokens += header.length / sizeof(uint16_t);
+        }
+        numReceived++;
+    }
+    if (!ok) {
+        fprintf(stderr, "connection %zu failed after %zu responses\n",
+                client->index, numReceived);
+        client->errors += numRequests - numReceived;
+    }
+    close(fd);
+    free(sent);
+    free(response);
+    return NULL;
+}
+
+static void printServerStats(void) {
+    int fd = connectTo(socketPath);
+    frameHeader_t header = {.op = OP_STATS};
+    if (fd < 0 || !writeAll(fd, &header, sizeof(header)) ||
+        !readAll(fd, &header, sizeof(header))) {
+        fprintf(stderr, "could not fetch server stats\n");
+    } else {
+        char *text = malloc(header.length);
+        if (text != NULL && readAll(fd, text, header.length)) {
+            printf("server:\n%.*s", (int) header.length, text);
+        }
+        free(text);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static char *readCorpus(const char *path, size_t *length) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = size > 0 ? malloc(size) : NULL;
+    if (buffer != NULL && fread(buffer, 1, size, f) != (size_t) size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(f);
+    *length = (size_t) size;
+    return buffer;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-s socket] [-c connections] [-n requests] "
+            "[-p pipeline] [-b bytes] [-o encode|count] [-S] file\n"
+            "  -c  concurrent connections, default 4\n"
+            "  -n  requests per connection, default 10000\n"
+            "  -p  requests in flight per connection, default 1\n"
+            "  -b  approximate request size in bytes, default 4096\n"
+            "  -S  print the server's latency histograms afterwards\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    bool serverStats = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:n:p:b:o:Sh")) != -1) {
+        switch (opt) {
+            case 's':
+                socketPath = optarg;
+                break;
+            case 'c':
+                numConnections = (size_t) atol(optarg);
+                break;
+            case 'n':
+                numRequests = (size_t) atol(optarg);
+                break;
+            case 'p':
+                pipelineDepth = (size_t) atol(optarg);
+                break;
+            case 'b':
+                requestBytes = (size_t) atol(optarg);
+                break;
+            case 'o':
+                if (strcmp(optarg, "encode") == 0) {
+                    requestOp = OP_ENCODE;
+                } else if (strcmp(optarg, "count") == 0) {
+                    requestOp = OP_COUNT;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'S':
+                serverStats = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || numConnections < 1 || numRequests < 1 ||
+        pipelineDepth < 1 || requestBytes < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    corpus = readCorpus(argv[optind], &corpusLen);
+    if (corpus == NULL) {
+        fprintf(stderr, "could not read %s\n", argv[optind]);
+        return 1;
+    }
+
+    CalibrateRdtscTicks();
+    client_t *clients = calloc(numConnections, sizeof(client_t));
+    uint64_t start = RDTSC();
+    for (size_t idx = 0; idx < numConnections; idx++) {
+        clients[idx].index = idx;
+        pthread_create(&clients[idx].thread, NULL, clientMain, &clients[idx]);
+    }
+    latencyHistogram_t latencies = {0};
+    uint64_t bytes = 0, tokens = 0, errors = 0;
+    for (size_t idx = 0; idx < numConnections; idx++) {
+        pthread_join(clients[idx].thread, NULL);
+        HistogramMerge(&latencies, &clients[idx].latencies);
+        bytes += clients[idx].bytes;
+        tokens += clients[idx].tokens;
+        errors += clients[idx].errors;
+    }
+    double seconds = (RDTSC() - start) / g_TicksPerNanoSec / 1000000000;
+
+    printf("%zu connections x %zu in flight: %llu requests in %.2f s, "
+           "%llu errors\n",
+           numConnections, pipelineDepth,
+           (unsigned long long) latencies.total, seconds,
+           (unsigned long long) errors);
+    printf("%.0f requests/s, %.2f MB/s, %.0f tokens/s\n",
+           latencies.total / seconds, bytes / seconds / 1000000,
+           tokens / seconds);
+    HistogramPrint(stdout, "latency", &latencies);
+    if (serverStats) {
+        printServerStats();
+    }
+    free(clients);
+    free((char *) corpus);
+    return errors != 0;
+}
@@ -1,28 +1,704 @@
 //
 // Created by Wes Brown on 8/10/21.
 //
+// gpt2codec: encodes text to token ids, decodes ids to text or counts
+// tokens, from files or stdin to stdout, so it drops into pipelines:
+//
+//   zcat corpus.gz | gpt2codec encode > shard.bin
+//
+// Reading, coding and writing run on their own threads and hand off
+// through pairs of buffers, so the coder works on one chunk while the next
+// is read and the previous one is written.  A chunk is cut where no
+// pre-token can straddle the cut, so chunking never changes the output.
+//
+// The histogram mode counts how often every token occurs.  Several coders
+// take chunks from the reader in turn and each keeps its own counts, which
+// are added up at the end; the tokens themselves are never stored.
+//
 
 #include "library.h"
+#include "rdtsc.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+enum CLI_MODE {
+    MODE_ENCODE,
+    MODE_DECODE,
+    MODE_COUNT,
+    MODE_HISTOGRAM
+};
+
+#define MAX_CODERS 64
+#define NUM_IDS (UINT16_MAX + 1)
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool full;                   /* owned by the consumer */
+    bool last;                   /* no more chunks follow */
+} chunk_t;
+
+/*
+ * Ring of buffers between two pipeline stages, two per consumer.  There is
+ * one producer; consumers take the chunks in the order they were published.
+ */
+typedef struct {
+    chunk_t chunks[2 * MAX_CODERS];
+    size_t numChunks;
+    uint64_t produced;
+    uint64_t consumed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} channel_t;
+
+typedef struct wordCount {
+    uint64_t count;
+    UT_hash_handle hh;
+    char bytes[];                /* key */
+} wordCount_t;
+
+/* A histogram coder's own counts, added up once the input is done. */
+typedef struct {
+    pthread_t thread;
+    const char *text;            /* chunk being encoded */
+    uint64_t *counts;            /* indexed by token id */
+    wordCount_t *words;          /* pre-tokens, when counted */
+    uint64_t numTokens;
+    codecStats_t stats;
+    enum CODEC_STATUS status;
+} histogramCoder_t;
+
+static enum CLI_MODE mode = MODE_ENCODE;
+static bool binary = true;
+static bool rawBytes = false;    /* decode without UTF-8 validation */
+static encodeOptions_t options = {0};
+static size_t chunkSize = 1 << 20;
+static size_t statsEvery = 0;     /* sample one chunk in this many */
+static size_t numCoders = 0;      /* histogram coders, 0 for one per core */
+static const char *wordsPath;     /* pre-token counts go here if set */
+static char **inputs;
+static int numInputs;
+
+static channel_t toCoder;
+static channel_t toWriter;
+static uint64_t bytesIn;
+static uint64_t numTokens;
+static bool failed;
+static codecStats_t stats;
+
+// ==========================================================================
+// Channels
+// ==========================================================================
+
+static void channelInit(channel_t *channel, size_t numConsumers) {
+    memset(channel, 0, sizeof(channel_t));
+    channel->numChunks = 2 * numConsumers;
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->changed, NULL);
+}
+
+static void channelFree(channel_t *channel) {
+    for (size_t idx = 0; idx < channel->numChunks; idx++) {
+        free(channel->chunks[idx].data);
+    }
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->changed);
+}
+
+/* The next chunk to fill, once its consumer is done with it. */
+static chunk_t *acquireEmpty(channel_t *channel) {
+    chunk_t *chunk = &channel->chunks[channel->produced % channel->numChunks];
+    pthread_mutex_lock(&channel->lock);
+    while (chunk->full) {
+        pthread_cond_wait(&channel->changed, &channel->lock);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    return chunk;
+}
+
+static void publish(channel_t *channel, chunk_t *chunk) {
+    pthread_mutex_lock(&channel->lock);
+    chunk->full = true;
+    channel->produced++;
+    pthread_cond_broadcast(&channel->changed);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+/*
+ * The oldest chunk no consumer has taken yet.  It cannot be refilled
+ * before it is released, so taking it by count is safe.
+ */
+static chunk_t *acquireFull(channel_t *channel) {
+    pthread_mutex_lock(&channel->lock);
+    while (channel->consumed == channel->produced) {
+        pthread_cond_wait(&channel->changed, &channel->lock);
+    }
+    chunk_t *chunk = &channel->chunks[channel->consumed++ %
+                                      channel->numChunks];
+    pthread_mutex_unlock(&channel->lock);
+    return chunk;
+}
+
+static void release(channel_t *channel, chunk_t *chunk) {
+    pthread_mutex_lock(&channel->lock);
+    chunk->full = false;
+    pthread_cond_broadcast(&channel->changed);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+static bool reserve(chunk_t *chunk, size_t numBytes) {
+    if (chunk->length + numBytes <= chunk->capacity) {
+        return true;
+    }
+    size_t capacity = chunk->capacity * 2 + numBytes;
+    char *data = realloc(chunk->data, capacity);
+    if (data == NULL) {
+        return false;
+    }
+    chunk->data = data;
+    chunk->capacity = capacity;
+    return true;
+}
+
+// ==========================================================================
+// Reader
+// ==========================================================================
+
+static size_t cutIds(const char *data, size_t length) {
+    if (binary) {
+        return length & ~(size_t) 1;
+    }
+    size_t pos = length;
+    while (pos > 0 && !isspace((unsigned char) data[pos - 1])) {
+        pos--;
+    }
+    return pos > 0 ? pos : length;
+}
+
+/*
+ * Hands the first `cut` bytes of the chunk on and starts the next chunk
+ * with the rest.
+ */
+static chunk_t *passOn(chunk_t *chunk, size_t cut) {
+    size_t carried = chunk->length - cut;
+    chunk->length = cut;
+    chunk->last = false;
+    publish(&toCoder, chunk);
+    /* The coder only reads up to the cut, the tail is still ours. */
+    chunk_t *next = acquireEmpty(&toCoder);
+    next->length = 0;
+    if (!reserve(next, carried + chunkSize)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(next->data, chunk->data + cut, carried);
+    next->length = carried;
+    return next;
+}
+
+static void *readerMain(void *arg) {
+    (void) arg;
+    chunk_t *chunk = acquireEmpty(&toCoder);
+    chunk->length = 0;
+    for (int idx = 0; idx < (numInputs > 0 ? numInputs : 1); idx++) {
+        const char *name = numInputs > 0 ? inputs[idx] : "-";
+        FILE *f = stdin;
+        if (strcmp(name, "-") != 0 && (f = fopen(name, "rb")) == NULL) {
+            perror(name);
+            failed = true;
+            continue;
+        }
+        for (;;) {
+            if (!reserve(chunk, chunkSize)) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            size_t got = fread(chunk->data + chunk->length, 1, chunkSize, f);
+            chunk->length += got;
+            bytesIn += got;
+            if (got < chunkSize) {
+                break;
+            }
+            size_t cut = mode == MODE_DECODE ?
+                         cutIds(chunk->data, chunk->length) :
+                         SplitterCutPoint(chunk->data, chunk->length);
+            /* Without a cut the chunk grows until there is one. */
+            if (cut != 0) {
+                chunk = passOn(chunk, cut);
+            }
+        }
+        if (ferror(f)) {
+            perror(name);
+            failed = true;
+        }
+        if (f != stdin) {
+            fclose(f);
+        }
+        /* Each input ends its own chunk, nothing carries across. */
+        if (chunk->length != 0 && idx + 1 < numInputs) {
+            chunk = passOn(chunk, chunk->length);
+        }
+    }
+    chunk->last = true;
+    publish(&toCoder, chunk);
+    /* Every histogram coder stops at a chunk marked last. */
+    for (size_t idx = 1; idx < numCoders; idx++) {
+        chunk = acquireEmpty(&toCoder);
+        chunk->length = 0;
+        chunk->last = true;
+        publish(&toCoder, chunk);
+    }
+    return NULL;
+}
+
+// ==========================================================================
+// Coder
+// ==========================================================================
+
+static char *formatId(char *dest, uint16_t id) {
+    char digits[5];
+    int numDigits = 0;
+    do {
+        digits[numDigits++] = (char) ('0' + id % 10);
+        id /= 10;
+    } while (id != 0);
+    while (numDigits > 0) {
+        *dest++ = digits[--numDigits];
+    }
+    return dest;
+}
+
+static void writeTokens(const uint16_t *tokens, size_t count,
+                        size_t offset, size_t length, void *ctx) {
+    chunk_t *out = (chunk_t *) ctx;
+    if (mode == MODE_COUNT) {
+        numTokens += count;
+        return;
+    }
+    if (!reserve(out, count * 6)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if (binary) {
+        memcpy(out->data + out->length, tokens, count * sizeof(uint16_t));
+        out->length += count * sizeof(uint16_t);
+    } else {
+        char *dest = out->data + out->length;
+        for (size_t idx = 0; idx < count; idx++) {
+            if (numTokens + idx != 0) {
+                *dest++ = ' ';
+            }
+            dest = formatId(dest, tokens[idx]);
+        }
+        out->length = dest - out->data;
+    }
+    numTokens += count;
+}
+
+static enum CODEC_STATUS decodeChunk(decoderSession_t *session,
+                                     const chunk_t *in, chunk_t *out) {
+    const char *pos = in->data;
+    const char *end = in->data + in->length;
+    while (pos < end) {
+        uint16_t id;
+        if (binary) {
+            if (end - pos < 2) {
+                return ERR_DECODE_INVALID;
+            }
+            memcpy(&id, pos, sizeof(id));
+            pos += sizeof(id);
+        } else {
+            while (pos < end && isspace((unsigned char) *pos)) pos++;
+            if (pos == end) break;
+            unsigned long value = 0;
+            const char *digits = pos;
+            while (pos < end && isdigit((unsigned char) *pos) &&
+                   value <= UINT16_MAX) {
+                value = value * 10 + (*pos++ - '0');
+            }
+            if (pos == digits || value > UINT16_MAX ||
+                (pos < end && !isspace((unsigned char) *pos))) {
+                return ERR_DECODE_INVALID;
+            }
+            id = (uint16_t) value;
+        }
+        if (!reserve(out, DECODE_BUFFER_SIZE)) {
+            return ERR_DECODE_INVALID;
+        }
+        size_t length;
+        enum CODEC_STATUS status = rawBytes ?
+                DecodeTokenBytes(id, out->data + out->length, &length) :
+                DecoderPush(session, id, out->data + out->length, &length);
+        if (status != CODEC_SUCCESS) {
+            return status;
+        }
+        out->length += length;
+        numTokens++;
+    }
+    return CODEC_SUCCESS;
+}
+
+static enum CODEC_STATUS runCoder(void) {
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    decoderSession_t session;
+    DecoderInit(&session);
+    bool last = false;
+    for (size_t numChunks = 0; !last; numChunks++) {
+        chunk_t *in = acquireFull(&toCoder);
+        chunk_t *out = acquireEmpty(&toWriter);
+        out->length = 0;
+        if (status == CODEC_SUCCESS) {
+            if (mode == MODE_DECODE) {
+                status = decodeChunk(&session, in, out);
+            } else {
+                options.stats = statsEvery != 0 &&
+                                numChunks % statsEvery == 0 ? &stats : NULL;
+                status = EncodeText(in->data, in->length, &options,
+                                    writeTokens, out);
+            }
+        }
+        last = in->last;
+        if (last && status == CODEC_SUCCESS && reserve(out, 32)) {
+            if (mode == MODE_DECODE) {
+                out->length += DecoderFinish(&session,
+                                             out->data + out->length);
+            } else if (mode == MODE_COUNT) {
+                out->length += sprintf(out->data + out->length, "%llu\n",
+                                       (unsigned long long) numTokens);
+            } else if (!binary && numTokens != 0) {
+                out->data[out->length++] = '\n';
+            }
+        }
+        out->last = last;
+        release(&toCoder, in);
+        publish(&toWriter, out);
+    }
+    return status;
+}
+
+// ==========================================================================
+// Histogram
+// ==========================================================================
+
+static void countWord(wordCount_t **words, const char *bytes, size_t length,
+                      uint64_t count) {
+    wordCount_t *word;
+    HASH_FIND(hh, *words, bytes, length, word);
+    if (word == NULL) {
+        word = malloc(sizeof(wordCount_t) + length);
+        if (word == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memcpy(word->bytes, bytes, length);
+        word->count = 0;
+        HASH_ADD_KEYPTR(hh, *words, word->bytes, length, word);
+    }
+    word->count += count;
+}
+
+static void countTokens(const uint16_t *tokens, size_t count,
+                        size_t offset, size_t length, void *ctx) {
+    histogramCoder_t *coder = (histogramCoder_t *) ctx;
+    for (size_t idx = 0; idx < count; idx++) {
+        coder->counts[tokens[idx]]++;
+    }
+    coder->numTokens += count;
+    if (wordsPath != NULL) {
+        countWord(&coder->words, coder->text + offset, length, 1);
+    }
+}
+
+static void *histogramMain(void *arg) {
+    histogramCoder_t *coder = (histogramCoder_t *) arg;
+    encodeOptions_t coderOptions = options;
+    bool last = false;
+    for (size_t numChunks = 0; !last; numChunks++) {
+        chunk_t *in = acquireFull(&toCoder);
+        if (coder->status == CODEC_SUCCESS && in->length != 0) {
+            coderOptions.stats = statsEvery != 0 &&
+                                 numChunks % statsEvery == 0 ?
+                                 &coder->stats : NULL;
+            coder->text = in->data;
+            coder->status = EncodeText(in->data, in->length, &coderOptions,
+                                       countTokens, coder);
+        }
+        last = in->last;
+        release(&toCoder, in);
+    }
+    return NULL;
+}
+
+/* Bytes as text: printable ASCII as is, anything else escaped. */
+static void writeEscaped(FILE *f, const char *bytes, size_t length) {
+    for (size_t idx = 0; idx < length; idx++) {
+        unsigned char ch = (unsigned char) bytes[idx];
+        if (ch == '\\') {
+            fputs("\\\\", f);
+        } else if (ch == '\n') {
+            fputs("\\n", f);
+        } else if (ch == '\t') {
+            fputs("\\t", f);
+        } else if (ch < 0x20 || ch >= 0x7F) {
+            fprintf(f, "\\x%02X", ch);
+        } else {
+            fputc(ch, f);
+        }
+    }
+}
+
+static int byCount(const wordCount_t *a, const wordCount_t *b) {
+    return a->count < b->count ? 1 : a->count > b->count ? -1 : 0;
+}
+
+static bool writeWords(wordCount_t **words) {
+    FILE *f = fopen(wordsPath, "w");
+    if (f == NULL) {
+        perror(wordsPath);
+        return false;
+    }
+    HASH_SORT(*words, byCount);
+    for (wordCount_t *word = *words; word != NULL; word = word->hh.next) {
+        fprintf(f, "%llu\t", (unsigned long long) word->count);
+        writeEscaped(f, word->bytes, word->hh.keylen);
+        fputc('\n', f);
+    }
+    if (fclose(f) != 0) {
+        perror(wordsPath);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Writes the counts as NUM_IDS uint64s indexed by token id, or with -t as
+ * a line of id, count and the token's bytes for every token that occurs.
+ */
+static void writeHistogram(const uint64_t *counts) {
+    if (binary) {
+        if (fwrite(counts, sizeof(uint64_t), NUM_IDS, stdout) != NUM_IDS) {
+            perror("stdout");
+            exit(1);
+        }
+    } else {
+        char bytes[MAX_TOKEN_BYTES];
+        for (uint32_t id = 0; id < NUM_IDS; id++) {
+            size_t length;
+            if (counts[id] == 0 ||
+                DecodeTokenBytes(id, bytes, &length) != CODEC_SUCCESS) {
+                continue;
+            }
+            printf("%u\t%llu\t", id, (unsigned long long) counts[id]);
+            writeEscaped(stdout, bytes, length);
+            putchar('\n');
+        }
+    }
+    fflush(stdout);
+}
+
+static enum CODEC_STATUS runHistogram(void) {
+    histogramCoder_t *coders = calloc(numCoders, sizeof(histogramCoder_t));
+    if (coders == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (size_t idx = 0; idx < numCoders; idx++) {
+        coders[idx].counts = calloc(NUM_IDS, sizeof(uint64_t));
+        if (coders[idx].counts == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        pthread_create(&coders[idx].thread, NULL, histogramMain,
+                       &coders[idx]);
+    }
+    histogramCoder_t *total = &coders[0];
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    for (size_t idx = 0; idx < numCoders; idx++) {
+        histogramCoder_t *coder = &coders[idx];
+        pthread_join(coder->thread, NULL);
+        if (status == CODEC_SUCCESS) {
+            status = coder->status;
+        }
+        numTokens += coder->numTokens;
+        StatsMerge(&stats, &coder->stats);
+        if (coder == total) {
+            continue;
+        }
+        for (uint32_t id = 0; id < NUM_IDS; id++) {
+            total->counts[id] += coder->counts[id];
+        }
+        wordCount_t *word, *next;
+        HASH_ITER(hh, coder->words, word, next) {
+            HASH_DEL(coder->words, word);
+            countWord(&total->words, word->bytes, word->hh.keylen,
+                      word->count);
+            free(word);
+        }
+        free(coder->counts);
+    }
+    if (status == CODEC_SUCCESS) {
+        writeHistogram(total->counts);
+        if (wordsPath != NULL && !writeWords(&total->words)) {
+            failed = true;
+        }
+    }
+    wordCount_t *word, *next;
+    HASH_ITER(hh, total->words, word, next) {
+        HASH_DEL(total->words, word);
+        free(word);
+    }
+    free(total->counts);
+    free(coders);
+    return status;
+}
+
+// ==========================================================================
+// Writer
+// ==========================================================================
+
+static void *writerMain(void *arg) {
+    (void) arg;
+    bool last = false;
+    while (!last) {
+        chunk_t *out = acquireFull(&toWriter);
+        if (out->length != 0 &&
+            fwrite(out->data, 1, out->length, stdout) != out->length) {
+            perror("stdout");
+            exit(1);
+        }
+        last = out->last;
+        release(&toWriter, out);
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s encode|decode|count|histogram [-t] [-a] [-r] "
+            "[-b bytes] [-s n]\n"
+            "       [-j threads] [-w file] [file...]\n"
+            "  -t  token ids as text rather than binary uint16; the "
+            "histogram as lines of\n"
+            "      id, count and token rather than %d binary uint64 counts\n"
+            "  -r  decode to the exact bytes that were encoded, rather than "
+            "replacing\n"
+            "      invalid UTF-8 with U+FFFD\n"
+            "  -a  encode registered special tokens, such as "
+            "<|endoftext|>, as their ids\n"
+            "  -b  chunk size in bytes, default 1048576\n"
+            "  -s  collect statistics on every nth chunk, printed to stderr "
+            "as JSON\n"
+            "  -j  histogram threads, default one per core\n"
+            "  -w  also write pre-token counts to file, most frequent "
+            "first\n"
+            "Reads stdin when no files are given.\n",
+            name, NUM_IDS);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "encode") == 0) {
+        mode = MODE_ENCODE;
+    } else if (strcmp(argv[1], "decode") == 0) {
+        mode = MODE_DECODE;
+    } else if (strcmp(argv[1], "count") == 0) {
+        mode = MODE_COUNT;
+    } else if (strcmp(argv[1], "histogram") == 0) {
+        mode = MODE_HISTOGRAM;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "tarb:s:j:w:h")) != -1) {
+        switch (opt) {
+            case 't':
+                binary = false;
+                break;
+            case 'a':
+                options.allowSpecial = SPECIAL_ALL;
+                break;
+            case 'r':
+                rawBytes = true;
+                break;
+            case 'b':
+                chunkSize = (size_t) atol(optarg);
+                break;
+            case 's':
+                statsEvery = (size_t) atol(optarg);
+                break;
+            case 'j':
+                numCoders = (size_t) atol(optarg);
+                break;
+            case 'w':
+                wordsPath = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (chunkSize < 64 || numCoders > MAX_CODERS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (mode != MODE_HISTOGRAM) {
+        numCoders = 1;
+    } else if (numCoders == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        numCoders = cores < 1 ? 1 : cores > MAX_CODERS ? MAX_CODERS :
+                                    (size_t) cores;
+    }
+    inputs = argv + optind;
+    numInputs = argc - optind;
+
+    enum CODEC_STATUS status = InitializeGPT2Codec();
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "InitializeGPT2Codec failed: %d\n", status);
+        return 1;
+    }
+
+    CalibrateRdtscTicks();
+    channelInit(&toCoder, numCoders);
+    channelInit(&toWriter, 1);
+    uint64_t start = RDTSC();
+    pthread_t reader, writer;
+    pthread_create(&reader, NULL, readerMain, NULL);
+    if (mode == MODE_HISTOGRAM) {
+        status = runHistogram();
+    } else {
+        pthread_create(&writer, NULL, writerMain, NULL);
+        status = runCoder();
+        pthread_join(writer, NULL);
+    }
+    pthread_join(reader, NULL);
+    double seconds = (RDTSC() - start) / g_TicksPerNanoSec / 1000000000;
 
-int main() {
-    InitializeGPT2Codec();
-    EncodeTextFile("test.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    // EncodeTextFile("frankenstein.txt");
-    /* EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html");
-    EncodeTextFile("enwiki8.html"); */
-}
\ No newline at end of file
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "%s failed: %d\n", argv[1], status);
+    }
+    fprintf(stderr, "%.2f MB in %.3f s: %.2f MB/s, %llu tokens, "
+                    "%.0f tokens/s\n",
+            bytesIn / 1000000.0, seconds, bytesIn / seconds / 1000000,
+            (unsigned long long) numTokens, numTokens / seconds);
+    if (statsEvery != 0) {
+        char *report = StatsReport(&stats);
+        if (report != NULL) {
+            fprintf(stderr, "%s\n", report);
+            free(report);
+        }
+    }
+    channelFree(&toCoder);
+    channelFree(&toWriter);
+    ShutdownGPT2Codec();
+    return status != CODEC_SUCCESS || failed;
+}
@@ -0,0 +1,24 @@
+//
+// Packs encoded documents into fixed length training sequences.
+//
+// Tokens are written straight from the encoder into the caller's output
+// buffer.  The buffer is handed to onBatch whenever it fills up and then
+// reused, so memory stays bounded no matter how much input streams through.
+// A document is only copied when it has to move: when greedy packing
+// pushes it onto a fresh row, when best-fit finds it a tighter row, or when
+// it is carried over into the next batch.
+//
+
+#include "packer.h"
+#include <string.h>
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+#define ID_BITS 16
+#include "packer_template.h"
+#undef ID_BITS
+
+#define ID_BITS 32
+#include "packer_template.h"
+#undef ID_BITS
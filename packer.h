@@ -0,0 +1,139 @@
+//
+// Packs encoded documents into fixed length training sequences.
+//
+
+#ifndef GPT2_CODEC_PACKER_H
+#define GPT2_CODEC_PACKER_H
+
+#include "library.h"
+#include <stdbool.h>
+
+enum PACK_MODE {
+    PACK_CONCAT,                 /* documents run across sequences, no padding */
+    PACK_GREEDY,                 /* a document that would straddle two
+                                    sequences starts a new one instead */
+    PACK_BEST_FIT                /* into the open sequence with the least room
+                                    left that still fits the document.  Only
+                                    the rows of the current batch are open,
+                                    so with few numSequences it can pad more
+                                    than greedy packing */
+};
+
+/*
+ * Receives a batch of `numSequences` rows of the output buffer.  Rows are
+ * `blockSize` tokens wide, and docStarts rows `maxDocsPerSequence` wide,
+ * with docCounts giving the documents starting in each row.  The buffers
+ * are reused for the next batch once this returns.
+ */
+typedef void (*batchSink_t)(const uint16_t *tokens, const uint32_t *docStarts,
+                            const uint32_t *docCounts, size_t numSequences,
+                            void *ctx);
+
+typedef struct {
+    enum PACK_MODE mode;
+    size_t blockSize;
+    size_t numSequences;         /* rows in the output buffer */
+    size_t maxDocsPerSequence;   /* row width of docStarts, a row that runs
+                                    out of room for starts is closed early */
+    bool appendEot;              /* end every document with eotToken */
+    uint16_t eotToken;
+    uint16_t padToken;
+    uint16_t *tokens;            /* [numSequences][blockSize] */
+    uint32_t *docStarts;         /* [numSequences][maxDocsPerSequence], or
+                                    NULL together with docCounts */
+    uint32_t *docCounts;         /* [numSequences] */
+    batchSink_t onBatch;
+    void *ctx;
+} packerConfig_t;
+
+/* The same for 32 bit ids, see PackerInit32(). */
+typedef void (*batchSink32_t)(const uint32_t *tokens,
+                              const uint32_t *docStarts,
+                              const uint32_t *docCounts, size_t numSequences,
+                              void *ctx);
+
+typedef struct {
+    enum PACK_MODE mode;
+    size_t blockSize;
+    size_t numSequences;
+    size_t maxDocsPerSequence;
+    bool appendEot;
+    uint32_t eotToken;
+    uint32_t padToken;
+    uint32_t *tokens;
+    uint32_t *docStarts;
+    uint32_t *docCounts;
+    batchSink32_t onBatch;
+    void *ctx;
+} packerConfig32_t;
+
+typedef struct {
+    packerConfig_t config;
+    size_t capacity;             /* numSequences * blockSize */
+    size_t cursor;               /* where the next token is written */
+    size_t docBegin;             /* where the current document starts */
+    bool inDoc;
+    bool docRecorded;            /* its start is in this batch's docStarts */
+    bool docContinued;           /* it began in an earlier batch */
+    uint32_t *fill;              /* committed tokens in each row */
+    uint16_t *carry;             /* a partial document moving to the next
+                                    batch, at most blockSize tokens */
+    size_t numDocuments;
+    size_t numBatches;
+    size_t numSequencesOut;
+    size_t numPadding;
+} packer_t;
+
+typedef struct {
+    packerConfig32_t config;
+    size_t capacity;
+    size_t cursor;
+    size_t docBegin;
+    bool inDoc;
+    bool docRecorded;
+    bool docContinued;
+    uint32_t *fill;
+    uint32_t *carry;
+    size_t numDocuments;
+    size_t numBatches;
+    size_t numSequencesOut;
+    size_t numPadding;
+} packer32_t;
+
+enum CODEC_STATUS PackerInit(packer_t *packer, const packerConfig_t *config);
+
+/*
+ * A document that fails to encode is dropped, though one long enough to
+ * span batches may already have been partly handed to onBatch.
+ */
+enum CODEC_STATUS PackDocument(packer_t *packer, const char *text,
+                               size_t numBytes,
+                               const encodeOptions_t *options);
+
+enum CODEC_STATUS PackDocumentTokens(packer_t *packer, const uint16_t *tokens,
+                                     size_t numTokens);
+
+void PackerFinish(packer_t *packer);
+
+void PackerFree(packer_t *packer);
+
+/*
+ * The packer over 32 bit ids, for vocabularies PackDocument() cannot
+ * encode.  PackDocument32() encodes with EncodeText32().
+ */
+enum CODEC_STATUS PackerInit32(packer32_t *packer,
+                               const packerConfig32_t *config);
+
+enum CODEC_STATUS PackDocument32(packer32_t *packer, const char *text,
+                                 size_t numBytes,
+                                 const encodeOptions_t *options);
+
+enum CODEC_STATUS PackDocumentTokens32(packer32_t *packer,
+                                       const uint32_t *tokens,
+                                       size_t numTokens);
+
+void PackerFinish32(packer32_t *packer);
+
+void PackerFree32(packer32_t *packer);
+
+#endif //GPT2_CODEC_PACKER_H
@@ -0,0 +1,326 @@
+//
+// The packer, written once for every id width.  packer.c includes this file
+// with ID_BITS set to 16 and again with 32.  The 16 bit pass defines the
+// plain PackerInit(), PackDocument() and friends over packer_t, the 32 bit
+// one PackerInit32() and so on over packer32_t; the static helpers carry
+// the width as a suffix either way.
+//
+
+#if ID_BITS == 16
+#define ID_T uint16_t
+#define PUBLIC(name) name
+#define PACKER_T packer_t
+#define CONFIG_T packerConfig_t
+#define ENCODE EncodeText
+#elif ID_BITS == 32
+#define ID_T uint32_t
+#define PUBLIC(name) CONCAT(name, 32)
+#define PACKER_T packer32_t
+#define CONFIG_T packerConfig32_t
+#define ENCODE EncodeText32
+#else
+#error "ID_BITS must be 16 or 32"
+#endif
+
+#define SUFFIX(name) CONCAT(name, ID_BITS)
+
+static void SUFFIX(recordDocStart)(PACKER_T *packer, size_t row,
+                                   size_t offset) {
+    CONFIG_T *config = &packer->config;
+    if (config->docStarts != NULL) {
+        config->docStarts[row * config->maxDocsPerSequence +
+                          config->docCounts[row]++] = (uint32_t) offset;
+    }
+    packer->docRecorded = true;
+}
+
+static bool SUFFIX(rowHasDocRoom)(const PACKER_T *packer, size_t row) {
+    const CONFIG_T *config = &packer->config;
+    return config->docStarts == NULL ||
+           config->docCounts[row] < config->maxDocsPerSequence;
+}
+
+static void SUFFIX(flushRows)(PACKER_T *packer, size_t numRows) {
+    CONFIG_T *config = &packer->config;
+    size_t blockSize = config->blockSize;
+    for (size_t row = 0; row < numRows; row++) {
+        ID_T *tokens = config->tokens + row * blockSize;
+        for (size_t col = packer->fill[row]; col < blockSize; col++) {
+            tokens[col] = config->padToken;
+        }
+        packer->numPadding += blockSize - packer->fill[row];
+    }
+    if (numRows != 0) {
+        config->onBatch(config->tokens, config->docStarts, config->docCounts,
+                        numRows, config->ctx);
+        packer->numBatches++;
+        packer->numSequencesOut += numRows;
+    }
+    memset(packer->fill, 0, config->numSequences * sizeof(uint32_t));
+    if (config->docCounts != NULL) {
+        memset(config->docCounts, 0,
+               config->numSequences * sizeof(uint32_t));
+    }
+}
+
+static void SUFFIX(commitRows)(PACKER_T *packer, size_t begin, size_t end) {
+    size_t blockSize = packer->config.blockSize;
+    for (size_t row = begin / blockSize; row * blockSize < end; row++) {
+        size_t rowEnd = end - row * blockSize;
+        packer->fill[row] = rowEnd < blockSize ? rowEnd : blockSize;
+    }
+}
+
+/*
+ * The output buffer is full.  A document short enough to fit a single row
+ * is carried over whole into the next batch, anything else continues there.
+ */
+static void SUFFIX(makeRoom)(PACKER_T *packer) {
+    CONFIG_T *config = &packer->config;
+    size_t blockSize = config->blockSize;
+    size_t length = packer->cursor - packer->docBegin;
+
+    if (!packer->inDoc || length == 0) {
+        SUFFIX(flushRows)(packer,
+                          (packer->cursor + blockSize - 1) / blockSize);
+        packer->cursor = 0;
+        packer->docBegin = 0;
+    } else if (config->mode != PACK_CONCAT && length < blockSize) {
+        memcpy(packer->carry, config->tokens + packer->docBegin,
+               length * sizeof(ID_T));
+        bool recorded = packer->docRecorded;
+        if (recorded && config->docCounts != NULL) {
+            config->docCounts[packer->docBegin / blockSize]--;
+        }
+        SUFFIX(flushRows)(packer,
+                          (packer->docBegin + blockSize - 1) / blockSize);
+        memcpy(config->tokens, packer->carry, length * sizeof(ID_T));
+        packer->docBegin = 0;
+        packer->cursor = length;
+        packer->docRecorded = false;
+        if (recorded) {
+            SUFFIX(recordDocStart)(packer, 0, 0);
+        }
+    } else {
+        if (!packer->docRecorded && !packer->docContinued) {
+            SUFFIX(recordDocStart)(packer, packer->docBegin / blockSize,
+                                   packer->docBegin % blockSize);
+        }
+        SUFFIX(commitRows)(packer, packer->docBegin, packer->capacity);
+        SUFFIX(flushRows)(packer, config->numSequences);
+        packer->docBegin = 0;
+        packer->cursor = 0;
+        packer->docRecorded = false;
+        packer->docContinued = true;
+    }
+}
+
+/*
+ * Greedy packing: the current document started part way into a row and has
+ * just reached the end of it, so it moves to the start of the next row.
+ */
+static void SUFFIX(moveToNextRow)(PACKER_T *packer) {
+    CONFIG_T *config = &packer->config;
+    size_t blockSize = config->blockSize;
+    size_t length = packer->cursor - packer->docBegin;
+    size_t row = packer->docBegin / blockSize;
+    if (!SUFFIX(rowHasDocRoom)(packer, row + 1)) {
+        return;
+    }
+    memcpy(config->tokens + packer->cursor,
+           config->tokens + packer->docBegin, length * sizeof(ID_T));
+    if (packer->docRecorded && config->docCounts != NULL) {
+        config->docCounts[row]--;
+    }
+    packer->docBegin = packer->cursor;
+    packer->cursor += length;
+    SUFFIX(recordDocStart)(packer, row + 1, 0);
+}
+
+static void SUFFIX(appendTokens)(PACKER_T *packer, const ID_T *tokens,
+                                 size_t numTokens) {
+    CONFIG_T *config = &packer->config;
+    size_t blockSize = config->blockSize;
+    while (numTokens > 0) {
+        if (packer->cursor == packer->capacity) {
+            SUFFIX(makeRoom)(packer);
+        } else if (config->mode == PACK_GREEDY &&
+                   packer->cursor % blockSize == 0 &&
+                   packer->docBegin % blockSize != 0 &&
+                   packer->cursor - packer->docBegin < blockSize) {
+            SUFFIX(moveToNextRow)(packer);
+        }
+        size_t rowEnd = (packer->cursor / blockSize + 1) * blockSize;
+        size_t chunk = rowEnd - packer->cursor;
+        if (chunk > numTokens) {
+            chunk = numTokens;
+        }
+        memcpy(config->tokens + packer->cursor, tokens,
+               chunk * sizeof(ID_T));
+        packer->cursor += chunk;
+        tokens += chunk;
+        numTokens -= chunk;
+    }
+}
+
+static void SUFFIX(packTokens)(const ID_T *tokens, size_t numTokens,
+                               size_t offset, size_t length, void *ctx) {
+    SUFFIX(appendTokens)((PACKER_T *) ctx, tokens, numTokens);
+}
+
+static void SUFFIX(beginDocument)(PACKER_T *packer) {
+    size_t blockSize = packer->config.blockSize;
+    packer->inDoc = false;
+    packer->docRecorded = false;
+    packer->docContinued = false;
+    if (packer->config.mode != PACK_BEST_FIT) {
+        if (packer->cursor == packer->capacity) {
+            SUFFIX(makeRoom)(packer);
+        }
+        if (!SUFFIX(rowHasDocRoom)(packer, packer->cursor / blockSize)) {
+            packer->cursor = (packer->cursor / blockSize + 1) * blockSize;
+            if (packer->cursor == packer->capacity) {
+                SUFFIX(makeRoom)(packer);
+            }
+        }
+        SUFFIX(recordDocStart)(packer, packer->cursor / blockSize,
+                               packer->cursor % blockSize);
+    }
+    /* Best fit writes to the first unused row and places the document once
+       its length is known. */
+    packer->docBegin = packer->cursor;
+    packer->inDoc = true;
+}
+
+static void SUFFIX(abandonDocument)(PACKER_T *packer) {
+    CONFIG_T *config = &packer->config;
+    if (packer->docRecorded && config->docCounts != NULL) {
+        config->docCounts[packer->docBegin / config->blockSize]--;
+    }
+    packer->cursor = packer->docBegin;
+    packer->inDoc = false;
+}
+
+static void SUFFIX(endDocument)(PACKER_T *packer) {
+    CONFIG_T *config = &packer->config;
+    size_t blockSize = config->blockSize;
+    size_t length = packer->cursor - packer->docBegin;
+    if (length == 0) {
+        SUFFIX(abandonDocument)(packer);
+        return;
+    }
+    packer->inDoc = false;
+    packer->numDocuments++;
+
+    /* Only rows of the batch still in the buffer are candidates, the ones
+       already handed to onBatch are gone. */
+    if (config->mode == PACK_BEST_FIT && length <= blockSize) {
+        size_t firstFresh = packer->docBegin / blockSize;
+        size_t best = firstFresh;
+        size_t bestRoom = blockSize + 1;
+        for (size_t row = 0; row < firstFresh; row++) {
+            size_t room = blockSize - packer->fill[row];
+            if (room >= length && room < bestRoom &&
+                (packer->docContinued ||
+                 SUFFIX(rowHasDocRoom)(packer, row))) {
+                best = row;
+                bestRoom = room;
+                if (room == length) break;
+            }
+        }
+        if (best != firstFresh) {
+            memcpy(config->tokens + best * blockSize + packer->fill[best],
+                   config->tokens + packer->docBegin,
+                   length * sizeof(ID_T));
+            if (!packer->docContinued) {
+                SUFFIX(recordDocStart)(packer, best, packer->fill[best]);
+            }
+            packer->fill[best] += length;
+            packer->cursor = packer->docBegin;
+            return;
+        }
+    }
+
+    if (!packer->docRecorded && !packer->docContinued) {
+        SUFFIX(recordDocStart)(packer, packer->docBegin / blockSize,
+                               packer->docBegin % blockSize);
+    }
+    SUFFIX(commitRows)(packer, packer->docBegin, packer->cursor);
+    if (config->mode == PACK_BEST_FIT) {
+        packer->cursor = (packer->cursor + blockSize - 1) / blockSize *
+                         blockSize;
+    }
+}
+
+enum CODEC_STATUS PUBLIC(PackerInit)(PACKER_T *packer,
+                                     const CONFIG_T *config) {
+    memset(packer, 0, sizeof(PACKER_T));
+    if (config->blockSize == 0 || config->numSequences == 0 ||
+        config->tokens == NULL || config->onBatch == NULL ||
+        (config->docStarts == NULL) != (config->docCounts == NULL) ||
+        (config->docStarts != NULL && config->maxDocsPerSequence == 0)) {
+        return ERR_PACK_INVALID;
+    }
+    packer->config = *config;
+    packer->capacity = config->numSequences * config->blockSize;
+    packer->fill = calloc(config->numSequences, sizeof(uint32_t));
+    packer->carry = malloc(config->blockSize * sizeof(ID_T));
+    if (packer->fill == NULL || packer->carry == NULL) {
+        PUBLIC(PackerFree)(packer);
+        return ERR_PACK_MALLOC;
+    }
+    if (config->docCounts != NULL) {
+        memset(config->docCounts, 0, config->numSequences * sizeof(uint32_t));
+    }
+    return CODEC_SUCCESS;
+}
+
+enum CODEC_STATUS PUBLIC(PackDocument)(PACKER_T *packer, const char *text,
+                                       size_t numBytes,
+                                       const encodeOptions_t *options) {
+    SUFFIX(beginDocument)(packer);
+    enum CODEC_STATUS status = ENCODE(text, numBytes, options,
+                                      SUFFIX(packTokens), packer);
+    if (status != CODEC_SUCCESS) {
+        SUFFIX(abandonDocument)(packer);
+        return status;
+    }
+    if (packer->config.appendEot) {
+        SUFFIX(appendTokens)(packer, &packer->config.eotToken, 1);
+    }
+    SUFFIX(endDocument)(packer);
+    return CODEC_SUCCESS;
+}
+
+enum CODEC_STATUS PUBLIC(PackDocumentTokens)(PACKER_T *packer,
+                                             const ID_T *tokens,
+                                             size_t numTokens) {
+    SUFFIX(beginDocument)(packer);
+    SUFFIX(appendTokens)(packer, tokens, numTokens);
+    if (packer->config.appendEot) {
+        SUFFIX(appendTokens)(packer, &packer->config.eotToken, 1);
+    }
+    SUFFIX(endDocument)(packer);
+    return CODEC_SUCCESS;
+}
+
+void PUBLIC(PackerFinish)(PACKER_T *packer) {
+    size_t blockSize = packer->config.blockSize;
+    SUFFIX(flushRows)(packer, (packer->cursor + blockSize - 1) / blockSize);
+    packer->cursor = 0;
+    packer->docBegin = 0;
+}
+
+void PUBLIC(PackerFree)(PACKER_T *packer) {
+    free(packer->fill);
+    free(packer->carry);
+    packer->fill = NULL;
+    packer->carry = NULL;
+}
+
+#undef SUFFIX
+#undef ENCODE
+#undef CONFIG_T
+#undef PACKER_T
+#undef PUBLIC
+#undef ID_T
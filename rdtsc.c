@@ -14,6 +14,8 @@
 #include "rdtsc.h"
 
 const int NANO_SECONDS_IN_SEC = 1000000000;
+double g_TicksPerNanoSec;
+
 /* returns a static buffer of struct timespec with the time difference of ts1
  * and ts2, ts1 is assumed to be greater than ts2 */
 struct timespec *TimeSpecDiff(struct timespec *ts1, struct timespec *ts2)
@@ -27,6 +27,6 @@ static inline uint64_t RDTSC() {
 #endif
 
     void CalibrateRdtscTicks();
-    double g_TicksPerNanoSec;
+    extern double g_TicksPerNanoSec;
 
 #endif //GPT2_CODEC_RDTSC_H
@@ -0,0 +1,777 @@
+//
+// Tokenization server: holds one set of codec tables and serves encode,
+// decode and count requests over a Unix domain socket, see server.h.
+//
+// The main thread polls the listening socket and every connection, cuts
+// complete frames out of the input and queues them.  A fixed pool of
+// workers takes queued requests in batches of up to `batchSize`, so a
+// burst of small requests costs one wakeup and one lock round trip per
+// batch rather than per request.
+//
+// Client sockets never block.  A worker writes each response as soon as
+// the request is done, as far as the socket takes it, and leaves the rest
+// in the connection's output queue for the poll loop to send.  The poll
+// loop stops reading from a connection with too many requests in flight or
+// too much output queued until it catches up, so a client that sends
+// without reading neither stalls a worker nor makes the server buffer
+// without limit.
+//
+
+#include "library.h"
+#include "histogram.h"
+#include "rdtsc.h"
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define READ_CHUNK 65536
+#define WORD_CACHE_BYTES (64 << 20)
+/* Past these a connection is not read from until it catches up. */
+#define MAX_PENDING_REQUESTS 64
+#define MAX_PENDING_OUTPUT (4 << 20)
+
+typedef struct {
+    int fd;
+    atomic_int refs;             /* the poll loop plus each queued request */
+    pthread_mutex_t writeLock;   /* guards the output queue */
+    char *input;                 /* bytes not yet cut into frames */
+    size_t inputLen;
+    size_t inputCap;
+    char *output;                /* responses the socket did not take yet */
+    size_t outputLen;
+    size_t outputCap;
+    bool broken;                 /* a write failed, the poll loop drops it */
+} connection_t;
+
+typedef struct request {
+    connection_t *conn;
+    frameHeader_t header;
+    char *payload;
+    uint64_t received;           /* RDTSC once the frame was complete */
+    struct request *next;
+    struct request *prev;
+} request_t;
+
+typedef struct {
+    pthread_t thread;
+    size_t numServed;
+    codecStats_t sample;         /* statistics of the current request */
+    uint16_t *tokens;            /* response buffers, reused */
+    size_t numTokens;
+    size_t tokensCap;
+    bool failed;                 /* tokens were dropped for lack of memory */
+    char *text;
+    size_t textCap;
+} worker_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    request_t *head;
+    size_t length;
+    bool stopping;
+} queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static struct {
+    pthread_mutex_t lock;
+    latencyHistogram_t latencies[OP_STATS + 1];
+    uint64_t batches;
+    uint64_t requests;
+    codecStats_t workload;       /* of the sampled requests */
+} stats = {PTHREAD_MUTEX_INITIALIZER};
+
+static const char *opNames[OP_STATS + 1] = {
+        "invalid", "encode", "decode", "count", "stats"};
+
+static size_t batchSize = 16;
+static long batchWindowUs = 0;
+static size_t statsEvery = 0;
+static int signalPipe[2];
+static int wakePipe[2];          /* a connection needs the poll loop */
+
+// ==========================================================================
+// Connections
+// ==========================================================================
+
+static void wakePollLoop(void) {
+    /* A full pipe means it is awake already. */
+    (void) !write(wakePipe[1], "x", 1);
+}
+
+static void releaseConnection(connection_t *conn) {
+    int refs = atomic_fetch_sub(&conn->refs, 1);
+    if (refs == 1) {
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->writeLock);
+        free(conn->input);
+        free(conn->output);
+        free(conn);
+    } else if (refs == MAX_PENDING_REQUESTS + 1) {
+        /* Back under the limit, reading resumes. */
+        wakePollLoop();
+    }
+}
+
+/*
+ * Writes as much of `iov` as the socket takes without blocking and leaves
+ * the rest in it.  Returns the number of bytes written, or -1 if the
+ * connection failed.
+ */
+static ssize_t writeSome(int fd, struct iovec *iov, int count) {
+    ssize_t total = 0;
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? total : -1;
+        }
+        total += written;
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= (ssize_t) iov->iov_len;
+            iov->iov_len = 0;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return total;
+}
+
+/* Appends what is left of `iov` to the output queue. */
+static bool queueOutput(connection_t *conn, const struct iovec *iov,
+                        int count) {
+    size_t length = 0;
+    for (int idx = 0; idx < count; idx++) {
+        length += iov[idx].iov_len;
+    }
+    if (conn->outputCap - conn->outputLen < length) {
+        size_t capacity = conn->outputCap * 2 + length;
+        char *output = realloc(conn->output, capacity);
+        if (output == NULL) {
+            return false;
+        }
+        conn->output = output;
+        conn->outputCap = capacity;
+    }
+    for (int idx = 0; idx < count; idx++) {
+        memcpy(conn->output + conn->outputLen, iov[idx].iov_base,
+               iov[idx].iov_len);
+        conn->outputLen += iov[idx].iov_len;
+    }
+    return true;
+}
+
+static void respond(connection_t *conn, const frameHeader_t *request,
+                    enum CODEC_STATUS status, const void *payload,
+                    size_t length) {
+    frameHeader_t header = {.length = (uint32_t) length,
+                            .id = request->id,
+                            .op = request->op,
+                            .status = (uint8_t) status};
+    struct iovec iov[2] = {{&header, sizeof(header)},
+                           {(void *) payload, length}};
+    int count = length != 0 ? 2 : 1;
+    bool wake = false;
+    pthread_mutex_lock(&conn->writeLock);
+    /* A client that went away just loses its response. */
+    if (!conn->broken) {
+        /* Queued responses go first. */
+        ssize_t written = conn->outputLen == 0 ?
+                          writeSome(conn->fd, iov, count) : 0;
+        if (written < 0) {
+            conn->broken = true;
+        } else {
+            bool idle = conn->outputLen == 0;
+            if (!queueOutput(conn, iov, count)) {
+                conn->broken = true;
+            }
+            wake = idle && conn->outputLen != 0;
+        }
+        wake = wake || conn->broken;
+    }
+    pthread_mutex_unlock(&conn->writeLock);
+    if (wake) {
+        wakePollLoop();
+    }
+}
+
+/* Sends queued output.  Returns false once the connection should be
+   dropped. */
+static bool flushOutput(connection_t *conn) {
+    pthread_mutex_lock(&conn->writeLock);
+    size_t sent = 0;
+    while (sent < conn->outputLen && !conn->broken) {
+        ssize_t written = write(conn->fd, conn->output + sent,
+                                conn->outputLen - sent);
+        if (written >= 0) {
+            sent += written;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            conn->broken = true;
+        }
+    }
+    if (sent != 0) {
+        memmove(conn->output, conn->output + sent, conn->outputLen - sent);
+        conn->outputLen -= sent;
+    }
+    bool alive = !conn->broken;
+    pthread_mutex_unlock(&conn->writeLock);
+    return alive;
+}
+
+/* What the poll loop waits for on the connection, -1 to drop it. */
+static short pollEvents(connection_t *conn) {
+    pthread_mutex_lock(&conn->writeLock);
+    bool broken = conn->broken;
+    size_t pending = conn->outputLen;
+    pthread_mutex_unlock(&conn->writeLock);
+    if (broken) {
+        return -1;
+    }
+    short events = pending != 0 ? POLLOUT : 0;
+    if (atomic_load(&conn->refs) - 1 < MAX_PENDING_REQUESTS &&
+        pending < MAX_PENDING_OUTPUT) {
+        events |= POLLIN;
+    }
+    return events;
+}
+
+/*
+ * Reads what the connection has to offer and appends every complete frame
+ * to `requests`.  Returns false once the connection should be dropped.
+ */
+static bool readFrames(connection_t *conn, request_t **requests) {
+    if (conn->inputCap - conn->inputLen < READ_CHUNK) {
+        size_t capacity = conn->inputCap * 2 + READ_CHUNK;
+        char *input = realloc(conn->input, capacity);
+        if (input == NULL) {
+            return false;
+        }
+        conn->input = input;
+        conn->inputCap = capacity;
+    }
+    ssize_t received = read(conn->fd, conn->input + conn->inputLen,
+                            conn->inputCap - conn->inputLen);
+    if (received < 0 &&
+        (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+    if (received <= 0) {
+        return false;
+    }
+    conn->inputLen += received;
+    uint64_t now = RDTSC();
+    size_t pos = 0;
+    while (conn->inputLen - pos >= sizeof(frameHeader_t)) {
+        frameHeader_t header;
+        memcpy(&header, conn->input + pos, sizeof(header));
+        if (header.length > SERVER_MAX_PAYLOAD) {
+            return false;
+        }
+        if (conn->inputLen - pos - sizeof(header) < header.length) {
+            break;
+        }
+        request_t *request = malloc(sizeof(request_t));
+        char *payload = malloc(header.length + 1);
+        if (request == NULL || payload == NULL) {
+            free(request);
+            free(payload);
+            return false;
+        }
+        memcpy(payload, conn->input + pos + sizeof(header), header.length);
+        payload[header.length] = '\0';
+        request->conn = conn;
+        request->header = header;
+        request->payload = payload;
+        request->received = now;
+        atomic_fetch_add(&conn->refs, 1);
+        DL_APPEND(*requests, request);
+        pos += sizeof(header) + header.length;
+    }
+    memmove(conn->input, conn->input + pos, conn->inputLen - pos);
+    conn->inputLen -= pos;
+    return true;
+}
+
+// ==========================================================================
+// Workers
+// ==========================================================================
+
+static bool reserveTokens(worker_t *worker, size_t numTokens) {
+    if (worker->numTokens + numTokens <= worker->tokensCap) {
+        return true;
+    }
+    size_t capacity = (worker->numTokens + numTokens) * 2;
+    uint16_t *tokens = realloc(worker->tokens, capacity * sizeof(uint16_t));
+    if (tokens == NULL) {
+        return false;
+    }
+    worker->tokens = tokens;
+    worker->tokensCap = capacity;
+    return true;
+}
+
+static void collectTokens(const uint16_t *tokens, size_t numTokens,
+                          size_t offset, size_t length, void *ctx) {
+    worker_t *worker = (worker_t *) ctx;
+    if (worker->failed || !reserveTokens(worker, numTokens)) {
+        worker->failed = true;
+        return;
+    }
+    memcpy(worker->tokens + worker->numTokens, tokens,
+           numTokens * sizeof(uint16_t));
+    worker->numTokens += numTokens;
+}
+
+static void countTokens(const uint16_t *tokens, size_t numTokens,
+                        size_t offset, size_t length, void *ctx) {
+    *(uint32_t *) ctx += (uint32_t) numTokens;
+}
+
+static enum CODEC_STATUS decodeRequest(worker_t *worker,
+                                       const request_t *request,
+                                       size_t *textLen) {
+    if (request->header.length % sizeof(uint16_t) != 0) {
+        return ERR_REQUEST_INVALID;
+    }
+    decoderSession_t session;
+    DecoderInit(&session);
+    size_t numIds = request->header.length / sizeof(uint16_t);
+    *textLen = 0;
+    for (size_t idx = 0; idx <= numIds; idx++) {
+        if (worker->textCap - *textLen < DECODE_BUFFER_SIZE) {
+            size_t capacity = worker->textCap * 2 + DECODE_BUFFER_SIZE;
+            char *text = realloc(worker->text, capacity);
+            if (text == NULL) {
+                return ERR_REQUEST_MALLOC;
+            }
+            worker->text = text;
+            worker->textCap = capacity;
+        }
+        if (idx == numIds) {
+            *textLen += DecoderFinish(&session, worker->text + *textLen);
+            break;
+        }
+        uint16_t id;
+        size_t length;
+        memcpy(&id, request->payload + idx * sizeof(uint16_t), sizeof(id));
+        enum CODEC_STATUS status = DecoderPush(&session, id,
+                                               worker->text + *textLen,
+                                               &length);
+        if (status != CODEC_SUCCESS) {
+            return status;
+        }
+        *textLen += length;
+    }
+    return CODEC_SUCCESS;
+}
+
+static void statsRequest(const request_t *request) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *f = open_memstream(&text, &length);
+    if (f == NULL) {
+        respond(request->conn, &request->header, ERR_REQUEST_INVALID,
+                NULL, 0);
+        return;
+    }
+    pthread_mutex_lock(&stats.lock);
+    fprintf(f, "%llu requests in %llu batches\n",
+            (unsigned long long) stats.requests,
+            (unsigned long long) stats.batches);
+    for (int op = OP_ENCODE; op <= OP_STATS; op++) {
+        HistogramPrint(f, opNames[op], &stats.latencies[op]);
+    }
+    if (statsEvery != 0) {
+        char *report = StatsReport(&stats.workload);
+        if (report != NULL) {
+            fprintf(f, "%s\n", report);
+            free(report);
+        }
+    }
+    pthread_mutex_unlock(&stats.lock);
+    fclose(f);
+    respond(request->conn, &request->header, CODEC_SUCCESS, text, length);
+    free(text);
+}
+
+static void serveRequest(worker_t *worker, const request_t *request) {
+    const frameHeader_t *header = &request->header;
+    encodeOptions_t options = {0};
+    if (header->flags & FRAME_ALLOW_SPECIAL) {
+        options.allowSpecial = SPECIAL_ALL;
+    }
+    if (statsEvery != 0 && worker->numServed++ % statsEvery == 0) {
+        memset(&worker->sample, 0, sizeof(codecStats_t));
+        options.stats = &worker->sample;
+    }
+    enum CODEC_STATUS status;
+    switch (header->op) {
+        case OP_ENCODE:
+            worker->numTokens = 0;
+            worker->failed = false;
+            status = EncodeText(request->payload, header->length, &options,
+                                collectTokens, worker);
+            if (status == CODEC_SUCCESS && worker->failed) {
+                status = ERR_REQUEST_MALLOC;
+            }
+            respond(request->conn, header, status, worker->tokens,
+                    status == CODEC_SUCCESS ?
+                    worker->numTokens * sizeof(uint16_t) : 0);
+            break;
+        case OP_COUNT: {
+            uint32_t count = 0;
+            status = EncodeText(request->payload, header->length, &options,
+                                countTokens, &count);
+            respond(request->conn, header, status, &count,
+                    status == CODEC_SUCCESS ? sizeof(count) : 0);
+            break;
+        }
+        case OP_DECODE: {
+            size_t length = 0;
+            status = decodeRequest(worker, request, &length);
+            respond(request->conn, header, status, worker->text,
+                    status == CODEC_SUCCESS ? length : 0);
+            break;
+        }
+        case OP_STATS:
+            statsRequest(request);
+            break;
+        default:
+            respond(request->conn, header, ERR_REQUEST_INVALID, NULL, 0);
+    }
+    if (options.stats != NULL && options.stats->calls != 0) {
+        pthread_mutex_lock(&stats.lock);
+        StatsMerge(&stats.workload, options.stats);
+        pthread_mutex_unlock(&stats.lock);
+    }
+}
+
+/*
+ * Waits for work, then takes up to batchSize requests.  With a batch window
+ * set, a partial batch waits that long for company first.
+ */
+static size_t takeBatch(request_t **batch) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.head == NULL && !queue.stopping) {
+        pthread_cond_wait(&queue.ready, &queue.lock);
+    }
+    if (queue.length < batchSize && batchWindowUs > 0 && !queue.stopping) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long nsec = (now.tv_usec + batchWindowUs) * 1000;
+        struct timespec deadline = {now.tv_sec + nsec / 1000000000,
+                                    nsec % 1000000000};
+        while (queue.length < batchSize && !queue.stopping &&
+               pthread_cond_timedwait(&queue.ready, &queue.lock,
+                                      &deadline) == 0) {
+        }
+    }
+    size_t numRequests = 0;
+    while (queue.head != NULL && numRequests < batchSize) {
+        request_t *request = queue.head;
+        DL_DELETE(queue.head, request);
+        batch[numRequests++] = request;
+        queue.length--;
+    }
+    if (queue.head != NULL) {
+        /* Leave the rest to the next worker. */
+        pthread_cond_signal(&queue.ready);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return numRequests;
+}
+
+static void *workerMain(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    request_t **batch = malloc(batchSize * sizeof(request_t *));
+    uint64_t *finished = malloc(batchSize * sizeof(uint64_t));
+    if (batch == NULL || finished == NULL) {
+        fprintf(stderr, "worker: out of memory\n");
+        exit(1);
+    }
+    size_t numRequests;
+    while ((numRequests = takeBatch(batch)) != 0) {
+        for (size_t idx = 0; idx < numRequests; idx++) {
+            serveRequest(worker, batch[idx]);
+            finished[idx] = RDTSC();
+        }
+        pthread_mutex_lock(&stats.lock);
+        for (size_t idx = 0; idx < numRequests; idx++) {
+            uint8_t op = batch[idx]->header.op;
+            HistogramRecord(&stats.latencies[op <= OP_STATS ? op : 0],
+                            (uint64_t) ((finished[idx] - batch[idx]->received) /
+                                        g_TicksPerNanoSec));
+        }
+        stats.batches++;
+        stats.requests += numRequests;
+        pthread_mutex_unlock(&stats.lock);
+        for (size_t idx = 0; idx < numRequests; idx++) {
+            releaseConnection(batch[idx]->conn);
+            free(batch[idx]->payload);
+            free(batch[idx]);
+        }
+    }
+    free(batch);
+    free(finished);
+    return NULL;
+}
+
+static void enqueue(request_t *requests) {
+    if (requests == NULL) {
+        return;
+    }
+    size_t numRequests;
+    request_t *request;
+    DL_COUNT(requests, request, numRequests);
+    pthread_mutex_lock(&queue.lock);
+    DL_CONCAT(queue.head, requests);
+    queue.length += numRequests;
+    pthread_cond_signal(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// ==========================================================================
+// Main loop
+// ==========================================================================
+
+static void onSignal(int signum) {
+    (void) signum;
+    (void) !write(signalPipe[1], "x", 1);
+}
+
+static int listenOn(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 128) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Moves the last connection into slot `idx`. */
+static void dropConnection(struct pollfd *fds, connection_t **conns,
+                           size_t *numFds, size_t idx) {
+    releaseConnection(conns[idx]);
+    fds[idx] = fds[*numFds - 1];
+    conns[idx] = conns[*numFds - 1];
+    (*numFds)--;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-s socket] [-t workers] [-b batch] [-w window_us] "
+            "[-j n] [-c name]\n"
+            "  -s  socket path, default " SERVER_SOCKET_PATH "\n"
+            "  -t  worker threads, default 4\n"
+            "  -b  most requests a worker takes at once, default 16\n"
+            "  -w  microseconds a partial batch waits to fill, default 0\n"
+            "  -j  collect workload statistics on every nth request, "
+            "reported\n      as JSON with the latency histograms\n"
+            "  -c  share a word cache with the other servers on this host\n"
+            "      through the named shared memory segment\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    const char *path = SERVER_SOCKET_PATH;
+    const char *cacheName = NULL;
+    int numWorkers = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:b:w:j:c:h")) != -1) {
+        switch (opt) {
+            case 's':
+                path = optarg;
+                break;
+            case 't':
+                numWorkers = atoi(optarg);
+                break;
+            case 'b':
+                batchSize = (size_t) atol(optarg);
+                break;
+            case 'w':
+                batchWindowUs = atol(optarg);
+                break;
+            case 'j':
+                statsEvery = (size_t) atol(optarg);
+                break;
+            case 'c':
+                cacheName = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (numWorkers < 1 || batchSize < 1 || batchWindowUs < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CalibrateRdtscTicks();
+    enum CODEC_STATUS status = InitializeGPT2Codec();
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "InitializeGPT2Codec failed: %d\n", status);
+        return 1;
+    }
+    if (cacheName != NULL &&
+        (status = AttachWordCache(cacheName, WORD_CACHE_BYTES)) !=
+        CODEC_SUCCESS) {
+        fprintf(stderr, "AttachWordCache failed: %d\n", status);
+        return 1;
+    }
+    int listenFd = listenOn(path);
+    if (listenFd < 0 || pipe(signalPipe) < 0 || pipe(wakePipe) < 0 ||
+        fcntl(wakePipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(wakePipe[1], F_SETFL, O_NONBLOCK) < 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    worker_t *workers = calloc(numWorkers, sizeof(worker_t));
+    for (int idx = 0; idx < numWorkers; idx++) {
+        pthread_create(&workers[idx].thread, NULL, workerMain, &workers[idx]);
+    }
+    fprintf(stderr, "listening on %s, %d workers, batches of up to %zu\n",
+            path, numWorkers, batchSize);
+
+    /* Slots 0 to 2 are the listening socket and the two pipes. */
+    size_t numFds = 3;
+    size_t capFds = 64;
+    struct pollfd *fds = malloc(capFds * sizeof(struct pollfd));
+    connection_t **conns = malloc(capFds * sizeof(connection_t *));
+    fds[0] = (struct pollfd) {.fd = listenFd, .events = POLLIN};
+    fds[1] = (struct pollfd) {.fd = signalPipe[0], .events = POLLIN};
+    fds[2] = (struct pollfd) {.fd = wakePipe[0], .events = POLLIN};
+    bool running = true;
+    while (running) {
+        for (size_t idx = 3; idx < numFds; idx++) {
+            short events = pollEvents(conns[idx]);
+            if (events < 0) {
+                dropConnection(fds, conns, &numFds, idx--);
+            } else {
+                fds[idx].events = events;
+            }
+        }
+        if (poll(fds, numFds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            running = false;
+        }
+        if (fds[2].revents != 0) {
+            char drained[64];
+            while (read(wakePipe[0], drained, sizeof(drained)) > 0) {
+            }
+        }
+        request_t *requests = NULL;
+        for (size_t idx = 3; idx < numFds; idx++) {
+            short revents = fds[idx].revents;
+            /* Hang ups and errors show up as a failed read. */
+            if (((revents & POLLOUT) && !flushOutput(conns[idx])) ||
+                ((revents & ~POLLOUT) &&
+                 !readFrames(conns[idx], &requests))) {
+                dropConnection(fds, conns, &numFds, idx--);
+            }
+        }
+        enqueue(requests);
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+            if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+                close(fd);
+                continue;
+            }
+            connection_t *conn = calloc(1, sizeof(connection_t));
+            if (numFds == capFds) {
+                capFds *= 2;
+                fds = realloc(fds, capFds * sizeof(struct pollfd));
+                conns = realloc(conns, capFds * sizeof(connection_t *));
+            }
+            conn->fd = fd;
+            atomic_init(&conn->refs, 1);
+            pthread_mutex_init(&conn->writeLock, NULL);
+            fds[numFds] = (struct pollfd) {.fd = fd, .events = POLLIN};
+            conns[numFds++] = conn;
+        }
+    }
+
+    /* Queued requests are still answered before the workers exit. */
+    pthread_mutex_lock(&queue.lock);
+    queue.stopping = true;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+    for (int idx = 0; idx < numWorkers; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        free(workers[idx].tokens);
+        free(workers[idx].text);
+    }
+    /* Responses the clients have not taken yet get a second to go out. */
+    struct timeval linger = {1, 0};
+    for (size_t idx = 3; idx < numFds; idx++) {
+        int fd = conns[idx]->fd;
+        if (fcntl(fd, F_SETFL, 0) == 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &linger,
+                       sizeof(linger)) == 0) {
+            flushOutput(conns[idx]);
+        }
+        releaseConnection(conns[idx]);
+    }
+    close(listenFd);
+    unlink(path);
+
+    fprintf(stderr, "%llu requests in %llu batches\n",
+            (unsigned long long) stats.requests,
+            (unsigned long long) stats.batches);
+    for (int op = OP_ENCODE; op <= OP_STATS; op++) {
+        if (stats.latencies[op].total != 0) {
+            HistogramPrint(stderr, opNames[op], &stats.latencies[op]);
+        }
+    }
+    if (statsEvery != 0) {
+        char *report = StatsReport(&stats.workload);
+        if (report != NULL) {
+            fprintf(stderr, "%s\n", report);
+            free(report);
+        }
+    }
+    free(workers);
+    free(fds);
+    free(conns);
+    ShutdownGPT2Codec();
+    return 0;
+}
@@ -0,0 +1,41 @@
+//
+// Wire protocol of the tokenization server.
+//
+// Every message is a frameHeader_t followed by `length` payload bytes, all
+// in host byte order since both ends share a machine.  Requests on one
+// connection may be pipelined; responses carry the request id back and can
+// arrive out of order.
+//
+//   OP_ENCODE  text -> uint16_t token ids
+//   OP_DECODE  uint16_t token ids -> text
+//   OP_COUNT   text -> uint32_t token count
+//   OP_STATS   nothing -> the server's latency histograms as text
+//
+
+#ifndef GPT2_CODEC_SERVER_H
+#define GPT2_CODEC_SERVER_H
+
+#include <stdint.h>
+
+#define SERVER_SOCKET_PATH "/tmp/gpt2_codec.sock"
+#define SERVER_MAX_PAYLOAD (64 << 20)
+
+/* Request flags. */
+#define FRAME_ALLOW_SPECIAL 1    /* registered special tokens become ids */
+
+enum SERVER_OP {
+    OP_ENCODE = 1,
+    OP_DECODE,
+    OP_COUNT,
+    OP_STATS
+};
+
+typedef struct {
+    uint32_t length;             /* payload bytes that follow */
+    uint32_t id;                 /* chosen by the client, echoed back */
+    uint8_t op;                  /* enum SERVER_OP */
+    uint8_t status;              /* enum CODEC_STATUS, in responses */
+    uint16_t flags;
+} frameHeader_t;
+
+#endif //GPT2_CODEC_SERVER_H
@@ -0,0 +1,94 @@
+//
+// Workload statistics gathered while encoding, exported as JSON.
+//
+
+#include "stats.h"
+#include <stddef.h>
+
+static void mergeHistogram(uint64_t *into, const uint64_t *from) {
+    for (size_t idx = 0; idx <= STATS_MAX_BUCKET; idx++) {
+        into[idx] += from[idx];
+    }
+}
+
+void StatsMerge(codecStats_t *into, const codecStats_t *from) {
+    into->calls += from->calls;
+    into->bytes += from->bytes;
+    into->tokens += from->tokens;
+    into->words += from->words;
+    into->wholeWords += from->wholeWords;
+    into->asciiRunes += from->asciiRunes;
+    into->otherRunes += from->otherRunes;
+    into->cacheLookups += from->cacheLookups;
+    into->cacheHits += from->cacheHits;
+    mergeHistogram(into->wordBytes, from->wordBytes);
+    mergeHistogram(into->wordMerges, from->wordMerges);
+    mergeHistogram(into->probes, from->probes);
+}
+
+static double ratio(uint64_t numerator, uint64_t denominator) {
+    return denominator != 0 ? (double) numerator / (double) denominator : 0;
+}
+
+/*
+ * Trailing empty buckets are left out, so the array is as long as the
+ * largest value seen.  Each histogram also gets its mean.
+ */
+static void addHistogram(cJSON *parent, const char *name,
+                         const uint64_t *histogram) {
+    size_t length = STATS_MAX_BUCKET + 1;
+    while (length > 0 && histogram[length - 1] == 0) {
+        length--;
+    }
+    cJSON *object = cJSON_AddObjectToObject(parent, name);
+    cJSON *counts = cJSON_AddArrayToObject(object, "counts");
+    uint64_t total = 0, sum = 0;
+    for (size_t idx = 0; idx < length; idx++) {
+        cJSON_AddItemToArray(counts,
+                             cJSON_CreateNumber((double) histogram[idx]));
+        total += histogram[idx];
+        sum += histogram[idx] * idx;
+    }
+    cJSON_AddNumberToObject(object, "mean", ratio(sum, total));
+    cJSON_AddNumberToObject(object, "overflowFrom", STATS_MAX_BUCKET);
+}
+
+cJSON *StatsToJson(const codecStats_t *stats) {
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        return NULL;
+    }
+    cJSON_AddNumberToObject(json, "calls", (double) stats->calls);
+    cJSON_AddNumberToObject(json, "bytes", (double) stats->bytes);
+    cJSON_AddNumberToObject(json, "tokens", (double) stats->tokens);
+    cJSON_AddNumberToObject(json, "preTokens", (double) stats->words);
+    cJSON_AddNumberToObject(json, "wholeWordShare",
+                            ratio(stats->wholeWords, stats->words));
+    cJSON_AddNumberToObject(json, "bytesPerToken",
+                            ratio(stats->bytes, stats->tokens));
+    cJSON *runes = cJSON_AddObjectToObject(json, "runes");
+    cJSON_AddNumberToObject(runes, "ascii", (double) stats->asciiRunes);
+    cJSON_AddNumberToObject(runes, "nonAscii", (double) stats->otherRunes);
+    cJSON_AddNumberToObject(runes, "asciiShare",
+                            ratio(stats->asciiRunes,
+                                  stats->asciiRunes + stats->otherRunes));
+    cJSON *cache = cJSON_AddObjectToObject(json, "wordCache");
+    cJSON_AddNumberToObject(cache, "lookups", (double) stats->cacheLookups);
+    cJSON_AddNumberToObject(cache, "hits", (double) stats->cacheHits);
+    cJSON_AddNumberToObject(cache, "hitRate",
+                            ratio(stats->cacheHits, stats->cacheLookups));
+    addHistogram(json, "preTokenBytes", stats->wordBytes);
+    addHistogram(json, "mergesPerPreToken", stats->wordMerges);
+    addHistogram(json, "probeLength", stats->probes);
+    return json;
+}
+
+char *StatsReport(const codecStats_t *stats) {
+    cJSON *json = StatsToJson(stats);
+    if (json == NULL) {
+        return NULL;
+    }
+    char *report = cJSON_Print(json);
+    cJSON_Delete(json);
+    return report;
+}
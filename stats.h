@@ -0,0 +1,48 @@
+//
+// Workload statistics gathered while encoding, to explain why throughput
+// differs between corpora.
+//
+
+#ifndef GPT2_CODEC_STATS_H
+#define GPT2_CODEC_STATS_H
+
+#include <cJSON/cJSON.h>
+#include <stdint.h>
+
+/* Histograms are indexed by value, the last bucket holds everything from
+   STATS_MAX_BUCKET up. */
+#define STATS_MAX_BUCKET 32
+
+/*
+ * Plain counters, bumped by the encoder when a codecStats_t is passed in
+ * encodeOptions_t.  Nothing is shared or locked, so every thread keeps its
+ * own and merges them; turning collection on for a sample of the calls
+ * keeps the overhead to that sample.
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t tokens;
+    uint64_t words;              /* pre-tokens */
+    uint64_t wholeWords;         /* pre-tokens that are a token as is */
+    uint64_t asciiRunes;
+    uint64_t otherRunes;
+    uint64_t cacheLookups;       /* word cache, when one is in use */
+    uint64_t cacheHits;
+    uint64_t wordBytes[STATS_MAX_BUCKET + 1];   /* pre-token length */
+    uint64_t wordMerges[STATS_MAX_BUCKET + 1];  /* BPE merges per pre-token */
+    uint64_t probes[STATS_MAX_BUCKET + 1];      /* slots per rank lookup */
+} codecStats_t;
+
+static inline void statsCount(uint64_t *histogram, uint64_t value) {
+    histogram[value < STATS_MAX_BUCKET ? value : STATS_MAX_BUCKET]++;
+}
+
+void StatsMerge(codecStats_t *into, const codecStats_t *from);
+
+cJSON *StatsToJson(const codecStats_t *stats);
+
+/* The report as a JSON string, to be freed by the caller. */
+char *StatsReport(const codecStats_t *stats);
+
+#endif //GPT2_CODEC_STATS_H
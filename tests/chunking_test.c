@@ -0,0 +1,198 @@
+//
+// Runs `gpt2codec encode` over inputs that offer few or no easy cut points
+// and checks that every chunk size gives the same tokens as one chunk:
+//
+//   chunking_test path/to/gpt2codec
+//
+// Run from the source directory, where the vocabulary and
+// frankenstein.txt live.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const size_t chunkSizes[] = {64, 1000, 4096, 65536};
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} buffer_t;
+
+static void append(buffer_t *buffer, const void *bytes, size_t numBytes) {
+    if (buffer->length + numBytes > buffer->capacity) {
+        buffer->capacity = (buffer->length + numBytes) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (buffer->data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(buffer->data + buffer->length, bytes, numBytes);
+    buffer->length += numBytes;
+}
+
+static uint32_t nextRandom(uint32_t *seed) {
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+/* The corpus with every space and newline taken out. */
+static bool spacelessText(buffer_t *input) {
+    FILE *f = fopen("frankenstein.txt", "rb");
+    if (f == NULL) {
+        perror("frankenstein.txt");
+        return false;
+    }
+    int ch;
+    while ((ch = fgetc(f)) != EOF) {
+        if (ch != ' ' && ch != '\n' && ch != '\r') {
+            char byte = (char) ch;
+            append(input, &byte, 1);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+/* Runs of CJK ideographs up to 6 KB long, each one pre-token. */
+static bool cjkText(buffer_t *input) {
+    uint32_t seed = 1;
+    while (input->length < 400000) {
+        size_t runLen = 1 + nextRandom(&seed) % 2000;
+        for (size_t idx = 0; idx < runLen; idx++) {
+            uint32_t rune = 0x4E00 + nextRandom(&seed) % 0x5200;
+            char bytes[3] = {(char) (0xE0 | rune >> 12),
+                             (char) (0x80 | (rune >> 6 & 0x3F)),
+                             (char) (0x80 | (rune & 0x3F))};
+            append(input, bytes, 3);
+        }
+        if (nextRandom(&seed) % 4 != 0) {
+            append(input, "\xE3\x80\x82", 3);
+        } else {
+            append(input, "\n", 1);
+        }
+    }
+    return true;
+}
+
+/*
+ * Words between runs of NBSP, NEL, tabs and other whitespace.  The last
+ * rune of each run goes with the word after it, and no run is a lone
+ * space or newline, which could be cut at without splitting.
+ */
+static bool whitespaceText(buffer_t *input) {
+    static const char *spaces[] = {" ", "\n", "\t", "\xC2\xA0", "\xC2\x85",
+                                   "\xE3\x80\x80"};
+    uint32_t seed = 3;
+    while (input->length < 400000) {
+        size_t wordLen = 1 + nextRandom(&seed) % 8;
+        for (size_t idx = 0; idx < wordLen; idx++) {
+            char letter = (char) ('a' + nextRandom(&seed) % 26);
+            append(input, &letter, 1);
+        }
+        size_t runLen = nextRandom(&seed) % 4;
+        if (runLen < 2) {
+            const char *space = spaces[2 + nextRandom(&seed) % 3];
+            append(input, space, strlen(space));
+        }
+        for (size_t idx = 0; idx < runLen; idx++) {
+            const char *space = spaces[nextRandom(&seed) % 6];
+            append(input, space, strlen(space));
+        }
+    }
+    return true;
+}
+
+static bool randomBytes(buffer_t *input) {
+    uint32_t seed = 2;
+    while (input->length < 400000) {
+        char byte = (char) nextRandom(&seed);
+        append(input, &byte, 1);
+    }
+    return true;
+}
+
+/* The tokens of `path` encoded in chunks of `chunkSize`, 0 for the
+   default. */
+static bool encodeFile(const char *codec, const char *path, size_t chunkSize,
+                       buffer_t *output) {
+    char command[4096];
+    char chunkArg[32] = "";
+    if (chunkSize != 0) {
+        snprintf(chunkArg, sizeof(chunkArg), "-b %zu ", chunkSize);
+    }
+    snprintf(command, sizeof(command), "'%s' encode %s'%s' 2>/dev/null",
+             codec, chunkArg, path);
+    FILE *pipe = popen(command, "r");
+    if (pipe == NULL) {
+        perror(command);
+        return false;
+    }
+    char bytes[65536];
+    size_t got;
+    while ((got = fread(bytes, 1, sizeof(bytes), pipe)) != 0) {
+        append(output, bytes, got);
+    }
+    if (pclose(pipe) != 0) {
+        fprintf(stderr, "failed: %s\n", command);
+        return false;
+    }
+    return true;
+}
+
+static bool checkInput(const char *codec, const char *name,
+                       bool (*generate)(buffer_t *)) {
+    buffer_t input = {0};
+    if (!generate(&input)) {
+        return false;
+    }
+    char path[] = "/tmp/chunking_test.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, input.data, input.length) !=
+                  (ssize_t) input.length) {
+        perror(path);
+        return false;
+    }
+    close(fd);
+    buffer_t whole = {0};
+    /* The default chunk is larger than the input. */
+    bool passed = encodeFile(codec, path, 0, &whole);
+    for (size_t idx = 0;
+         passed && idx < sizeof(chunkSizes) / sizeof(chunkSizes[0]); idx++) {
+        buffer_t chunked = {0};
+        passed = encodeFile(codec, path, chunkSizes[idx], &chunked);
+        if (passed && (chunked.length != whole.length ||
+                       memcmp(chunked.data, whole.data, whole.length) != 0)) {
+            fprintf(stderr, "%s: chunks of %zu give %zu tokens, not %zu\n",
+                    name, chunkSizes[idx], chunked.length / 2,
+                    whole.length / 2);
+            passed = false;
+        }
+        free(chunked.data);
+    }
+    if (passed) {
+        printf("%s: %zu bytes, %zu tokens in any chunks\n", name,
+               input.length, whole.length / 2);
+    }
+    unlink(path);
+    free(input.data);
+    free(whole.data);
+    return passed;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s path/to/gpt2codec\n", argv[0]);
+        return 2;
+    }
+    bool passed = checkInput(argv[1], "spaceless text", spacelessText);
+    passed = checkInput(argv[1], "CJK", cjkText) && passed;
+    passed = checkInput(argv[1], "whitespace runs", whitespaceText) && passed;
+    passed = checkInput(argv[1], "random bytes", randomBytes) && passed;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+//
+// Makes random edits to a document and checks, after every one, that its
+// tokens and offsets match a full encode of the edited text:
+//
+//   document_test
+//
+// Run from the source directory, where the vocabulary and
+// frankenstein.txt live.
+//
+
+#include "document.h"
+#include <string.h>
+
+#define DOCUMENT_BYTES 16384
+#define NUM_EDITS 1500
+
+/* Inserted around edits, to make and break contractions, whitespace runs,
+   numbers and special tokens. */
+static const char *snippets[] = {
+        " the", "\n", "\n\n", "'s", "'re", "don't", "  ", "x", "\xC3\xA9",
+        "\xE6\x97\xA5\xE6\x9C\xAC", "<|endoftext|>", "123", "!!", "\t", " ",
+        "a", "e", "\xE2\x80\x99", "<|", "endoftext|>", "\xC2\xA0", "\xC2\x85"};
+
+typedef struct {
+    uint16_t *tokens;
+    size_t *offsets;
+    size_t numTokens;
+    size_t capacity;
+} encoding_t;
+
+static uint32_t nextRandom(uint32_t *seed) {
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+static void collectFull(const uint16_t *tokens, size_t numTokens,
+                        size_t offset, size_t length, void *ctx) {
+    encoding_t *full = (encoding_t *) ctx;
+    (void) length;
+    if (full->numTokens + numTokens > full->capacity) {
+        full->capacity = (full->numTokens + numTokens) * 2;
+        full->tokens = realloc(full->tokens,
+                               full->capacity * sizeof(uint16_t));
+        full->offsets = realloc(full->offsets,
+                                full->capacity * sizeof(size_t));
+        if (full->tokens == NULL || full->offsets == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    for (size_t idx = 0; idx < numTokens; idx++) {
+        full->tokens[full->numTokens] = tokens[idx];
+        full->offsets[full->numTokens++] = offset;
+    }
+}
+
+/* Moves `pos` forward off UTF-8 continuation bytes. */
+static size_t runeStart(const char *text, size_t length, size_t pos) {
+    while (pos < length && ((unsigned char) text[pos] & 0xC0) == 0x80) {
+        pos++;
+    }
+    return pos;
+}
+
+static bool checkEdits(const char *name, const char *source,
+                       size_t sourceLen, const encodeOptions_t *options) {
+    size_t capacity = sourceLen * 2 + NUM_EDITS * 128;
+    char *text = malloc(capacity);
+    char *edited = malloc(capacity);
+    if (text == NULL || edited == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(text, source, sourceLen);
+    size_t length = sourceLen;
+    tokenDocument_t doc;
+    DocumentInit(&doc);
+    enum CODEC_STATUS status = DocumentEncode(&doc, text, length, options);
+    encoding_t full = {0};
+    uint32_t seed = 1;
+    size_t reencoded = 0;
+    bool passed = status == CODEC_SUCCESS;
+    if (!passed) {
+        fprintf(stderr, "%s: DocumentEncode failed: %d\n", name, status);
+    }
+    for (size_t edit = 0; edit < NUM_EDITS && passed; edit++) {
+        size_t offset = runeStart(text, length,
+                                  nextRandom(&seed) % (length + 1));
+        size_t removed = nextRandom(&seed) % 3 == 0 ?
+                         nextRandom(&seed) % 20 : 0;
+        if (offset + removed > length) {
+            removed = length - offset;
+        }
+        removed = runeStart(text, length, offset + removed) - offset;
+
+        char insert[256];
+        size_t inserted = 0;
+        for (uint32_t count = nextRandom(&seed) % 4; count > 0; count--) {
+            const char *snippet = snippets[nextRandom(&seed) %
+                                           (sizeof(snippets) /
+                                            sizeof(snippets[0]))];
+            memcpy(insert + inserted, snippet, strlen(snippet));
+            inserted += strlen(snippet);
+        }
+        if (nextRandom(&seed) % 5 == 0) {
+            size_t from = runeStart(source, sourceLen,
+                                    nextRandom(&seed) % (sourceLen - 64));
+            size_t end = runeStart(source, sourceLen,
+                                   from + nextRandom(&seed) % 20);
+            memcpy(insert + inserted, source + from, end - from);
+            inserted += end - from;
+        }
+
+        memcpy(edited, text, offset);
+        memcpy(edited + offset, insert, inserted);
+        memcpy(edited + offset + inserted, text + offset + removed,
+               length - offset - removed);
+        length = length - removed + inserted;
+        memcpy(text, edited, length);
+
+        status = DocumentEdit(&doc, text, length, offset, removed, inserted);
+        if (status != CODEC_SUCCESS) {
+            fprintf(stderr, "%s: edit %zu failed: %d\n", name, edit, status);
+            passed = false;
+            break;
+        }
+        reencoded += doc.numReencoded;
+        full.numTokens = 0;
+        status = EncodeText(text, length, options, collectFull, &full);
+        if (status != CODEC_SUCCESS) {
+            fprintf(stderr, "%s: EncodeText failed: %d\n", name, status);
+            passed = false;
+            break;
+        }
+        size_t numTokens = DocumentNumTokens(&doc);
+        for (size_t idx = 0; idx < numTokens && idx < full.numTokens;
+             idx++) {
+            size_t tokenOffset;
+            uint16_t token = DocumentToken(&doc, idx, &tokenOffset);
+            if (token != full.tokens[idx] ||
+                tokenOffset != full.offsets[idx]) {
+                fprintf(stderr, "%s: after edit %zu, %zu bytes at %zu "
+                                "replaced by %zu, token %zu is %u at %zu, "
+                                "not %u at %zu\n", name, edit, removed,
+                        offset, inserted, idx, token, tokenOffset,
+                        full.tokens[idx], full.offsets[idx]);
+                passed = false;
+                break;
+            }
+        }
+        if (passed && numTokens != full.numTokens) {
+            fprintf(stderr, "%s: after edit %zu, %zu tokens, not %zu\n",
+                    name, edit, numTokens, full.numTokens);
+            passed = false;
+        }
+    }
+    if (passed) {
+        printf("%s: %d edits, %.1f bytes re-encoded per edit\n", name,
+               NUM_EDITS, (double) reencoded / NUM_EDITS);
+    }
+    DocumentFree(&doc);
+    free(full.tokens);
+    free(full.offsets);
+    free(text);
+    free(edited);
+    return passed;
+}
+
+int main(void) {
+    FILE *f = fopen("frankenstein.txt", "rb");
+    if (f == NULL) {
+        perror("frankenstein.txt");
+        return 2;
+    }
+    char *source = malloc(DOCUMENT_BYTES);
+    size_t sourceLen = source == NULL ? 0 :
+                       fread(source, 1, DOCUMENT_BYTES, f);
+    fclose(f);
+    if (sourceLen < 1024) {
+        fprintf(stderr, "could not read frankenstein.txt\n");
+        return 2;
+    }
+    /* Do not end the document part way into a rune. */
+    while (((unsigned char) source[sourceLen - 1] & 0xC0) == 0x80 ||
+           (unsigned char) source[sourceLen - 1] >= 0xC0) {
+        sourceLen--;
+    }
+    encodeOptions_t options = {0};
+    bool passed = checkEdits("text", source, sourceLen, &options);
+    options.allowSpecial = SPECIAL_ALL;
+    passed = checkEdits("special tokens", source, sourceLen, &options) &&
+             passed;
+    free(source);
+    ShutdownGPT2Codec();
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,544 @@
+//
+// Packs documents in every mode and at both id widths, and checks that
+// each document comes out exactly once, whole and where docStarts says it
+// starts, with no more padding than the mode allows:
+//
+//   packer_test
+//
+// Run from the source directory, where the vocabulary and
+// frankenstein.txt live.
+//
+
+#include "packer.h"
+#include <string.h>
+
+#define NUM_DOCUMENTS 3000
+/* Synthetic documents start with their number plus one, below this, and
+   carry random tokens from here up. */
+#define FIRST_BODY_TOKEN 4096
+#define EOT_TOKEN 50256
+
+static const size_t blockSizes[] = {64, 1024};
+static const size_t batchRows[] = {1, 3, 64};
+static const enum PACK_MODE modes[] = {PACK_CONCAT, PACK_GREEDY,
+                                       PACK_BEST_FIT};
+static const char *modeNames[] = {"concat", "greedy", "best fit"};
+
+typedef struct {
+    uint32_t *tokens;            /* including the end of text token */
+    size_t numTokens;
+} document_t;
+
+typedef struct {
+    size_t row;
+    size_t col;
+} start_t;
+
+typedef struct {
+    size_t blockSize;
+    size_t maxDocs;              /* row width of docStarts */
+    uint32_t *tokens;            /* every row handed out, in order */
+    size_t *rowBatch;            /* the batch each row came in */
+    size_t numRows;
+    size_t rowCap;
+    size_t batchCap;
+    start_t *starts;
+    size_t numStarts;
+    size_t startCap;
+    size_t numBatches;
+} output_t;
+
+static void *grow(void *data, size_t *capacity, size_t needed, size_t size) {
+    if (needed > *capacity) {
+        *capacity = needed * 2;
+        data = realloc(data, *capacity * size);
+        if (data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    return data;
+}
+
+static uint32_t nextRandom(uint32_t *seed) {
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+static void collectStarts(output_t *out, const uint32_t *docStarts,
+                          const uint32_t *docCounts, size_t numSequences) {
+    size_t firstRow = out->numRows - numSequences;
+    for (size_t row = 0; row < numSequences; row++) {
+        out->rowBatch[firstRow + row] = out->numBatches;
+        for (size_t idx = 0; idx < docCounts[row]; idx++) {
+            out->starts = grow(out->starts, &out->startCap,
+                               out->numStarts + 1, sizeof(start_t));
+            out->starts[out->numStarts].row = firstRow + row;
+            out->starts[out->numStarts++].col =
+                    docStarts[row * out->maxDocs + idx];
+        }
+    }
+    out->numBatches++;
+}
+
+static void collectRows(output_t *out, size_t numSequences) {
+    out->tokens = grow(out->tokens, &out->rowCap,
+                       out->numRows + numSequences,
+                       out->blockSize * sizeof(uint32_t));
+    out->rowBatch = grow(out->rowBatch, &out->batchCap,
+                         out->numRows + numSequences, sizeof(size_t));
+    out->numRows += numSequences;
+}
+
+static void collect16(const uint16_t *tokens, const uint32_t *docStarts,
+                      const uint32_t *docCounts, size_t numSequences,
+                      void *ctx) {
+    output_t *out = (output_t *) ctx;
+    collectRows(out, numSequences);
+    uint32_t *dest = out->tokens +
+                     (out->numRows - numSequences) * out->blockSize;
+    for (size_t idx = 0; idx < numSequences * out->blockSize; idx++) {
+        dest[idx] = tokens[idx];
+    }
+    collectStarts(out, docStarts, docCounts, numSequences);
+}
+
+static void collect32(const uint32_t *tokens, const uint32_t *docStarts,
+                      const uint32_t *docCounts, size_t numSequences,
+                      void *ctx) {
+    output_t *out = (output_t *) ctx;
+    collectRows(out, numSequences);
+    memcpy(out->tokens + (out->numRows - numSequences) * out->blockSize,
+           tokens, numSequences * out->blockSize * sizeof(uint32_t));
+    collectStarts(out, docStarts, docCounts, numSequences);
+}
+
+/*
+ * Follows every recorded start through the rows, and then checks the
+ * padding left over: concatenation pads only the last row, greedy packing
+ * only a row the next document did not fit, and best fit leaves no row
+ * with room for a document it put in a later row of the same batch.  Both
+ * of the latter keep a document that fits in a row within one.
+ */
+static bool checkOutput(const char *name, const output_t *out,
+                        const document_t *docs, size_t numDocs,
+                        enum PACK_MODE mode, bool numbered, bool padRules,
+                        uint32_t padToken, size_t numPadding) {
+    size_t blockSize = out->blockSize;
+    size_t total = out->numRows * blockSize;
+    bool *claimed = calloc(total, sizeof(bool));
+    bool *seen = calloc(numDocs, sizeof(bool));
+    size_t *lengths = calloc(out->numStarts, sizeof(size_t));
+    size_t *rowPadding = calloc(out->numRows, sizeof(size_t));
+    if (claimed == NULL || seen == NULL || lengths == NULL ||
+        rowPadding == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    bool passed = true;
+    for (size_t idx = 0; idx < out->numStarts && passed; idx++) {
+        const start_t *start = &out->starts[idx];
+        size_t pos = start->row * blockSize + start->col;
+        size_t doc = numbered ? out->tokens[pos] - 1 : idx;
+        if (start->col >= blockSize || doc >= numDocs || seen[doc] ||
+            pos + docs[doc].numTokens > total) {
+            fprintf(stderr, "%s: no document starts at row %zu, col %zu\n",
+                    name, start->row, start->col);
+            passed = false;
+            break;
+        }
+        for (size_t tok = 0; tok < docs[doc].numTokens; tok++) {
+            if (claimed[pos + tok] ||
+                out->tokens[pos + tok] != docs[doc].tokens[tok]) {
+                fprintf(stderr, "%s: document %zu differs at token %zu\n",
+                        name, doc, tok);
+                passed = false;
+                break;
+            }
+            claimed[pos + tok] = true;
+        }
+        seen[doc] = true;
+        lengths[idx] = docs[doc].numTokens;
+    }
+    for (size_t doc = 0; doc < numDocs && passed; doc++) {
+        if (!seen[doc]) {
+            fprintf(stderr, "%s: document %zu is missing\n", name, doc);
+            passed = false;
+        }
+    }
+    size_t padding = 0;
+    for (size_t pos = 0; pos < total && passed; pos++) {
+        if (!claimed[pos]) {
+            if (out->tokens[pos] != padToken) {
+                fprintf(stderr, "%s: stray token at row %zu, col %zu\n",
+                        name, pos / blockSize, pos % blockSize);
+                passed = false;
+            }
+            rowPadding[pos / blockSize]++;
+            padding++;
+        }
+    }
+    if (passed && padding != numPadding) {
+        fprintf(stderr, "%s: %zu padding tokens, the packer counted %zu\n",
+                name, padding, numPadding);
+        passed = false;
+    }
+
+    for (size_t row = 0; row + 1 < out->numRows && padRules && passed;
+         row++) {
+        if (mode == PACK_CONCAT && rowPadding[row] != 0) {
+            fprintf(stderr, "%s: row %zu is padded\n", name, row);
+            passed = false;
+        }
+    }
+    for (size_t idx = 0; idx < out->numStarts && padRules && passed; idx++) {
+        const start_t *start = &out->starts[idx];
+        if (mode != PACK_CONCAT && lengths[idx] <= blockSize &&
+            start->col + lengths[idx] > blockSize) {
+            fprintf(stderr, "%s: the document at row %zu, col %zu runs "
+                            "into the next row\n", name, start->row,
+                    start->col);
+            passed = false;
+        }
+        if (start->col != 0) {
+            continue;
+        }
+        size_t row = start->row;
+        if (mode == PACK_GREEDY && row > 0 &&
+            rowPadding[row - 1] >= lengths[idx]) {
+            fprintf(stderr, "%s: row %zu has room for the document that "
+                            "follows it\n", name, row - 1);
+            passed = false;
+        }
+        while (mode == PACK_BEST_FIT && row-- > 0 &&
+               out->rowBatch[row] == out->rowBatch[start->row]) {
+            if (rowPadding[row] >= lengths[idx]) {
+                fprintf(stderr, "%s: row %zu has room for the document "
+                                "put in row %zu\n", name, row, start->row);
+                passed = false;
+                break;
+            }
+        }
+    }
+    if (passed) {
+        printf("%s: %zu documents in %zu rows, %zu padding tokens\n", name,
+               numDocs, out->numRows, padding);
+    }
+    free(claimed);
+    free(seen);
+    free(lengths);
+    free(rowPadding);
+    return passed;
+}
+
+static void freeOutput(output_t *out) {
+    free(out->tokens);
+    free(out->rowBatch);
+    free(out->starts);
+}
+
+/* Mostly short documents, with some spanning several rows. */
+static document_t *numberedDocuments(size_t blockSize, uint32_t firstBody,
+                                     bool appendEot) {
+    document_t *docs = calloc(NUM_DOCUMENTS, sizeof(document_t));
+    if (docs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    uint32_t seed = (uint32_t) blockSize;
+    for (size_t doc = 0; doc < NUM_DOCUMENTS; doc++) {
+        size_t length = nextRandom(&seed) % 8 == 0 ?
+                        1 + nextRandom(&seed) % (3 * blockSize) :
+                        1 + nextRandom(&seed) % (blockSize / 2);
+        docs[doc].tokens = malloc((length + 1) * sizeof(uint32_t));
+        if (docs[doc].tokens == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        docs[doc].tokens[0] = (uint32_t) doc + 1;
+        for (size_t tok = 1; tok < length; tok++) {
+            docs[doc].tokens[tok] = firstBody + nextRandom(&seed) % 50000;
+        }
+        if (appendEot) {
+            docs[doc].tokens[length++] = EOT_TOKEN;
+        }
+        docs[doc].numTokens = length;
+    }
+    return docs;
+}
+
+static void freeDocuments(document_t *docs, size_t numDocs) {
+    for (size_t doc = 0; doc < numDocs; doc++) {
+        free(docs[doc].tokens);
+    }
+    free(docs);
+}
+
+/* Feeds `docs` to a packer of each width, without their end of text
+   tokens when `appendEot` has the packer add them, or as text. */
+static bool pack16(const char *name, const packerConfig_t *base,
+                   const document_t *docs, size_t numDocs,
+                   const char **texts, const size_t *textLengths,
+                   bool numbered) {
+    output_t out = {.blockSize = base->blockSize,
+                    .maxDocs = base->maxDocsPerSequence};
+    packerConfig_t config = *base;
+    config.tokens = malloc(config.numSequences * config.blockSize *
+                           sizeof(uint16_t));
+    config.docStarts = malloc(config.numSequences *
+                              config.maxDocsPerSequence * sizeof(uint32_t));
+    config.docCounts = malloc(config.numSequences * sizeof(uint32_t));
+    config.onBatch = collect16;
+    config.ctx = &out;
+    uint16_t *tokens = malloc(4 * config.blockSize * sizeof(uint16_t));
+    packer_t packer;
+    enum CODEC_STATUS status = PackerInit(&packer, &config);
+    for (size_t doc = 0; doc < numDocs && status == CODEC_SUCCESS; doc++) {
+        if (texts != NULL) {
+            status = PackDocument(&packer, texts[doc], textLengths[doc],
+                                  NULL);
+            continue;
+        }
+        size_t numTokens = docs[doc].numTokens - config.appendEot;
+        for (size_t tok = 0; tok < numTokens; tok++) {
+            tokens[tok] = (uint16_t) docs[doc].tokens[tok];
+        }
+        status = PackDocumentTokens(&packer, tokens, numTokens);
+    }
+    PackerFinish(&packer);
+    bool passed = status == CODEC_SUCCESS &&
+                  checkOutput(name, &out, docs, numDocs, config.mode,
+                              numbered, true, config.padToken,
+                              packer.numPadding);
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "%s: packing failed: %d\n", name, status);
+    }
+    PackerFree(&packer);
+    free(config.tokens);
+    free(config.docStarts);
+    free(config.docCounts);
+    free(tokens);
+    freeOutput(&out);
+    return passed;
+}
+
+static bool pack32(const char *name, const packerConfig32_t *base,
+                   const document_t *docs, size_t numDocs,
+                   const char **texts, const size_t *textLengths,
+                   bool numbered) {
+    output_t out = {.blockSize = base->blockSize,
+                    .maxDocs = base->maxDocsPerSequence};
+    packerConfig32_t config = *base;
+    config.tokens = malloc(config.numSequences * config.blockSize *
+                           sizeof(uint32_t));
+    config.docStarts = malloc(config.numSequences *
+                              config.maxDocsPerSequence * sizeof(uint32_t));
+    config.docCounts = malloc(config.numSequences * sizeof(uint32_t));
+    config.onBatch = collect32;
+    config.ctx = &out;
+    packer32_t packer;
+    enum CODEC_STATUS status = PackerInit32(&packer, &config);
+    for (size_t doc = 0; doc < numDocs && status == CODEC_SUCCESS; doc++) {
+        status = texts != NULL ?
+                 PackDocument32(&packer, texts[doc], textLengths[doc],
+                                NULL) :
+                 PackDocumentTokens32(&packer, docs[doc].tokens,
+                                      docs[doc].numTokens -
+                                      config.appendEot);
+    }
+    PackerFinish32(&packer);
+    bool passed = status == CODEC_SUCCESS &&
+                  checkOutput(name, &out, docs, numDocs, config.mode,
+                              numbered, true, config.padToken,
+                              packer.numPadding);
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "%s: packing failed: %d\n", name, status);
+    }
+    PackerFree32(&packer);
+    free(config.tokens);
+    free(config.docStarts);
+    free(config.docCounts);
+    freeOutput(&out);
+    return passed;
+}
+
+static bool checkNumbered(void) {
+    bool passed = true;
+    for (size_t size = 0; size < sizeof(blockSizes) / sizeof(blockSizes[0]);
+         size++) {
+        size_t blockSize = blockSizes[size];
+        document_t *docs16 = numberedDocuments(blockSize, FIRST_BODY_TOKEN,
+                                               size == 0);
+        /* Past what 16 bits can hold. */
+        document_t *docs32 = numberedDocuments(blockSize, 1 << 16,
+                                               size == 0);
+        for (size_t mode = 0; mode < sizeof(modes) / sizeof(modes[0]);
+             mode++) {
+            for (size_t rows = 0;
+                 rows < sizeof(batchRows) / sizeof(batchRows[0]); rows++) {
+                char name[128];
+                packerConfig_t config16 = {
+                        .mode = modes[mode], .blockSize = blockSize,
+                        .numSequences = batchRows[rows],
+                        .maxDocsPerSequence = blockSize,
+                        .appendEot = size == 0, .eotToken = EOT_TOKEN,
+                        .padToken = UINT16_MAX};
+                snprintf(name, sizeof(name), "%s, %zu rows of %zu, 16 bit",
+                         modeNames[mode], batchRows[rows], blockSize);
+                passed = pack16(name, &config16, docs16, NUM_DOCUMENTS,
+                                NULL, NULL, true) && passed;
+                packerConfig32_t config32 = {
+                        .mode = modes[mode], .blockSize = blockSize,
+                        .numSequences = batchRows[rows],
+                        .maxDocsPerSequence = blockSize,
+                        .appendEot = size == 0, .eotToken = EOT_TOKEN,
+                        .padToken = UINT32_MAX};
+                snprintf(name, sizeof(name), "%s, %zu rows of %zu, 32 bit",
+                         modeNames[mode], batchRows[rows], blockSize);
+                passed = pack32(name, &config32, docs32, NUM_DOCUMENTS,
+                                NULL, NULL, true) && passed;
+            }
+        }
+        freeDocuments(docs16, NUM_DOCUMENTS);
+        freeDocuments(docs32, NUM_DOCUMENTS);
+    }
+    return passed;
+}
+
+/* Rows that run out of room for starts close early, so the padding rules
+   do not hold; every document must still come out once. */
+static bool checkFewStarts(void) {
+    bool passed = true;
+    document_t *docs = numberedDocuments(64, FIRST_BODY_TOKEN, false);
+    for (size_t mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+        char name[128];
+        snprintf(name, sizeof(name), "%s, 2 starts a row", modeNames[mode]);
+        output_t out = {.blockSize = 64, .maxDocs = 2};
+        uint16_t tokens[3 * 64];
+        uint32_t docStarts[3 * 2];
+        uint32_t docCounts[3];
+        packerConfig_t config = {
+                .mode = modes[mode], .blockSize = 64, .numSequences = 3,
+                .maxDocsPerSequence = 2, .padToken = UINT16_MAX,
+                .tokens = tokens, .docStarts = docStarts,
+                .docCounts = docCounts, .onBatch = collect16, .ctx = &out};
+        packer_t packer;
+        enum CODEC_STATUS status = PackerInit(&packer, &config);
+        for (size_t doc = 0; doc < NUM_DOCUMENTS && status == CODEC_SUCCESS;
+             doc++) {
+            uint16_t doc16[3 * 64];
+            for (size_t tok = 0; tok < docs[doc].numTokens; tok++) {
+                doc16[tok] = (uint16_t) docs[doc].tokens[tok];
+            }
+            status = PackDocumentTokens(&packer, doc16, docs[doc].numTokens);
+        }
+        PackerFinish(&packer);
+        if (status != CODEC_SUCCESS) {
+            fprintf(stderr, "%s: packing failed: %d\n", name, status);
+            passed = false;
+        } else if (!checkOutput(name, &out, docs, NUM_DOCUMENTS, modes[mode],
+                                true, false, UINT16_MAX,
+                                packer.numPadding)) {
+            passed = false;
+        }
+        PackerFree(&packer);
+        freeOutput(&out);
+    }
+    freeDocuments(docs, NUM_DOCUMENTS);
+    return passed;
+}
+
+static void collectDocument(const uint32_t *tokens, size_t numTokens,
+                            size_t offset, size_t length, void *ctx) {
+    document_t *doc = (document_t *) ctx;
+    (void) offset;
+    (void) length;
+    doc->tokens = realloc(doc->tokens,
+                          (doc->numTokens + numTokens + 1) *
+                          sizeof(uint32_t));
+    if (doc->tokens == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(doc->tokens + doc->numTokens, tokens,
+           numTokens * sizeof(uint32_t));
+    doc->numTokens += numTokens;
+}
+
+/* The paragraphs of the corpus, packed in order through the encoder. */
+static bool checkText(void) {
+    FILE *f = fopen("frankenstein.txt", "rb");
+    if (f == NULL) {
+        perror("frankenstein.txt");
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t numBytes = (size_t) ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = malloc(numBytes + 1);
+    if (text == NULL || fread(text, 1, numBytes, f) != numBytes) {
+        fprintf(stderr, "could not read frankenstein.txt\n");
+        return false;
+    }
+    fclose(f);
+    text[numBytes] = '\0';
+
+    size_t numDocs = 0, textCap = 0, lengthCap = 0, docCap = 0;
+    const char **texts = NULL;
+    size_t *textLengths = NULL;
+    document_t *docs = NULL;
+    for (char *pos = text; pos < text + numBytes; numDocs++) {
+        char *end = strstr(pos, "\n\n");
+        end = end == NULL ? text + numBytes : end + 2;
+        texts = grow(texts, &textCap, numDocs + 1, sizeof(char *));
+        textLengths = grow(textLengths, &lengthCap, numDocs + 1,
+                           sizeof(size_t));
+        docs = grow(docs, &docCap, numDocs + 1, sizeof(document_t));
+        texts[numDocs] = pos;
+        textLengths[numDocs] = (size_t) (end - pos);
+        docs[numDocs] = (document_t) {0};
+        enum CODEC_STATUS status = EncodeText32(pos, (size_t) (end - pos),
+                                                NULL, collectDocument,
+                                                &docs[numDocs]);
+        if (status != CODEC_SUCCESS) {
+            fprintf(stderr, "EncodeText32 failed: %d\n", status);
+            return false;
+        }
+        docs[numDocs].tokens[docs[numDocs].numTokens++] = EOT_TOKEN;
+        pos = end;
+    }
+
+    bool passed = true;
+    for (size_t mode = 0; mode < 2; mode++) {
+        char name[128];
+        packerConfig_t config16 = {
+                .mode = modes[mode], .blockSize = 256, .numSequences = 3,
+                .maxDocsPerSequence = 256, .appendEot = true,
+                .eotToken = EOT_TOKEN, .padToken = UINT16_MAX};
+        snprintf(name, sizeof(name), "%s, paragraphs, 16 bit",
+                 modeNames[mode]);
+        passed = pack16(name, &config16, docs, numDocs, texts, textLengths,
+                        false) && passed;
+        packerConfig32_t config32 = {
+                .mode = modes[mode], .blockSize = 256, .numSequences = 3,
+                .maxDocsPerSequence = 256, .appendEot = true,
+                .eotToken = EOT_TOKEN, .padToken = UINT32_MAX};
+        snprintf(name, sizeof(name), "%s, paragraphs, 32 bit",
+                 modeNames[mode]);
+        passed = pack32(name, &config32, docs, numDocs, texts, textLengths,
+                        false) && passed;
+    }
+    freeDocuments(docs, numDocs);
+    free(texts);
+    free(textLengths);
+    free(text);
+    return passed;
+}
+
+int main(void) {
+    bool passed = checkNumbered();
+    passed = checkFewStarts() && passed;
+    passed = checkText() && passed;
+    ShutdownGPT2Codec();
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+//
+// Cuts inputs into windows, fed in pieces of several sizes, and checks
+// every window against the matching slice of a single full encode:
+//
+//   windower_test
+//
+// Run from the source directory, where the vocabulary and
+// frankenstein.txt live.
+//
+
+#include "windower.h"
+#include <string.h>
+
+static const size_t pushSizes[] = {1, 1000, 65536, 1 << 30};
+
+static const windowConfig_t configs[] = {
+        {.maxTokens = 1000, .stride = 1000},
+        {.maxTokens = 1024, .stride = 768, .slack = 64},
+        {.maxTokens = 64, .stride = 32, .slack = 16},
+};
+
+typedef struct {
+    uint32_t *tokens;
+    uint64_t *offsets;           /* input offset of each token */
+    size_t numTokens;
+    size_t capacity;
+} encoding_t;
+
+typedef struct {
+    const encoding_t *full;
+    uint64_t numBytes;
+    size_t numWindows;
+    size_t numBad;
+    size_t covered;              /* tokens up to the end of the last window */
+} check_t;
+
+static void collectFull(const uint32_t *tokens, size_t numTokens,
+                        size_t offset, size_t length, void *ctx) {
+    encoding_t *full = (encoding_t *) ctx;
+    (void) length;
+    if (full->numTokens + numTokens > full->capacity) {
+        full->capacity = (full->numTokens + numTokens) * 2;
+        full->tokens = realloc(full->tokens,
+                               full->capacity * sizeof(uint32_t));
+        full->offsets = realloc(full->offsets,
+                                full->capacity * sizeof(uint64_t));
+        if (full->tokens == NULL || full->offsets == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    for (size_t idx = 0; idx < numTokens; idx++) {
+        char bytes[MAX_TOKEN_BYTES];
+        size_t tokenLen = 0;
+        full->tokens[full->numTokens] = tokens[idx];
+        full->offsets[full->numTokens++] = offset;
+        DecodeTokenBytes(tokens[idx], bytes, &tokenLen);
+        offset += tokenLen;
+    }
+}
+
+/* The index of the full encode's first token at or after `offset`. */
+static size_t findToken(const encoding_t *full, uint64_t offset) {
+    size_t lower = 0, upper = full->numTokens;
+    while (lower < upper) {
+        size_t middle = lower + (upper - lower) / 2;
+        if (full->offsets[middle] < offset) {
+            lower = middle + 1;
+        } else {
+            upper = middle;
+        }
+    }
+    return lower;
+}
+
+static void checkWindow(const uint32_t *tokens, size_t numTokens,
+                        uint64_t begin, uint64_t end, void *ctx) {
+    check_t *check = (check_t *) ctx;
+    const encoding_t *full = check->full;
+    size_t first = findToken(full, begin);
+    size_t last = first + numTokens;
+    uint64_t fullEnd = last < full->numTokens ? full->offsets[last] :
+                       check->numBytes;
+    if (last > full->numTokens || full->offsets[first] != begin ||
+        fullEnd != end || first > check->covered ||
+        memcmp(full->tokens + first, tokens,
+               numTokens * sizeof(uint32_t)) != 0) {
+        check->numBad++;
+    }
+    check->numWindows++;
+    check->covered = last;
+}
+
+static bool checkInput(const char *name, const char *text, size_t numBytes) {
+    encoding_t full = {0};
+    enum CODEC_STATUS status = EncodeText32(text, numBytes, NULL,
+                                            collectFull, &full);
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "%s: EncodeText32 failed: %d\n", name, status);
+        return false;
+    }
+    bool passed = true;
+    for (size_t idx = 0; idx < sizeof(configs) / sizeof(configs[0]); idx++) {
+        for (size_t size = 0;
+             size < sizeof(pushSizes) / sizeof(pushSizes[0]); size++) {
+            check_t check = {.full = &full, .numBytes = numBytes};
+            windowConfig_t config = configs[idx];
+            config.onWindow = checkWindow;
+            config.ctx = &check;
+            windower_t windower;
+            status = WindowerInit(&windower, &config);
+            for (size_t pos = 0; pos < numBytes && status == CODEC_SUCCESS;
+                 pos += pushSizes[size]) {
+                size_t piece = numBytes - pos < pushSizes[size] ?
+                               numBytes - pos : pushSizes[size];
+                status = WindowerPush(&windower, text + pos, piece);
+            }
+            if (status == CODEC_SUCCESS) {
+                status = WindowerFinish(&windower);
+            }
+            WindowerFree(&windower);
+            if (status != CODEC_SUCCESS || check.numBad != 0 ||
+                check.covered != full.numTokens) {
+                fprintf(stderr, "%s: windows of %zu every %zu, pushed %zu "
+                                "bytes at a time: status %d, %zu of %zu "
+                                "windows differ, %zu of %zu tokens\n",
+                        name, config.maxTokens, config.stride,
+                        pushSizes[size], status, check.numBad,
+                        check.numWindows, check.covered, full.numTokens);
+                passed = false;
+            }
+        }
+    }
+    if (passed) {
+        printf("%s: %zu tokens, every window matches\n", name,
+               full.numTokens);
+    }
+    free(full.tokens);
+    free(full.offsets);
+    return passed;
+}
+
+int main(void) {
+    FILE *f = fopen("frankenstein.txt", "rb");
+    if (f == NULL) {
+        perror("frankenstein.txt");
+        return 2;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t numBytes = (size_t) ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = malloc(numBytes);
+    if (text == NULL || fread(text, 1, numBytes, f) != numBytes) {
+        fprintf(stderr, "could not read frankenstein.txt\n");
+        return 2;
+    }
+    fclose(f);
+    bool passed = checkInput("frankenstein.txt", text, numBytes);
+    /* Without spaces or newlines there is no cheap place to cut. */
+    size_t spaceless = 0;
+    for (size_t idx = 0; idx < numBytes; idx++) {
+        if (text[idx] != ' ' && text[idx] != '\n' && text[idx] != '\r') {
+            text[spaceless++] = text[idx];
+        }
+    }
+    passed = checkInput("spaceless text", text, spaceless) && passed;
+    free(text);
+    ShutdownGPT2Codec();
+    return passed ? 0 : 1;
+}
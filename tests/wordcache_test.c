@@ -0,0 +1,212 @@
+//
+// Forks processes that share one named word cache, some creating it and
+// filling it, the others attaching once it exists, and checks that every
+// encode through the cache matches the encode without it.  Then attaches
+// with a different vocabulary, which must fail:
+//
+//   wordcache_test
+//
+// Run from the source directory, where the vocabulary and
+// frankenstein.txt live.
+//
+
+#include "library.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NUM_WRITERS 2
+#define NUM_READERS 3
+/* Small enough that the corpus keeps evicting words. */
+#define CACHE_BYTES (256 * 1024)
+
+typedef struct {
+    uint16_t *tokens;
+    size_t numTokens;
+    size_t capacity;
+    size_t numBad;               /* when comparing instead of collecting */
+    bool compare;
+} encoding_t;
+
+static void collectTokens(const uint16_t *tokens, size_t numTokens,
+                          size_t offset, size_t length, void *ctx) {
+    encoding_t *encoding = (encoding_t *) ctx;
+    (void) offset;
+    (void) length;
+    if (encoding->compare) {
+        for (size_t idx = 0; idx < numTokens; idx++) {
+            if (encoding->numTokens + idx >= encoding->capacity ||
+                encoding->tokens[encoding->numTokens + idx] != tokens[idx]) {
+                encoding->numBad++;
+            }
+        }
+        encoding->numTokens += numTokens;
+        return;
+    }
+    if (encoding->numTokens + numTokens > encoding->capacity) {
+        encoding->capacity = (encoding->numTokens + numTokens) * 2;
+        encoding->tokens = realloc(encoding->tokens,
+                                   encoding->capacity * sizeof(uint16_t));
+        if (encoding->tokens == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(encoding->tokens + encoding->numTokens, tokens,
+           numTokens * sizeof(uint16_t));
+    encoding->numTokens += numTokens;
+}
+
+/* Encodes the corpus `rounds` times through the cache, 0 if every round
+   matched `expected`. */
+static int encodeCached(const char *name, bool writer, int rounds,
+                        const char *text, size_t numBytes,
+                        const encoding_t *expected) {
+    const char *role = writer ? "writer" : "reader";
+    enum CODEC_STATUS status;
+    /* A reader only attaches to a segment a writer has created. */
+    for (int tries = 0;
+         (status = AttachWordCache(name, writer ? CACHE_BYTES : 0)) ==
+         ERR_CACHE_OPEN && !writer && tries < 10000; tries++) {
+        usleep(1000);
+    }
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "%s %d: AttachWordCache failed: %d\n", role,
+                (int) getpid(), status);
+        return 1;
+    }
+    codecStats_t stats = {0};
+    encodeOptions_t options = {.stats = &stats};
+    for (int round = 0; round < rounds; round++) {
+        encoding_t check = {.tokens = expected->tokens,
+                            .capacity = expected->numTokens,
+                            .compare = true};
+        status = EncodeText(text, numBytes, &options, collectTokens, &check);
+        if (status != CODEC_SUCCESS || check.numBad != 0 ||
+            check.numTokens != expected->numTokens) {
+            fprintf(stderr, "%s %d, round %d: status %d, %zu of %zu tokens "
+                            "differ, %zu tokens\n", role, (int) getpid(),
+                    round, status, check.numBad, expected->numTokens,
+                    check.numTokens);
+            return 1;
+        }
+    }
+    if (stats.cacheHits == 0) {
+        fprintf(stderr, "%s %d: no cache hits in %llu lookups\n", role,
+                (int) getpid(), (unsigned long long) stats.cacheLookups);
+        return 1;
+    }
+    DetachWordCache();
+    return 0;
+}
+
+static bool checkShared(const char *name, const char *text,
+                        size_t numBytes, const encoding_t *expected) {
+    pid_t children[NUM_WRITERS + NUM_READERS];
+    for (int idx = 0; idx < NUM_WRITERS + NUM_READERS; idx++) {
+        bool writer = idx % 2 == 0 && idx / 2 < NUM_WRITERS;
+        children[idx] = fork();
+        if (children[idx] == 0) {
+            _exit(encodeCached(name, writer, writer ? 2 : 4, text, numBytes,
+                               expected));
+        } else if (children[idx] < 0) {
+            perror("fork");
+            return false;
+        }
+    }
+    bool passed = true;
+    for (int idx = 0; idx < NUM_WRITERS + NUM_READERS; idx++) {
+        int wstatus;
+        if (waitpid(children[idx], &wstatus, 0) < 0 ||
+            !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+            passed = false;
+        }
+    }
+    if (passed) {
+        printf("%d writers and %d readers: every encode matches\n",
+               NUM_WRITERS, NUM_READERS);
+    }
+    return passed;
+}
+
+/* The GPT-2 merges less the last one, written next to the test segment. */
+static bool checkMismatch(const char *name) {
+    char bpePath[] = "/tmp/wordcache_test.XXXXXX";
+    int fd = mkstemp(bpePath);
+    FILE *in = fopen("resources/vocab.bpe", "rb");
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (in == NULL || out == NULL) {
+        perror("vocab.bpe");
+        return false;
+    }
+    char line[1024];
+    long lastLine = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (line[0] != '\0' && line[1] != '\0') {
+            lastLine = ftell(out);
+        }
+        fputs(line, out);
+    }
+    fclose(in);
+    fflush(out);
+    bool passed = ftruncate(fd, lastLine) == 0;
+    fclose(out);
+
+    enum CODEC_STATUS status = InitializeCodec("resources/encoder.json",
+                                               bpePath);
+    if (passed && status != CODEC_SUCCESS) {
+        fprintf(stderr, "InitializeCodec failed: %d\n", status);
+        passed = false;
+    }
+    if (passed && (status = AttachWordCache(name, 0)) != ERR_CACHE_MISMATCH) {
+        fprintf(stderr, "attached with other merges: %d\n", status);
+        passed = false;
+    }
+    /* The segment is still good for the vocabulary it was made for. */
+    if (passed && ((status = InitializeGPT2Codec()) != CODEC_SUCCESS ||
+                   (status = AttachWordCache(name, 0)) != CODEC_SUCCESS)) {
+        fprintf(stderr, "could not attach again: %d\n", status);
+        passed = false;
+    }
+    if (passed) {
+        printf("other merges: ERR_CACHE_MISMATCH\n");
+    }
+    unlink(bpePath);
+    return passed;
+}
+
+int main(void) {
+    FILE *f = fopen("frankenstein.txt", "rb");
+    if (f == NULL) {
+        perror("frankenstein.txt");
+        return 2;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t numBytes = (size_t) ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = malloc(numBytes);
+    if (text == NULL || fread(text, 1, numBytes, f) != numBytes) {
+        fprintf(stderr, "could not read frankenstein.txt\n");
+        return 2;
+    }
+    fclose(f);
+
+    encoding_t expected = {0};
+    enum CODEC_STATUS status = EncodeText(text, numBytes, NULL,
+                                          collectTokens, &expected);
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "EncodeText failed: %d\n", status);
+        return 1;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/gpt2codec_test.%d", (int) getpid());
+    shm_unlink(name);
+    bool passed = checkShared(name, text, numBytes, &expected);
+    passed = checkMismatch(name) && passed;
+    shm_unlink(name);
+    free(expected.tokens);
+    free(text);
+    ShutdownGPT2Codec();
+    return passed ? 0 : 1;
+}
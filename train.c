@@ -0,0 +1,218 @@
+//
+// gpt2_codec_train: learns a byte-level BPE vocabulary from text files and
+// writes encoder.json and vocab.bpe for InitializeCodec():
+//
+//   gpt2_codec_train -n 50000 -o vocab corpus/*.txt
+//
+// The files are read in blocks.  Every block is cut into one slice per
+// thread where no pre-token straddles the cut, and each thread counts the
+// pre-tokens of its slices into a trainer of its own.
+//
+
+#include "trainer.h"
+#include "rdtsc.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_COUNTERS 64
+
+typedef struct {
+    pthread_t thread;
+    bpeTrainer_t trainer;
+    const char *text;            /* slice of the current block */
+    size_t numBytes;
+    enum CODEC_STATUS status;
+} counter_t;
+
+static counter_t counters[MAX_COUNTERS];
+static size_t numCounters = 0;    /* 0 for one per core */
+
+static void *counterMain(void *arg) {
+    counter_t *counter = (counter_t *) arg;
+    counter->status = TrainerCount(&counter->trainer, counter->text,
+                                   counter->numBytes);
+    return NULL;
+}
+
+/* Counts a block that ends where no pre-token straddles it. */
+static enum CODEC_STATUS countBlock(const char *text, size_t numBytes) {
+    size_t pos = 0;
+    for (size_t idx = 0; idx < numCounters; idx++) {
+        size_t end = numBytes;
+        size_t share = (numBytes - pos) / (numCounters - idx);
+        if (idx + 1 < numCounters && share > MAX_TOKEN_BYTES) {
+            /* No cut leaves this counter nothing and the next more. */
+            end = pos + SplitterCutPoint(text + pos, share);
+        }
+        counters[idx].text = text + pos;
+        counters[idx].numBytes = end - pos;
+        pos = end;
+        pthread_create(&counters[idx].thread, NULL, counterMain,
+                       &counters[idx]);
+    }
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    for (size_t idx = 0; idx < numCounters; idx++) {
+        pthread_join(counters[idx].thread, NULL);
+        if (counters[idx].status != CODEC_SUCCESS) {
+            status = counters[idx].status;
+        }
+    }
+    return status;
+}
+
+static enum CODEC_STATUS countFile(const char *path, char **block,
+                                   size_t *blockSize) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return ERR_CORPUS_FOPEN;
+    }
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    size_t length = 0;
+    for (;;) {
+        size_t got = fread(*block + length, 1, *blockSize - length, f);
+        length += got;
+        if (length < *blockSize) {
+            break;
+        }
+        /* The tail after the cut starts the next block. */
+        size_t cut = SplitterCutPoint(*block, length);
+        if (cut == 0) {
+            /* One pre-token fills the block, it grows to hold more. */
+            char *grown = realloc(*block, *blockSize * 2);
+            if (grown == NULL) {
+                status = ERR_TRAIN_MALLOC;
+                break;
+            }
+            *block = grown;
+            *blockSize *= 2;
+            continue;
+        }
+        status = countBlock(*block, cut);
+        if (status != CODEC_SUCCESS) {
+            break;
+        }
+        memmove(*block, *block + cut, length - cut);
+        length -= cut;
+    }
+    if (ferror(f)) {
+        perror(path);
+        status = ERR_CORPUS_FOPEN;
+    } else if (status == CODEC_SUCCESS && length != 0) {
+        status = countBlock(*block, length);
+    }
+    fclose(f);
+    return status;
+}
+
+static double secondsSince(uint64_t start) {
+    return (RDTSC() - start) / g_TicksPerNanoSec / 1000000000;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n merges] [-m count] [-j threads] [-b bytes] "
+            "[-o dir] file...\n"
+            "  -n  merges to learn, default 50000\n"
+            "  -m  stop once no pair occurs this often, default 2\n"
+            "  -j  counting threads, default one per core\n"
+            "  -b  block size in bytes, default 67108864\n"
+            "  -o  directory for encoder.json and vocab.bpe, default .\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    size_t numMerges = 50000;
+    uint64_t minCount = 2;
+    size_t blockSize = 1 << 26;
+    const char *outDir = ".";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:j:b:o:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                numMerges = (size_t) atol(optarg);
+                break;
+            case 'm':
+                minCount = (uint64_t) atol(optarg);
+                break;
+            case 'j':
+                numCounters = (size_t) atol(optarg);
+                break;
+            case 'b':
+                blockSize = (size_t) atol(optarg);
+                break;
+            case 'o':
+                outDir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind == argc || blockSize < 4 * MAX_TOKEN_BYTES ||
+        numCounters > MAX_COUNTERS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (numCounters == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        numCounters = cores < 1 ? 1 : cores > MAX_COUNTERS ? MAX_COUNTERS :
+                                      (size_t) cores;
+    }
+    char *block = malloc(blockSize);
+    if (block == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t idx = 0; idx < numCounters; idx++) {
+        TrainerInit(&counters[idx].trainer);
+    }
+
+    CalibrateRdtscTicks();
+    uint64_t start = RDTSC();
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    for (int idx = optind; idx < argc && status == CODEC_SUCCESS; idx++) {
+        status = countFile(argv[idx], &block, &blockSize);
+    }
+    free(block);
+    bpeTrainer_t *trainer = &counters[0].trainer;
+    for (size_t idx = 1; idx < numCounters; idx++) {
+        if (status == CODEC_SUCCESS) {
+            status = TrainerMerge(trainer, &counters[idx].trainer);
+        }
+        TrainerFree(&counters[idx].trainer);
+    }
+    double seconds = secondsSince(start);
+    if (status == CODEC_SUCCESS) {
+        fprintf(stderr, "counted %.2f MB in %.3f s: %.2f MB/s, "
+                        "%zu distinct pre-tokens\n",
+                trainer->numBytes / 1000000.0, seconds,
+                trainer->numBytes / seconds / 1000000,
+                trainer->words.filled);
+        start = RDTSC();
+        status = TrainerLearn(trainer, numMerges, minCount);
+        seconds = secondsSince(start);
+    }
+    if (status == CODEC_SUCCESS) {
+        fprintf(stderr, "learned %zu merges in %.3f s, %zu tokens\n",
+                trainer->numMerges, seconds, trainer->numTokens + 1);
+        size_t pathLen = strlen(outDir) + sizeof("/encoder.json");
+        char *encoderPath = malloc(pathLen);
+        char *bpePath = malloc(pathLen);
+        if (encoderPath == NULL || bpePath == NULL) {
+            status = ERR_TRAIN_MALLOC;
+        } else {
+            snprintf(encoderPath, pathLen, "%s/encoder.json", outDir);
+            snprintf(bpePath, pathLen, "%s/vocab.bpe", outDir);
+            status = TrainerWrite(trainer, encoderPath, bpePath);
+        }
+        free(encoderPath);
+        free(bpePath);
+    }
+    if (status != CODEC_SUCCESS) {
+        fprintf(stderr, "training failed: %d\n", status);
+    }
+    TrainerFree(trainer);
+    return status != CODEC_SUCCESS;
+}
@@ -0,0 +1,650 @@
+//
+// Learns a byte-level BPE vocabulary from a corpus and writes it in the
+// GPT-2 file formats, for InitializeCodec() to load as is.
+//
+// The corpus is first reduced to its distinct pre-tokens and their counts.
+// Each pair of adjacent symbols then knows how often it occurs and which
+// words it occurs in.  A merge only revisits those words, taking their
+// pairs out and putting the new ones back, so the counts stay current
+// without ever recounting.  The most frequent pair comes off a heap whose
+// stale entries are corrected as they reach the top.
+//
+
+#include "trainer.h"
+#include <string.h>
+
+#define END_OF_TEXT "<|endoftext|>"
+
+// ==========================================================================
+// Byte string tables
+// ==========================================================================
+
+static bool tableGrow(trainerTable_t *table) {
+    size_t size = table->size ? table->size * 2 : 1024;
+    trainerSlot_t *slots = calloc(size, sizeof(trainerSlot_t));
+    if (slots == NULL) {
+        return false;
+    }
+    for (size_t idx = 0; idx < table->size; idx++) {
+        const trainerSlot_t *slot = &table->slots[idx];
+        if (slot->hash == 0) {
+            continue;
+        }
+        size_t pos = slot->hash & (size - 1);
+        while (slots[pos].hash != 0) {
+            pos = (pos + 1) & (size - 1);
+        }
+        slots[pos] = *slot;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->size = size;
+    return true;
+}
+
+/*
+ * The slot holding `key`, added with a value of 0 when `add` is set.  NULL
+ * if it is missing, or out of memory.
+ */
+static trainerSlot_t *tableFind(trainerTable_t *table, const char *key,
+                                size_t length, bool add) {
+    if (add && (table->filled + 1) * 2 > table->size && !tableGrow(table)) {
+        return NULL;
+    }
+    if (table->size == 0) {
+        return NULL;
+    }
+    uint32_t hash = genHash(key, (unsigned int) length, 0);
+    size_t pos = hash & (table->size - 1);
+    trainerSlot_t *slot;
+    while ((slot = &table->slots[pos])->hash != 0) {
+        if (slot->hash == hash && slot->length == length &&
+            memcmp(table->pool + slot->offset, key, length) == 0) {
+            return slot;
+        }
+        pos = (pos + 1) & (table->size - 1);
+    }
+    if (!add) {
+        return NULL;
+    }
+    if (table->poolLen + length > table->poolCap) {
+        size_t capacity = table->poolCap ? table->poolCap * 2 : 1 << 16;
+        while (capacity < table->poolLen + length) {
+            capacity *= 2;
+        }
+        char *pool = realloc(table->pool, capacity);
+        if (pool == NULL) {
+            return NULL;
+        }
+        table->pool = pool;
+        table->poolCap = capacity;
+    }
+    memcpy(table->pool + table->poolLen, key, length);
+    slot->hash = hash;
+    slot->length = (uint32_t) length;
+    slot->offset = table->poolLen;
+    slot->value = 0;
+    table->poolLen += length;
+    table->filled++;
+    return slot;
+}
+
+static void tableFree(trainerTable_t *table) {
+    free(table->slots);
+    free(table->pool);
+    memset(table, 0, sizeof(trainerTable_t));
+}
+
+// ==========================================================================
+// Counting
+// ==========================================================================
+
+void TrainerInit(bpeTrainer_t *trainer) {
+    memset(trainer, 0, sizeof(bpeTrainer_t));
+}
+
+static void countWord(const char *word, size_t length, void *ctx) {
+    bpeTrainer_t *trainer = (bpeTrainer_t *) ctx;
+    trainerSlot_t *slot = tableFind(&trainer->words, word, length, true);
+    if (slot == NULL) {
+        trainer->failed = true;
+        return;
+    }
+    slot->value++;
+}
+
+enum CODEC_STATUS TrainerCount(bpeTrainer_t *trainer, const char *text,
+                               size_t numBytes) {
+    if (!trainer->failed) {
+        SplitText(text, numBytes, countWord, trainer);
+        trainer->numBytes += numBytes;
+    }
+    return trainer->failed ? ERR_TRAIN_MALLOC : CODEC_SUCCESS;
+}
+
+enum CODEC_STATUS TrainerMerge(bpeTrainer_t *into, const bpeTrainer_t *from) {
+    if (into->failed || from->failed) {
+        return ERR_TRAIN_MALLOC;
+    }
+    for (size_t idx = 0; idx < from->words.size; idx++) {
+        const trainerSlot_t *word = &from->words.slots[idx];
+        if (word->hash == 0) {
+            continue;
+        }
+        trainerSlot_t *slot = tableFind(&into->words,
+                                        from->words.pool + word->offset,
+                                        word->length, true);
+        if (slot == NULL) {
+            into->failed = true;
+            return ERR_TRAIN_MALLOC;
+        }
+        slot->value += word->value;
+    }
+    into->numBytes += from->numBytes;
+    return CODEC_SUCCESS;
+}
+
+// ==========================================================================
+// Learning
+// ==========================================================================
+
+typedef struct {
+    uint64_t key;                /* pairKey(), 0 marks an empty slot */
+    int64_t count;               /* occurrences, times the word counts */
+    uint32_t *words;             /* that contain it, repeats possible */
+    uint32_t numWords;
+    uint32_t wordsCap;
+    uint32_t touched;            /* last merge that made it more common */
+} pairSlot_t;
+
+typedef struct {
+    int64_t count;
+    uint64_t key;
+} heapEntry_t;
+
+typedef struct {
+    uint32_t *symbols;           /* every word's token ids, back to back */
+    size_t *starts;              /* of each word in symbols */
+    uint16_t *lengths;           /* symbols left in each word */
+    uint64_t *counts;
+    uint32_t *visited;           /* last merge that looked at each word */
+    size_t numWords;
+    pairSlot_t *pairs;           /* open addressing, a power of two */
+    size_t pairsSize;
+    size_t pairsFilled;
+    heapEntry_t *heap;
+    size_t heapLen;
+    size_t heapCap;
+    uint64_t *touched;           /* pairs the current merge added to */
+    size_t numTouched;
+    size_t touchedCap;
+    bool failed;
+} learner_t;
+
+static inline uint64_t pairKey(uint32_t left, uint32_t right) {
+    return (uint64_t) (left + 1) << 32 | right;
+}
+
+static inline size_t pairHash(uint64_t key) {
+    key *= 0x9E3779B97F4A7C15u;
+    return (size_t) (key ^ key >> 29);
+}
+
+static bool pairsGrow(learner_t *learner) {
+    size_t size = learner->pairsSize ? learner->pairsSize * 2 : 1 << 16;
+    pairSlot_t *pairs = calloc(size, sizeof(pairSlot_t));
+    if (pairs == NULL) {
+        return false;
+    }
+    for (size_t idx = 0; idx < learner->pairsSize; idx++) {
+        const pairSlot_t *pair = &learner->pairs[idx];
+        if (pair->key == 0) {
+            continue;
+        }
+        size_t pos = pairHash(pair->key) & (size - 1);
+        while (pairs[pos].key != 0) {
+            pos = (pos + 1) & (size - 1);
+        }
+        pairs[pos] = *pair;
+    }
+    free(learner->pairs);
+    learner->pairs = pairs;
+    learner->pairsSize = size;
+    return true;
+}
+
+/* Slots move as the table grows, a pointer is only good until the next
+   call that adds. */
+static pairSlot_t *pairFind(learner_t *learner, uint64_t key, bool add) {
+    if (add && (learner->pairsFilled + 1) * 2 > learner->pairsSize &&
+        !pairsGrow(learner)) {
+        return NULL;
+    }
+    size_t pos = pairHash(key) & (learner->pairsSize - 1);
+    pairSlot_t *pair;
+    while ((pair = &learner->pairs[pos])->key != 0) {
+        if (pair->key == key) {
+            return pair;
+        }
+        pos = (pos + 1) & (learner->pairsSize - 1);
+    }
+    if (!add) {
+        return NULL;
+    }
+    pair->key = key;
+    learner->pairsFilled++;
+    return pair;
+}
+
+static inline bool heapAbove(const heapEntry_t *a, const heapEntry_t *b) {
+    return a->count > b->count || (a->count == b->count && a->key < b->key);
+}
+
+static void heapPush(learner_t *learner, int64_t count, uint64_t key) {
+    if (learner->heapLen == learner->heapCap) {
+        size_t capacity = learner->heapCap ? learner->heapCap * 2 : 1 << 16;
+        heapEntry_t *heap = realloc(learner->heap,
+                                    capacity * sizeof(heapEntry_t));
+        if (heap == NULL) {
+            learner->failed = true;
+            return;
+        }
+        learner->heap = heap;
+        learner->heapCap = capacity;
+    }
+    heapEntry_t entry = {count, key};
+    size_t pos = learner->heapLen++;
+    while (pos > 0 && heapAbove(&entry, &learner->heap[(pos - 1) / 2])) {
+        learner->heap[pos] = learner->heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    learner->heap[pos] = entry;
+}
+
+static heapEntry_t heapPop(learner_t *learner) {
+    heapEntry_t top = learner->heap[0];
+    heapEntry_t last = learner->heap[--learner->heapLen];
+    size_t pos = 0;
+    for (;;) {
+        size_t child = 2 * pos + 1;
+        if (child >= learner->heapLen) {
+            break;
+        }
+        if (child + 1 < learner->heapLen &&
+            heapAbove(&learner->heap[child + 1], &learner->heap[child])) {
+            child++;
+        }
+        if (!heapAbove(&learner->heap[child], &last)) {
+            break;
+        }
+        learner->heap[pos] = learner->heap[child];
+        pos = child;
+    }
+    learner->heap[pos] = last;
+    return top;
+}
+
+/*
+ * Adds `delta` occurrences of a pair in `word`.  A pair the current merge
+ * (`stamp` > 0) made more common lists the word and goes back on the heap
+ * once the merge is done.
+ */
+static void countPair(learner_t *learner, uint32_t left, uint32_t right,
+                      uint32_t word, int64_t delta, uint32_t stamp) {
+    uint64_t key = pairKey(left, right);
+    pairSlot_t *pair = pairFind(learner, key, true);
+    if (pair == NULL) {
+        learner->failed = true;
+        return;
+    }
+    pair->count += delta;
+    if (delta < 0) {
+        return;
+    }
+    if (pair->numWords == 0 || pair->words[pair->numWords - 1] != word) {
+        if (pair->numWords == pair->wordsCap) {
+            uint32_t capacity = pair->wordsCap ? pair->wordsCap * 2 : 4;
+            uint32_t *words = realloc(pair->words,
+                                      capacity * sizeof(uint32_t));
+            if (words == NULL) {
+                learner->failed = true;
+                return;
+            }
+            pair->words = words;
+            pair->wordsCap = capacity;
+        }
+        pair->words[pair->numWords++] = word;
+    }
+    if (stamp != 0 && pair->touched != stamp) {
+        if (learner->numTouched == learner->touchedCap) {
+            size_t capacity = learner->touchedCap ?
+                              learner->touchedCap * 2 : 1024;
+            uint64_t *touched = realloc(learner->touched,
+                                        capacity * sizeof(uint64_t));
+            if (touched == NULL) {
+                learner->failed = true;
+                return;
+            }
+            learner->touched = touched;
+            learner->touchedCap = capacity;
+        }
+        pair->touched = stamp;
+        learner->touched[learner->numTouched++] = key;
+    }
+}
+
+/* Replaces every `left right` in the word with `merged`. */
+static void rewriteWord(learner_t *learner, uint32_t word, uint32_t left,
+                        uint32_t right, uint32_t merged, uint32_t stamp) {
+    uint32_t *symbols = learner->symbols + learner->starts[word];
+    size_t length = learner->lengths[word];
+    int64_t count = (int64_t) learner->counts[word];
+    size_t first = 0;
+    while (first + 1 < length &&
+           (symbols[first] != left || symbols[first + 1] != right)) {
+        first++;
+    }
+    if (first + 1 >= length) {
+        return;
+    }
+    for (size_t idx = 0; idx + 1 < length; idx++) {
+        countPair(learner, symbols[idx], symbols[idx + 1], word, -count, 0);
+    }
+    size_t out = first;
+    for (size_t idx = first; idx < length;) {
+        if (idx + 1 < length && symbols[idx] == left &&
+            symbols[idx + 1] == right) {
+            symbols[out++] = merged;
+            idx += 2;
+        } else {
+            symbols[out++] = symbols[idx++];
+        }
+    }
+    learner->lengths[word] = (uint16_t) out;
+    for (size_t idx = 0; idx + 1 < out; idx++) {
+        bool fresh = symbols[idx] == merged || symbols[idx + 1] == merged;
+        countPair(learner, symbols[idx], symbols[idx + 1], word, count,
+                  fresh ? stamp : 0);
+    }
+}
+
+/* The id of a token with these bytes, added to the vocabulary if new. */
+static bool addToken(bpeTrainer_t *trainer, const char *bytes, size_t length,
+                     uint32_t *id) {
+    trainerSlot_t *slot = tableFind(&trainer->tokens, bytes, length, true);
+    if (slot == NULL) {
+        return false;
+    }
+    if (slot->value == 0) {
+        size_t *keys = realloc(trainer->tokenKeys,
+                               (trainer->numTokens + 1) * sizeof(size_t));
+        if (keys != NULL) {
+            trainer->tokenKeys = keys;
+        }
+        uint16_t *lengths = realloc(trainer->tokenLengths,
+                                    (trainer->numTokens + 1) *
+                                    sizeof(uint16_t));
+        if (lengths != NULL) {
+            trainer->tokenLengths = lengths;
+        }
+        if (keys == NULL || lengths == NULL) {
+            return false;
+        }
+        keys[trainer->numTokens] = slot->offset;
+        lengths[trainer->numTokens] = (uint16_t) length;
+        /* Stored off by one, 0 is a slot that was just added. */
+        slot->value = ++trainer->numTokens;
+    }
+    *id = (uint32_t) (slot->value - 1);
+    return true;
+}
+
+/* The single bytes, ids in GPT-2's order: by the rune each stands for. */
+static bool addByteTokens(bpeTrainer_t *trainer, uint32_t *byteIds) {
+    codecTables_t *tables = calloc(1, sizeof(codecTables_t));
+    if (tables == NULL) {
+        return false;
+    }
+    buildUnicodeByteTable(&tables);
+    bool added = true;
+    for (uint16_t rune = 0; rune < 0x200 && added; rune++) {
+        for (unsigned int byte = 0; byte < 256; byte++) {
+            if (tables->bytesToUnicode[byte] == rune) {
+                char ch = (char) byte;
+                added = addToken(trainer, &ch, 1, &byteIds[byte]);
+                break;
+            }
+        }
+    }
+    free(tables);
+    return added;
+}
+
+static bool loadWords(learner_t *learner, const bpeTrainer_t *trainer,
+                      const uint32_t *byteIds) {
+    const trainerTable_t *words = &trainer->words;
+    learner->starts = malloc(words->filled * sizeof(size_t));
+    learner->lengths = malloc(words->filled * sizeof(uint16_t));
+    learner->counts = malloc(words->filled * sizeof(uint64_t));
+    learner->visited = calloc(words->filled, sizeof(uint32_t));
+    learner->symbols = malloc(words->poolLen * sizeof(uint32_t));
+    if (learner->starts == NULL || learner->lengths == NULL ||
+        learner->counts == NULL || learner->visited == NULL ||
+        (learner->symbols == NULL && words->poolLen != 0) ||
+        !pairsGrow(learner)) {
+        return false;
+    }
+    size_t numSymbols = 0;
+    for (size_t idx = 0; idx < words->size; idx++) {
+        const trainerSlot_t *slot = &words->slots[idx];
+        if (slot->hash == 0) {
+            continue;
+        }
+        uint32_t word = (uint32_t) learner->numWords++;
+        const unsigned char *bytes =
+                (const unsigned char *) words->pool + slot->offset;
+        uint32_t *symbols = learner->symbols + numSymbols;
+        for (size_t pos = 0; pos < slot->length; pos++) {
+            symbols[pos] = byteIds[bytes[pos]];
+        }
+        learner->starts[word] = numSymbols;
+        learner->lengths[word] = (uint16_t) slot->length;
+        learner->counts[word] = slot->value;
+        numSymbols += slot->length;
+        for (size_t pos = 0; pos + 1 < slot->length; pos++) {
+            countPair(learner, symbols[pos], symbols[pos + 1], word,
+                      (int64_t) slot->value, 0);
+        }
+    }
+    for (size_t idx = 0; idx < learner->pairsSize; idx++) {
+        if (learner->pairs[idx].count > 0) {
+            heapPush(learner, learner->pairs[idx].count,
+                     learner->pairs[idx].key);
+        }
+    }
+    return !learner->failed;
+}
+
+/* The most frequent pair, or NULL once none is left. */
+static pairSlot_t *popBestPair(learner_t *learner) {
+    while (learner->heapLen > 0) {
+        heapEntry_t top = heapPop(learner);
+        pairSlot_t *pair = pairFind(learner, top.key, false);
+        if (pair->count == top.count) {
+            return pair;
+        }
+        /* Fewer since it was pushed; a larger count is on the heap too. */
+        if (pair->count > 0 && pair->count < top.count) {
+            heapPush(learner, pair->count, top.key);
+        }
+    }
+    return NULL;
+}
+
+static void freeLearner(learner_t *learner) {
+    for (size_t idx = 0; idx < learner->pairsSize; idx++) {
+        free(learner->pairs[idx].words);
+    }
+    free(learner->pairs);
+    free(learner->heap);
+    free(learner->touched);
+    free(learner->symbols);
+    free(learner->starts);
+    free(learner->lengths);
+    free(learner->counts);
+    free(learner->visited);
+}
+
+enum CODEC_STATUS TrainerLearn(bpeTrainer_t *trainer, size_t numMerges,
+                               uint64_t minCount) {
+    uint32_t byteIds[256];
+    learner_t learner = {0};
+    tableFree(&trainer->tokens);
+    trainer->numTokens = 0;
+    free(trainer->merges);
+    trainer->merges = malloc(numMerges * sizeof(trainer->merges[0]));
+    trainer->numMerges = 0;
+    if ((trainer->merges == NULL && numMerges != 0) ||
+        !addByteTokens(trainer, byteIds) ||
+        !loadWords(&learner, trainer, byteIds)) {
+        freeLearner(&learner);
+        return ERR_TRAIN_MALLOC;
+    }
+    while (trainer->numMerges < numMerges && !learner.failed) {
+        pairSlot_t *best = popBestPair(&learner);
+        if (best == NULL || best->count < (int64_t) minCount) {
+            break;
+        }
+        uint32_t left = (uint32_t) (best->key >> 32) - 1;
+        uint32_t right = (uint32_t) best->key;
+        char bytes[2 * MAX_TOKEN_BYTES];
+        size_t leftLen = trainer->tokenLengths[left];
+        size_t rightLen = trainer->tokenLengths[right];
+        memcpy(bytes, trainer->tokens.pool + trainer->tokenKeys[left],
+               leftLen);
+        memcpy(bytes + leftLen,
+               trainer->tokens.pool + trainer->tokenKeys[right], rightLen);
+        uint32_t merged;
+        if (!addToken(trainer, bytes, leftLen + rightLen, &merged)) {
+            learner.failed = true;
+            break;
+        }
+        trainer->merges[trainer->numMerges][0] = left;
+        trainer->merges[trainer->numMerges][1] = right;
+        uint32_t stamp = (uint32_t) ++trainer->numMerges;
+
+        /* Every occurrence goes, the word list is not needed again. */
+        uint32_t *words = best->words;
+        uint32_t numWords = best->numWords;
+        best->words = NULL;
+        best->numWords = 0;
+        best->wordsCap = 0;
+        learner.numTouched = 0;
+        for (uint32_t idx = 0; idx < numWords; idx++) {
+            uint32_t word = words[idx];
+            if (learner.visited[word] != stamp) {
+                learner.visited[word] = stamp;
+                rewriteWord(&learner, word, left, right, merged, stamp);
+            }
+        }
+        free(words);
+        for (size_t idx = 0; idx < learner.numTouched; idx++) {
+            pairSlot_t *pair = pairFind(&learner, learner.touched[idx],
+                                        false);
+            if (pair->count > 0) {
+                heapPush(&learner, pair->count, pair->key);
+            }
+        }
+    }
+    bool failed = learner.failed;
+    freeLearner(&learner);
+    return failed ? ERR_TRAIN_MALLOC : CODEC_SUCCESS;
+}
+
+// ==========================================================================
+// Output
+// ==========================================================================
+
+/* A token's bytes as the runes they stand for, NUL terminated. */
+static void tokenUnicode(codecTables_t *tables, const bpeTrainer_t *trainer,
+                         uint32_t id, char *dest) {
+    char *ch = trainer->tokens.pool + trainer->tokenKeys[id];
+    char *end = ch + trainer->tokenLengths[id];
+    while (ch < end) {
+        encodeCharBPE(tables, &ch, &dest);
+    }
+    *dest = '\0';
+}
+
+static enum CODEC_STATUS writeEncoder(codecTables_t *tables,
+                                      const bpeTrainer_t *trainer,
+                                      const char *path) {
+    cJSON *encoder = cJSON_CreateObject();
+    char key[2 * MAX_TOKEN_BYTES + 1];
+    bool added = encoder != NULL;
+    for (uint32_t id = 0; id < trainer->numTokens && added; id++) {
+        tokenUnicode(tables, trainer, id, key);
+        added = cJSON_AddNumberToObject(encoder, key, id) != NULL;
+    }
+    added = added && cJSON_AddNumberToObject(encoder, END_OF_TEXT,
+                                             trainer->numTokens) != NULL;
+    char *json = added ? cJSON_PrintUnformatted(encoder) : NULL;
+    cJSON_Delete(encoder);
+    if (json == NULL) {
+        return ERR_TRAIN_MALLOC;
+    }
+    FILE *f = fopen(path, "wb");
+    size_t length = strlen(json);
+    bool written = f != NULL && fwrite(json, 1, length, f) == length;
+    if (f != NULL && fclose(f) != 0) {
+        written = false;
+    }
+    free(json);
+    return written ? CODEC_SUCCESS : ERR_TRAIN_WRITE;
+}
+
+static enum CODEC_STATUS writeMerges(codecTables_t *tables,
+                                     const bpeTrainer_t *trainer,
+                                     const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        return ERR_TRAIN_WRITE;
+    }
+    char left[2 * MAX_TOKEN_BYTES + 1];
+    char right[2 * MAX_TOKEN_BYTES + 1];
+    fputs("#version: 0.2\n", f);
+    for (size_t idx = 0; idx < trainer->numMerges; idx++) {
+        tokenUnicode(tables, trainer, trainer->merges[idx][0], left);
+        tokenUnicode(tables, trainer, trainer->merges[idx][1], right);
+        fprintf(f, "%s %s\n", left, right);
+    }
+    bool written = !ferror(f);
+    if (fclose(f) != 0) {
+        written = false;
+    }
+    return written ? CODEC_SUCCESS : ERR_TRAIN_WRITE;
+}
+
+enum CODEC_STATUS TrainerWrite(const bpeTrainer_t *trainer,
+                               const char *encoderPath, const char *bpePath) {
+    codecTables_t *tables = calloc(1, sizeof(codecTables_t));
+    if (tables == NULL) {
+        return ERR_TRAIN_MALLOC;
+    }
+    buildUnicodeByteTable(&tables);
+    enum CODEC_STATUS status = writeEncoder(tables, trainer, encoderPath);
+    if (status == CODEC_SUCCESS) {
+        status = writeMerges(tables, trainer, bpePath);
+    }
+    free(tables);
+    return status;
+}
+
+void TrainerFree(bpeTrainer_t *trainer) {
+    tableFree(&trainer->words);
+    tableFree(&trainer->tokens);
+    free(trainer->tokenKeys);
+    free(trainer->tokenLengths);
+    free(trainer->merges);
+    TrainerInit(trainer);
+}
@@ -0,0 +1,67 @@
+//
+// Learns a byte-level BPE vocabulary from a corpus and writes it in the
+// GPT-2 file formats, for InitializeCodec() to load as is.
+//
+
+#ifndef GPT2_CODEC_TRAINER_H
+#define GPT2_CODEC_TRAINER_H
+
+#include "library.h"
+
+/* A byte string and its value, the key lives in the table's pool. */
+typedef struct {
+    uint32_t hash;               /* 0 marks an empty slot */
+    uint32_t length;
+    size_t offset;
+    uint64_t value;
+} trainerSlot_t;
+
+typedef struct {
+    trainerSlot_t *slots;        /* open addressing, a power of two */
+    size_t size;
+    size_t filled;
+    char *pool;
+    size_t poolLen;
+    size_t poolCap;
+} trainerTable_t;
+
+/*
+ * Training only needs the distinct pre-tokens of the corpus and how often
+ * each occurs.  Every thread counts its share of the text into a trainer
+ * of its own; TrainerMerge() adds them up before TrainerLearn().
+ */
+typedef struct {
+    trainerTable_t words;        /* pre-token -> occurrences */
+    uint64_t numBytes;           /* of text counted */
+    bool failed;                 /* a count ran out of memory */
+    trainerTable_t tokens;       /* token bytes -> id, once learned */
+    size_t *tokenKeys;           /* indexed by id, offsets in its pool */
+    uint16_t *tokenLengths;
+    size_t numTokens;
+    uint32_t (*merges)[2];       /* token ids, in rank order */
+    size_t numMerges;
+} bpeTrainer_t;
+
+void TrainerInit(bpeTrainer_t *trainer);
+
+/* Counts the pre-tokens of the text, which must not split one. */
+enum CODEC_STATUS TrainerCount(bpeTrainer_t *trainer, const char *text,
+                               size_t numBytes);
+
+enum CODEC_STATUS TrainerMerge(bpeTrainer_t *into, const bpeTrainer_t *from);
+
+/*
+ * Learns up to `numMerges` merges, stopping early when no pair occurs
+ * `minCount` times.  A merge whose result is already a token reuses its
+ * id, so the vocabulary can end up smaller than 256 + numMerges, plus
+ * <|endoftext|> as its last id.
+ */
+enum CODEC_STATUS TrainerLearn(bpeTrainer_t *trainer, size_t numMerges,
+                               uint64_t minCount);
+
+enum CODEC_STATUS TrainerWrite(const bpeTrainer_t *trainer,
+                               const char *encoderPath, const char *bpePath);
+
+void TrainerFree(bpeTrainer_t *trainer);
+
+#endif //GPT2_CODEC_TRAINER_H
@@ -0,0 +1,230 @@
+//
+// Cuts the encoding of a long input into overlapping windows of tokens,
+// each with the byte range of the input it covers.
+//
+// Input is held back until there is enough of it to cut where no
+// pre-token straddles the cut, see SplitterCutPoint(), and encoded up to
+// there.  The tokens go into a pending buffer along with their offsets
+// and how good a break lies in front of each.  As soon as it holds more
+// than a window, the window is cut at the best break near its end and the
+// tokens in front of the next window are dropped.
+//
+
+#include "windower.h"
+#include <ctype.h>
+#include <string.h>
+
+/* Input held back before looking for a cut, more while there is none. */
+#define WINDOW_HELD 131072
+
+static bool reservePending(windower_t *windower, size_t numTokens) {
+    if (windower->numPending + numTokens <= windower->capacity) {
+        return true;
+    }
+    size_t capacity = windower->capacity ? windower->capacity * 2 : 1024;
+    while (capacity < windower->numPending + numTokens) {
+        capacity *= 2;
+    }
+    uint32_t *tokens = realloc(windower->tokens, capacity * sizeof(uint32_t));
+    if (tokens == NULL) {
+        return false;
+    }
+    windower->tokens = tokens;
+    uint64_t *offsets = realloc(windower->offsets,
+                                capacity * sizeof(uint64_t));
+    if (offsets == NULL) {
+        return false;
+    }
+    windower->offsets = offsets;
+    uint8_t *breaks = realloc(windower->breaks, capacity);
+    if (breaks == NULL) {
+        return false;
+    }
+    windower->breaks = breaks;
+    windower->capacity = capacity;
+    return true;
+}
+
+/*
+ * The break in front of a pre-token, from what came before it.  Then
+ * notes what this one means for the next.
+ */
+static uint8_t breakBefore(windower_t *windower, const char *word,
+                           size_t length) {
+    uint8_t kind = BREAK_WORD;
+    if (windower->newlineRun > 1) {
+        kind = BREAK_PARAGRAPH;
+    } else if (windower->newlineRun == 1 ||
+               (windower->sentenceEnd && isspace((unsigned char) word[0]))) {
+        kind = BREAK_SENTENCE;
+    }
+    size_t newlines = 0;
+    bool space = true;
+    for (size_t idx = 0; idx < length && space; idx++) {
+        newlines += word[idx] == '\n';
+        space = isspace((unsigned char) word[idx]);
+    }
+    windower->newlineRun = space ? windower->newlineRun + newlines : 0;
+    /* Closing quotes and brackets come in the same pre-token. */
+    size_t end = length;
+    while (end > 1 && strchr("\"')]", word[end - 1]) != NULL) {
+        end--;
+    }
+    windower->sentenceEnd = !space && strchr(".!?", word[end - 1]) != NULL;
+    return kind;
+}
+
+/* The latest of the best breaks in front of tokens lower up to upper. */
+static size_t bestBreak(const windower_t *windower, size_t lower,
+                        size_t upper) {
+    size_t best = upper;
+    for (size_t idx = upper; idx-- > lower;) {
+        if (windower->breaks[idx] > windower->breaks[best]) {
+            best = idx;
+        }
+    }
+    return best;
+}
+
+/* Emits the window at the front and drops the tokens in front of the
+   next one. */
+static void cutWindow(windower_t *windower) {
+    const windowConfig_t *config = &windower->config;
+    size_t end = bestBreak(windower, config->maxTokens - config->slack,
+                           config->maxTokens);
+    config->onWindow(windower->tokens, end, windower->offsets[0],
+                     windower->offsets[end], config->ctx);
+    windower->numWindows++;
+    size_t next = end;
+    if (config->stride < end) {
+        next = bestBreak(windower, config->stride - config->slack,
+                         config->stride);
+    }
+    windower->numPending -= next;
+    memmove(windower->tokens, windower->tokens + next,
+            windower->numPending * sizeof(uint32_t));
+    memmove(windower->offsets, windower->offsets + next,
+            windower->numPending * sizeof(uint64_t));
+    memmove(windower->breaks, windower->breaks + next,
+            windower->numPending);
+}
+
+static void collectTokens(const uint32_t *tokens, size_t numTokens,
+                          size_t offset, size_t length, void *ctx) {
+    windower_t *windower = (windower_t *) ctx;
+    if (windower->failed || !reservePending(windower, numTokens)) {
+        windower->failed = true;
+        return;
+    }
+    const char *word = windower->encoding + offset;
+    uint64_t start = windower->consumed + offset;
+    size_t pending = windower->numPending;
+    windower->breaks[pending] = breakBefore(windower, word, length);
+    for (size_t idx = 0; idx < numTokens; idx++) {
+        windower->tokens[pending + idx] = tokens[idx];
+        windower->offsets[pending + idx] = start;
+        if (idx + 1 < numTokens) {
+            /* Only a window cut inside the pre-token needs this. */
+            char bytes[MAX_TOKEN_BYTES];
+            size_t tokenLen = 0;
+            DecodeTokenBytes(tokens[idx], bytes, &tokenLen);
+            start += tokenLen;
+            windower->breaks[pending + idx + 1] = BREAK_NONE;
+        }
+    }
+    windower->numPending += numTokens;
+    while (windower->numPending > windower->config.maxTokens) {
+        cutWindow(windower);
+    }
+}
+
+/* Encodes the first `numBytes` held back and drops them. */
+static enum CODEC_STATUS encodeHeld(windower_t *windower, size_t numBytes) {
+    windower->encoding = windower->held;
+    enum CODEC_STATUS status = EncodeText32(windower->held, numBytes,
+                                            &windower->config.options,
+                                            collectTokens, windower);
+    if (status == CODEC_SUCCESS && windower->failed) {
+        status = ERR_WINDOW_MALLOC;
+    }
+    windower->consumed += numBytes;
+    windower->heldLen -= numBytes;
+    memmove(windower->held, windower->held + numBytes, windower->heldLen);
+    return status;
+}
+
+enum CODEC_STATUS WindowerInit(windower_t *windower,
+                               const windowConfig_t *config) {
+    memset(windower, 0, sizeof(windower_t));
+    if (config->maxTokens == 0 || config->stride == 0 ||
+        config->stride > config->maxTokens ||
+        config->slack >= config->stride || config->onWindow == NULL) {
+        return ERR_WINDOW_INVALID;
+    }
+    windower->config = *config;
+    /* The input starts a paragraph. */
+    windower->newlineRun = 2;
+    return CODEC_SUCCESS;
+}
+
+static bool growHeld(windower_t *windower) {
+    size_t capacity = windower->heldCap ? windower->heldCap * 2 : WINDOW_HELD;
+    char *held = realloc(windower->held, capacity);
+    if (held == NULL) {
+        return false;
+    }
+    windower->held = held;
+    windower->heldCap = capacity;
+    return true;
+}
+
+enum CODEC_STATUS WindowerPush(windower_t *windower, const char *text,
+                               size_t numBytes) {
+    /* Taken a buffer at a time, so a large push is not copied whole. */
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    while (numBytes != 0 && status == CODEC_SUCCESS) {
+        if (windower->heldLen == windower->heldCap) {
+            size_t cut = SplitterCutPoint(windower->held, windower->heldLen);
+            if (cut != 0) {
+                status = encodeHeld(windower, cut);
+            } else if (!growHeld(windower)) {
+                status = ERR_WINDOW_MALLOC;
+            }
+            continue;
+        }
+        size_t piece = windower->heldCap - windower->heldLen;
+        if (piece > numBytes) {
+            piece = numBytes;
+        }
+        memcpy(windower->held + windower->heldLen, text, piece);
+        windower->heldLen += piece;
+        text += piece;
+        numBytes -= piece;
+    }
+    return status;
+}
+
+enum CODEC_STATUS WindowerFinish(windower_t *windower) {
+    enum CODEC_STATUS status = CODEC_SUCCESS;
+    if (windower->heldLen != 0) {
+        status = encodeHeld(windower, windower->heldLen);
+    }
+    /* The last window, always with tokens the one before it left out. */
+    if (status == CODEC_SUCCESS && windower->numPending != 0) {
+        const windowConfig_t *config = &windower->config;
+        config->onWindow(windower->tokens, windower->numPending,
+                         windower->offsets[0], windower->consumed,
+                         config->ctx);
+        windower->numWindows++;
+        windower->numPending = 0;
+    }
+    return status;
+}
+
+void WindowerFree(windower_t *windower) {
+    free(windower->tokens);
+    free(windower->offsets);
+    free(windower->breaks);
+    free(windower->held);
+    memset(windower, 0, sizeof(windower_t));
+}
@@ -0,0 +1,81 @@
+//
+// Cuts the encoding of a long input into overlapping windows of tokens,
+// each with the byte range of the input it covers.
+//
+
+#ifndef GPT2_CODEC_WINDOWER_H
+#define GPT2_CODEC_WINDOWER_H
+
+#include "library.h"
+
+/* How good a place to cut the boundary in front of a token is. */
+enum WINDOW_BREAK {
+    BREAK_NONE,                  /* inside a pre-token */
+    BREAK_WORD,
+    BREAK_SENTENCE,              /* after . ! or ? and before white space,
+                                    or after a line break */
+    BREAK_PARAGRAPH              /* after a blank line */
+};
+
+/*
+ * Receives one window: `numTokens` tokens encoded from the input bytes
+ * `begin` up to `end`, counted from the first byte ever pushed.  The
+ * tokens are only valid during the call.
+ */
+typedef void (*windowSink_t)(const uint32_t *tokens, size_t numTokens,
+                             uint64_t begin, uint64_t end, void *ctx);
+
+/*
+ * Every window but the last holds between maxTokens - slack and maxTokens
+ * tokens, and ends at the best break in that range, the latest of equally
+ * good ones.  The next window starts `stride` tokens after this one, or
+ * up to `slack` tokens earlier at a better break, but never after it
+ * ends.  So a stride of maxTokens gives windows that do not overlap.
+ */
+typedef struct {
+    size_t maxTokens;
+    size_t stride;               /* 1 up to maxTokens */
+    size_t slack;                /* less than the stride, 0 to cut at token
+                                    counts alone */
+    encodeOptions_t options;
+    windowSink_t onWindow;
+    void *ctx;
+} windowConfig_t;
+
+/*
+ * The tokens from the start of the next window on, at most maxTokens plus
+ * one pre-token, and the input from the last cut that no pre-token
+ * straddles.  Memory stays bounded however long the input is, unless a
+ * single pre-token is.
+ */
+typedef struct {
+    windowConfig_t config;
+    uint32_t *tokens;
+    uint64_t *offsets;           /* input offset of each token */
+    uint8_t *breaks;             /* enum WINDOW_BREAK in front of each */
+    size_t numPending;
+    size_t capacity;
+    char *held;                  /* input not encoded yet */
+    size_t heldLen;
+    size_t heldCap;
+    uint64_t consumed;           /* input bytes in front of held */
+    const char *encoding;        /* the part of held being encoded */
+    size_t newlineRun;           /* newlines in the white space just seen */
+    bool sentenceEnd;            /* the last pre-token ended a sentence */
+    bool failed;
+    size_t numWindows;
+} windower_t;
+
+enum CODEC_STATUS WindowerInit(windower_t *windower,
+                               const windowConfig_t *config);
+
+/* Feeds the next `numBytes` of the input, in pieces of any size. */
+enum CODEC_STATUS WindowerPush(windower_t *windower, const char *text,
+                               size_t numBytes);
+
+/* Encodes the rest of the input and emits the last windows. */
+enum CODEC_STATUS WindowerFinish(windower_t *windower);
+
+void WindowerFree(windower_t *windower);
+
+#endif //GPT2_CODEC_WINDOWER_H
@@ -0,0 +1,211 @@
+//
+// A word cache in shared memory, so that processes encoding with the same
+// vocabulary merge each pre-token once between them.
+//
+// The table is open-addressed with a short probe and a fixed size: it
+// never grows or rehashes, and entries are only ever overwritten in place
+// under their version, so there is nothing to lock.  When every slot of a
+// probe is taken, one of them is evicted.
+//
+
+#include "wordcache.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Slots looked at from the home slot, four cache lines. */
+#define WORD_CACHE_WAYS 4
+#define WORD_CACHE_MIN_SLOTS 64
+/* Bumped whenever the slot layout changes. */
+#define WORD_CACHE_FORMAT 1
+
+_Static_assert(sizeof(wordCacheSlot_t) == 64, "a slot is one cache line");
+_Static_assert(sizeof(wordCacheHeader_t) == 64, "so is the header");
+
+/*
+ * Everything the cached tokens depend on: the vocabulary files as loaded,
+ * the id width and the number of slots.  Special tokens are left out,
+ * pre-tokens never contain them.
+ */
+static uint64_t cacheLayout(const codecTables_t *tables, uint32_t numSlots) {
+    uint32_t vocabHash = genHash(tables->strings, tables->vocabLen, 0);
+    unsigned int slotBits = 0;
+    while ((1u << slotBits) < numSlots) {
+        slotBits++;
+    }
+    return (uint64_t) vocabHash << 32 | slotBits << 16 |
+           tables->idBits << 8 | WORD_CACHE_FORMAT;
+}
+
+static void *mapSegment(const char *name, size_t numBytes, size_t *mapped) {
+    if (name == NULL) {
+        *mapped = numBytes;
+        return mmap(NULL, numBytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    int fd = shm_open(name, numBytes != 0 ? O_RDWR | O_CREAT : O_RDWR,
+                      0600);
+    if (fd < 0) {
+        return MAP_FAILED;
+    }
+    /* A new segment is sized by whoever gets here first; it reads as all
+       zeroes, an empty table. */
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (st.st_size == 0 && numBytes != 0 &&
+         (ftruncate(fd, (off_t) numBytes) != 0 || fstat(fd, &st) != 0)) ||
+        st.st_size == 0) {
+        close(fd);
+        return MAP_FAILED;
+    }
+    *mapped = (size_t) st.st_size;
+    void *segment = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+    close(fd);
+    return segment;
+}
+
+enum CODEC_STATUS WordCacheOpen(const codecTables_t *tables, const char *name,
+                                size_t numBytes, wordCache_t **cache) {
+    if (name == NULL && numBytes == 0) {
+        return ERR_CACHE_INVALID;
+    }
+    wordCache_t *opened = calloc(1, sizeof(wordCache_t));
+    if (opened == NULL) {
+        return ERR_CACHE_MALLOC;
+    }
+    void *segment = mapSegment(name, numBytes, &opened->mapped);
+    if (segment == MAP_FAILED) {
+        free(opened);
+        return ERR_CACHE_OPEN;
+    }
+    size_t numSlots = WORD_CACHE_MIN_SLOTS;
+    while (sizeof(wordCacheHeader_t) +
+           2 * numSlots * sizeof(wordCacheSlot_t) <= opened->mapped &&
+           2 * numSlots <= (size_t) 1 << 31) {
+        numSlots *= 2;
+    }
+    opened->header = (wordCacheHeader_t *) segment;
+    opened->slots = (wordCacheSlot_t *) (opened->header + 1);
+    opened->mask = (uint32_t) numSlots - 1;
+    opened->idBytes = tables->idBits / 8;
+    uint64_t layout = cacheLayout(tables, (uint32_t) numSlots);
+    uint64_t found = 0;
+    if (sizeof(wordCacheHeader_t) + numSlots * sizeof(wordCacheSlot_t) >
+        opened->mapped) {
+        WordCacheClose(opened);
+        return ERR_CACHE_INVALID;
+    }
+    if (!atomic_compare_exchange_strong(&opened->header->layout, &found,
+                                        layout) && found != layout) {
+        WordCacheClose(opened);
+        return ERR_CACHE_MISMATCH;
+    }
+    *cache = opened;
+    return CODEC_SUCCESS;
+}
+
+void WordCacheClose(wordCache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    munmap(cache->header, cache->mapped);
+    free(cache);
+}
+
+/*
+ * Copies slot `index` to `entry`.  Returns its version, or an odd one if
+ * an insert was writing it meanwhile and the copy cannot be trusted.
+ */
+static uint32_t readSlot(const wordCache_t *cache, uint32_t index,
+                         wordCacheEntry_t *entry) {
+    wordCacheSlot_t *slot = &cache->slots[index];
+    uint32_t version = atomic_load_explicit(&slot->version,
+                                            memory_order_acquire);
+    if (version & 1) {
+        return version;
+    }
+    memcpy(entry, &slot->entry, sizeof(wordCacheEntry_t));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->version,
+                             memory_order_relaxed) != version) {
+        return 1;
+    }
+    return version;
+}
+
+static bool entryIs(const wordCacheEntry_t *entry, uint32_t hash,
+                    const char *word, size_t length) {
+    return entry->hash == hash && entry->length == length &&
+           memcmp(entry->key, word, length) == 0;
+}
+
+size_t WordCacheLookup(wordCache_t *cache, const char *word, size_t length,
+                       void *tokens) {
+    if (length < WORD_CACHE_MIN_BYTES || length > WORD_CACHE_KEY_BYTES) {
+        return 0;
+    }
+    uint32_t hash = genHash(word, (unsigned int) length, 0);
+    for (uint32_t way = 0; way < WORD_CACHE_WAYS; way++) {
+        wordCacheEntry_t entry;
+        uint32_t version = readSlot(cache, (hash + way) & cache->mask,
+                                    &entry);
+        if (version & 1) {
+            continue;
+        } else if (entry.length == 0) {
+            break;
+        } else if (entryIs(&entry, hash, word, length)) {
+            memcpy(tokens, entry.tokens, entry.numTokens * cache->idBytes);
+            return entry.numTokens;
+        }
+    }
+    return 0;
+}
+
+void WordCacheInsert(wordCache_t *cache, const char *word, size_t length,
+                     const void *tokens, size_t numTokens) {
+    if (length < WORD_CACHE_MIN_BYTES || length > WORD_CACHE_KEY_BYTES ||
+        numTokens * cache->idBytes > WORD_CACHE_TOKEN_BYTES) {
+        return;
+    }
+    uint32_t hash = genHash(word, (unsigned int) length, 0);
+    /* The first empty slot, or else the one this word evicts. */
+    uint32_t way = (hash >> 24) % WORD_CACHE_WAYS;
+    uint32_t index = (hash + way) & cache->mask;
+    uint32_t version = 1;
+    for (way = 0; way < WORD_CACHE_WAYS; way++) {
+        wordCacheEntry_t entry;
+        uint32_t probed = (hash + way) & cache->mask;
+        uint32_t seen = readSlot(cache, probed, &entry);
+        if (seen & 1) {
+            continue;
+        } else if (entry.length == 0) {
+            index = probed;
+            version = seen;
+            break;
+        } else if (entryIs(&entry, hash, word, length)) {
+            return;
+        } else if (probed == index) {
+            version = seen;
+        }
+    }
+    /* Claim the slot unless it changed since it was read. */
+    wordCacheSlot_t *slot = &cache->slots[index];
+    if ((version & 1) ||
+        !atomic_compare_exchange_strong_explicit(&slot->version, &version,
+                                                 version + 1,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    wordCacheEntry_t *entry = &slot->entry;
+    entry->hash = hash;
+    entry->length = (uint8_t) length;
+    entry->numTokens = (uint8_t) numTokens;
+    memcpy(entry->key, word, length);
+    memcpy(entry->tokens, tokens, numTokens * cache->idBytes);
+    atomic_store_explicit(&slot->version, version + 2, memory_order_release);
+}
@@ -0,0 +1,82 @@
+//
+// A word cache in shared memory, so that processes encoding with the same
+// vocabulary merge each pre-token once between them.
+//
+
+#ifndef GPT2_CODEC_WORDCACHE_H
+#define GPT2_CODEC_WORDCACHE_H
+
+#include "library.h"
+#include <stdatomic.h>
+
+/* Shorter words take a merge or two, cheaper than a trip to the cache. */
+#define WORD_CACHE_MIN_BYTES 4
+#define WORD_CACHE_KEY_BYTES 28
+#define WORD_CACHE_TOKEN_BYTES 24
+
+typedef struct {
+    uint32_t hash;
+    uint8_t length;              /* key bytes, 0 for an empty slot */
+    uint8_t numTokens;
+    uint16_t unused;
+    char key[WORD_CACHE_KEY_BYTES];
+    uint8_t tokens[WORD_CACHE_TOKEN_BYTES];   /* ids of the codec width */
+} wordCacheEntry_t;
+
+/*
+ * One cache line per entry.  Writers bump `version` to an odd value,
+ * write the entry and bump it again; a reader copies the entry and only
+ * trusts the copy if `version` was the same even value before and after.
+ * Nothing ever waits on an odd version: an insert that finds one gives
+ * up, and a lookup treats it as a miss.  So a process that dies half way
+ * through an insert costs the cache that one slot and nothing more.
+ */
+typedef struct {
+    _Atomic uint32_t version;    /* odd while an insert is writing */
+    wordCacheEntry_t entry;
+} wordCacheSlot_t;
+
+/*
+ * The segment starts with this header, padded to a cache line.  `layout`
+ * stays zero until the first process to attach stores the vocabulary
+ * fingerprint and table size in it; everyone after must agree with it.
+ */
+typedef struct {
+    _Atomic uint64_t layout;
+    char unused[56];
+} wordCacheHeader_t;
+
+struct wordCacheStruct {
+    wordCacheHeader_t *header;   /* the mapped segment */
+    wordCacheSlot_t *slots;
+    size_t mapped;               /* bytes */
+    uint32_t mask;               /* slots - 1, a power of two */
+    unsigned int idBytes;
+};
+
+/*
+ * Maps the cache for `tables`.  With a name the segment is shm_open()ed,
+ * created with `numBytes` if it does not exist yet, so unrelated processes
+ * can share it; a numBytes of 0 only attaches to an existing one.  Without
+ * a name the mapping is anonymous and shared with the children forked
+ * after this.  Fails with ERR_CACHE_MISMATCH if the segment was laid out
+ * for a different vocabulary.
+ */
+enum CODEC_STATUS WordCacheOpen(const codecTables_t *tables, const char *name,
+                                size_t numBytes, wordCache_t **cache);
+
+/* Unmaps the cache, the named segment stays for the other processes. */
+void WordCacheClose(wordCache_t *cache);
+
+/*
+ * Copies the tokens of `word` to `tokens` and returns how many there are,
+ * or 0 when it is not cached.
+ */
+size_t WordCacheLookup(wordCache_t *cache, const char *word, size_t length,
+                       void *tokens);
+
+/* Adds a merged word, unless it or its tokens are too long for a slot. */
+void WordCacheInsert(wordCache_t *cache, const char *word, size_t length,
+                     const void *tokens, size_t numTokens);
+
+#endif //GPT2_CODEC_WORDCACHE_H